@@ -0,0 +1,142 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "kernels.h"
+#include "scene.h"
+#include "threadpool.h"
+
+#define SPHERE_COUNT 4096
+#define RAY_COUNT 4096
+#define DEFAULT_ROUNDS 200
+
+// Deterministic xorshift, so every run benchmarks the same data
+static unsigned long long benchState = 0x2545f4914f6cdd1dULL;
+
+double nextRandom(double min, double max);
+real* column(size_t count, double min, double max);
+
+int main(int argc, char const *argv[]) {
+    size_t rounds = DEFAULT_ROUNDS;
+    if(argc > 1) {
+        rounds = strtoul(argv[1], NULL, 10);
+        if(rounds == 0) {
+            fprintf(stderr, "usage: kernelbench [rounds]\n");
+            return 1;
+        }
+    }
+
+    sceneSpheres spheres = { 0 };
+    spheres.count = SPHERE_COUNT;
+    spheres.posX = column(SPHERE_COUNT, -10, 10);
+    spheres.posY = column(SPHERE_COUNT, -10, 10);
+    spheres.posZ = column(SPHERE_COUNT, 5, 30);
+    spheres.radius = column(SPHERE_COUNT, 0.5, 3);
+    spheres.radius2 = column(SPHERE_COUNT, 0, 0);
+    for(size_t i = 0; i < SPHERE_COUNT; i++) {
+        spheres.radius2[i] = spheres.radius[i] * spheres.radius[i];
+    }
+
+    vector3d origin = { 0 };
+    vector3d* dirs = malloc(sizeof(*dirs) * RAY_COUNT);
+    if(dirs == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return 1;
+    }
+    for(size_t i = 0; i < RAY_COUNT; i++) {
+        vector3d dir = { nextRandom(-0.5, 0.5), nextRandom(-0.5, 0.5), 1 };
+        dirs[i] = vector3d_normalize(dir);
+    }
+
+    static const size_t batches[] = { 4, 8, 16 };
+    double scalarNs[3] = { 0 };
+
+    printf("%-8s %6s %12s %10s %8s\n", "kernel", "batch", "ns/batch",
+        "ns/sphere", "speedup");
+    for(int kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+        if(!kernel_supported(kernel)) {
+            printf("%-8s (not supported by this CPU)\n", kernel_name(kernel));
+            continue;
+        }
+        sphereKernel func = kernel_get(kernel);
+
+        for(size_t b = 0; b < sizeof(batches) / sizeof(*batches); b++) {
+            size_t batch = batches[b];
+            size_t groups = SPHERE_COUNT / batch;
+            size_t calls = 0;
+            double checksum = 0;
+            size_t mismatches = 0;
+            size_t rejected = 0;
+
+            double start = threadpool_now();
+            for(size_t round = 0; round < rounds; round++) {
+                for(size_t r = 0; r < RAY_COUNT; r++) {
+                    size_t group = (r * 31 + round) % groups;
+                    real t;
+                    size_t index;
+                    if(func(&spheres, group * batch, batch, origin, dirs[r], 0,
+                            INFINITY, &t, &index, &rejected)) {
+                        checksum += t + index;
+                    }
+                    calls++;
+                }
+            }
+            double elapsed = threadpool_now() - start;
+
+            // Every variant must agree with the scalar kernel exactly
+            for(size_t r = 0; r < RAY_COUNT; r++) {
+                size_t group = (r * 31) % groups;
+                real t = 0, expectT = 0;
+                size_t index = 0, expectIndex = 0;
+                int hit = func(&spheres, group * batch, batch, origin, dirs[r],
+                    0, INFINITY, &t, &index, &rejected);
+                int expectHit = spheres_nearest_scalar(&spheres, group * batch,
+                    batch, origin, dirs[r], 0, INFINITY, &expectT, &expectIndex,
+                    &rejected);
+                if(hit != expectHit || (hit && (t != expectT ||
+                        index != expectIndex))) {
+                    mismatches++;
+                }
+            }
+
+            double ns = elapsed * 1e9 / calls;
+            if(kernel == KERNEL_SCALAR) {
+                scalarNs[b] = ns;
+            }
+            printf("%-8s %6zu %12.2f %10.3f %7.2fx%s\n", kernel_name(kernel),
+                batch, ns, ns / batch, scalarNs[b] / ns,
+                mismatches > 0 ? "  MISMATCH" : "");
+            // Keep the work observable so it isn't optimized away
+            if(checksum < 0) {
+                printf("%f\n", checksum);
+            }
+            if(mismatches > 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+double nextRandom(double min, double max) {
+    benchState ^= benchState << 13;
+    benchState ^= benchState >> 7;
+    benchState ^= benchState << 17;
+
+    return min + (max - min) * ((benchState >> 11) * (1.0 / 9007199254740992.0));
+}
+
+real* column(size_t count, double min, double max) {
+    real* values = malloc(sizeof(*values) * count);
+    if(values == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < count; i++) {
+        values[i] = nextRandom(min, max);
+    }
+
+    return values;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+// Compares two P6 images of the same size, such as the double and
+// single-precision renders of one scene (see 'make compare'), and reports the
+// largest difference seen in each channel.
+
+typedef struct image {
+    size_t width;
+    size_t height;
+    unsigned char* data;
+} image;
+
+int readImage(const char* path, image* image);
+int readField(FILE* file, size_t* value);
+
+int main(int argc, char const *argv[]) {
+    if(argc != 3) {
+        fprintf(stderr, "usage: ppmdiff /path/to/first.ppm /path/to/second.ppm\n");
+        return 1;
+    }
+
+    image first, second;
+    if(readImage(argv[1], &first) < 0 || readImage(argv[2], &second) < 0) {
+        return 1;
+    }
+    if(first.width != second.width || first.height != second.height) {
+        fprintf(stderr, "Error: Images are %zux%zu and %zux%zu\n", first.width,
+            first.height, second.width, second.height);
+        return 1;
+    }
+
+    static const char* channels[3] = { "red", "green", "blue" };
+    int maxDiff[3] = { 0 };
+    size_t differing = 0;
+    size_t pixels = first.width * first.height;
+
+    for(size_t i = 0; i < pixels; i++) {
+        int differs = 0;
+        for(size_t c = 0; c < 3; c++) {
+            int diff = abs(first.data[i * 3 + c] - second.data[i * 3 + c]);
+            if(diff > maxDiff[c]) {
+                maxDiff[c] = diff;
+            }
+            differs |= diff != 0;
+        }
+        differing += differs;
+    }
+
+    printf("%s vs %s:", argv[1], argv[2]);
+    for(size_t c = 0; c < 3; c++) {
+        printf(" %s %d%s", channels[c], maxDiff[c], c < 2 ? "," : "");
+    }
+    printf(" (%zu of %zu pixels differ)\n", differing, pixels);
+
+    free(first.data);
+    free(second.data);
+
+    return 0;
+}
+
+int readImage(const char* path, image* image) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        return -1;
+    }
+
+    size_t maxColor;
+    if(fgetc(file) != 'P' || fgetc(file) != '6' ||
+            readField(file, &(image->width)) < 0 ||
+            readField(file, &(image->height)) < 0 ||
+            readField(file, &maxColor) < 0 || maxColor != 255) {
+        fprintf(stderr, "Error: '%s' is not an 8-bit P6 image\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    size_t size = image->width * image->height * 3;
+    image->data = malloc(size + 1);
+    if(image->data == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        fclose(file);
+        return -1;
+    }
+    if(fread(image->data, 1, size, file) != size) {
+        fprintf(stderr, "Error: '%s' ends early\n", path);
+        free(image->data);
+        fclose(file);
+        return -1;
+    }
+
+    fclose(file);
+
+    return 0;
+}
+
+// Reads one header number, skipping whitespace and '#' comments, along with
+// the single whitespace character that ends it
+int readField(FILE* file, size_t* value) {
+    int c = fgetc(file);
+    while(isspace(c) || c == '#') {
+        if(c == '#') {
+            while(c != '\n' && c != EOF) {
+                c = fgetc(file);
+            }
+        }
+        c = fgetc(file);
+    }
+
+    if(!isdigit(c)) {
+        return -1;
+    }
+    *value = 0;
+    while(isdigit(c)) {
+        *value = *value * 10 + (c - '0');
+        c = fgetc(file);
+    }
+
+    return isspace(c) ? 0 : -1;
+}
@@ -0,0 +1,236 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "json.h"
+#include "kernels.h"
+#include "raycast.h"
+#include "scenegen.h"
+#include "threadpool.h"
+#include "write.h"
+
+// Renders generated scenes end to end and prints the timings as JSON, so
+// results can be diffed across releases. With no scene options the fixed
+// suite below is run; otherwise one custom scene is.
+
+typedef struct benchScene {
+    const char* name;
+    sceneParams params;
+} benchScene;
+
+static const benchScene suite[] = {
+    { "small", { 50, 1, 2, 0.2, 320, 240, 1 } },
+    { "medium", { 2000, 2, 3, 0.3, 480, 360, 2 } },
+    { "large", { 20000, 3, 4, 0.3, 480, 360, 3 } },
+    { "mirrors", { 500, 2, 2, 0.9, 480, 360, 4 } }
+};
+
+int runScene(const benchScene* bench, renderOptions options, const char* dir,
+    int last);
+int parseCount(const char* str, size_t* value);
+
+int main(int argc, char const *argv[]) {
+    benchScene custom = { "custom", { 1000, 1, 2, 0.3, 480, 360, 1 } };
+    int useCustom = 0;
+    renderOptions options = defaultRenderOptions();
+
+    for(int i = 1; i < argc; i++) {
+        size_t* target = NULL;
+        if(strcmp(argv[i], "--spheres") == 0) {
+            target = &(custom.params.spheres);
+        }
+        else if(strcmp(argv[i], "--planes") == 0) {
+            target = &(custom.params.planes);
+        }
+        else if(strcmp(argv[i], "--lights") == 0) {
+            target = &(custom.params.lights);
+        }
+        else if(strcmp(argv[i], "--width") == 0) {
+            target = &(custom.params.width);
+        }
+        else if(strcmp(argv[i], "--height") == 0) {
+            target = &(custom.params.height);
+        }
+        else if(strcmp(argv[i], "--threads") == 0) {
+            if(i + 1 >= argc || parseCount(argv[++i], &(options.threads)) < 0) {
+                fprintf(stderr, "Error: '--threads' requires a thread count\n");
+                return 1;
+            }
+            continue;
+        }
+        else if(strcmp(argv[i], "--reflective") == 0) {
+            char* endptr;
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Error: '--reflective' requires a fraction\n");
+                return 1;
+            }
+            custom.params.reflective = strtod(argv[++i], &endptr);
+            if(*endptr != '\0' || custom.params.reflective < 0 ||
+                    custom.params.reflective > 1) {
+                fprintf(stderr, "Error: '--reflective' must be from 0 to 1\n");
+                return 1;
+            }
+            useCustom = 1;
+            continue;
+        }
+        else if(strcmp(argv[i], "--seed") == 0) {
+            size_t seed;
+            if(i + 1 >= argc || parseCount(argv[++i], &seed) < 0) {
+                fprintf(stderr, "Error: '--seed' requires a number\n");
+                return 1;
+            }
+            custom.params.seed = seed;
+            useCustom = 1;
+            continue;
+        }
+        else {
+            fprintf(stderr, "usage: renderbench [--threads N] [--spheres N] "
+                "[--planes N] [--lights N] [--reflective F] [--width N] "
+                "[--height N] [--seed N]\n");
+            return 1;
+        }
+
+        if(i + 1 >= argc || parseCount(argv[++i], target) < 0) {
+            fprintf(stderr, "Error: '%s' requires a count\n", argv[i - 1]);
+            return 1;
+        }
+        useCustom = 1;
+    }
+
+    if(custom.params.width == 0 || custom.params.height == 0) {
+        fprintf(stderr, "Error: Width and height must be at least 1\n");
+        return 1;
+    }
+
+    if(kernel_init(KERNEL_AUTO) < 0) {
+        return 1;
+    }
+
+    const char* dir = getenv("TMPDIR");
+    if(dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+
+    size_t threads = options.threads != 0 ? options.threads : threadpool_cores();
+    printf("{\n");
+    printf("  \"threads\": %zu,\n", threads);
+    printf("  \"kernel\": \"%s\",\n", kernel_name(kernel_best()));
+    printf("  \"precision\": \"%s\",\n",
+        sizeof(real) == sizeof(float) ? "single" : "double");
+    printf("  \"scenes\": [\n");
+
+    if(useCustom) {
+        if(runScene(&custom, options, dir, 1) < 0) {
+            return 1;
+        }
+    }
+    else {
+        size_t count = sizeof(suite) / sizeof(*suite);
+        for(size_t i = 0; i < count; i++) {
+            if(runScene(&(suite[i]), options, dir, i + 1 == count) < 0) {
+                return 1;
+            }
+        }
+    }
+
+    printf("  ]\n");
+    printf("}\n");
+
+    return 0;
+}
+
+int runScene(const benchScene* bench, renderOptions options, const char* dir,
+        int last) {
+    sceneParams params = bench->params;
+    renderStats stats = { 0 };
+    options.stats = &stats;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/renderbench-%ld-%s.json", dir,
+        (long)getpid(), bench->name);
+    if(generateScene(path, params) < 0) {
+        return -1;
+    }
+
+    double start = threadpool_now();
+    jsonObj jsonObj = readScene(path);
+    double parsed = threadpool_now();
+    scene scene = buildScene(jsonObj.objs, jsonObj.lights, jsonObj.groups,
+        jsonObj.instances);
+    double built = threadpool_now();
+    remove(path);
+
+    pixel* pixels = malloc(sizeof(*pixels) * params.width * params.height);
+    if(pixels == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return -1;
+    }
+
+    double renderStart = threadpool_now();
+    raycast(pixels, params.width, params.height, jsonObj.camera, &scene,
+        options);
+    double rendered = threadpool_now();
+
+    // Write to a real file so the timing includes the file system
+    snprintf(path, sizeof(path), "%s/renderbench-%ld-%s.ppm", dir,
+        (long)getpid(), bench->name);
+    FILE* outputFd = fopen(path, "w");
+    if(outputFd == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        free(pixels);
+        return -1;
+    }
+    pnmHeader header = { 6, params.width, params.height, 255 };
+    double writeStart = threadpool_now();
+    if(writeHeader(header, outputFd) < 0 ||
+            writeBody(header, pixels, outputFd, 0) < 0 ||
+            fclose(outputFd) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        free(pixels);
+        return -1;
+    }
+    double written = threadpool_now();
+    remove(path);
+    free(pixels);
+
+    double renderSeconds = rendered - renderStart;
+    size_t rays = stats.primaryRays + stats.secondaryRays + stats.shadowRays;
+
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", bench->name);
+    printf("      \"spheres\": %zu,\n", params.spheres);
+    printf("      \"planes\": %zu,\n", params.planes);
+    printf("      \"lights\": %zu,\n", params.lights);
+    printf("      \"reflective\": %.3f,\n", params.reflective);
+    printf("      \"width\": %zu,\n", params.width);
+    printf("      \"height\": %zu,\n", params.height);
+    printf("      \"seed\": %llu,\n", params.seed);
+    printf("      \"parse_ms\": %.3f,\n", (parsed - start) * 1e3);
+    printf("      \"build_ms\": %.3f,\n", (built - parsed) * 1e3);
+    printf("      \"render_ms\": %.3f,\n", renderSeconds * 1e3);
+    printf("      \"write_ms\": %.3f,\n", (written - writeStart) * 1e3);
+    printf("      \"primary_rays\": %zu,\n", stats.primaryRays);
+    printf("      \"secondary_rays\": %zu,\n", stats.secondaryRays);
+    printf("      \"shadow_rays\": %zu,\n", stats.shadowRays);
+    printf("      \"rays_per_sec\": %.0f,\n",
+        renderSeconds > 0 ? rays / renderSeconds : 0.0);
+    printf("      \"ns_per_ray\": %.3f\n",
+        rays > 0 ? renderSeconds * 1e9 / rays : 0.0);
+    printf("    }%s\n", last ? "" : ",");
+    fflush(stdout);
+
+    return 0;
+}
+
+int parseCount(const char* str, size_t* value) {
+    char* endptr;
+    *value = strtoul(str, &endptr, 10);
+    if(!(*str != '\0' && *endptr == '\0')) {
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "scenegen.h"
+
+// Planes beyond the floor close the scene in, starting with the back wall
+static const double planeTemplates[][6] = {
+    // position, normal
+    { 0, -4, 0, 0, 1, 0 },
+    { 0, 0, 40, 0, 0, -1 },
+    { -14, 0, 0, 1, 0, 0 },
+    { 14, 0, 0, -1, 0, 0 },
+    { 0, 14, 0, 0, -1, 0 }
+};
+
+double nextUniform(unsigned long long* state, double min, double max);
+
+int generateScene(const char* path, sceneParams params) {
+    FILE* json = fopen(path, "w");
+    if(json == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        return -1;
+    }
+
+    // xorshift gets stuck on a zero state
+    unsigned long long state = params.seed * 0x9e3779b97f4a7c15ULL + 1;
+    double aspect = params.width > 0 ? (double)params.height / params.width : 1;
+    // Grow the volume with the sphere count, so density stays about the same
+    double depth = 4 + 2 * cbrt((double)params.spheres);
+
+    fprintf(json, "[\n");
+    fprintf(json, "    {\n        \"type\": \"camera\",\n"
+        "        \"width\": 2,\n        \"height\": %.6g\n    }", 2 * aspect);
+
+    for(size_t i = 0; i < params.spheres; i++) {
+        fprintf(json, ",\n    {\n        \"type\": \"sphere\",\n");
+        fprintf(json, "        \"diffuse_color\": [%.4f, %.4f, %.4f],\n",
+            nextUniform(&state, 0, 1), nextUniform(&state, 0, 1),
+            nextUniform(&state, 0, 1));
+        fprintf(json, "        \"specular_color\": [1, 1, 1],\n");
+        fprintf(json, "        \"position\": [%.4f, %.4f, %.4f],\n",
+            nextUniform(&state, -8, 8), nextUniform(&state, -3, 6),
+            nextUniform(&state, 4, 4 + depth));
+        if(nextUniform(&state, 0, 1) < params.reflective) {
+            fprintf(json, "        \"reflectivity\": %.4f,\n",
+                nextUniform(&state, 0.2, 0.8));
+        }
+        fprintf(json, "        \"radius\": %.4f\n    }",
+            nextUniform(&state, 0.1, 0.6));
+    }
+
+    size_t templates = sizeof(planeTemplates) / sizeof(*planeTemplates);
+    for(size_t i = 0; i < params.planes; i++) {
+        const double* plane = planeTemplates[i % templates];
+        // Extra planes past the templates are stacked further out
+        double shift = 4.0 * (i / templates);
+        fprintf(json, ",\n    {\n        \"type\": \"plane\",\n");
+        fprintf(json, "        \"diffuse_color\": [%.4f, %.4f, %.4f],\n",
+            nextUniform(&state, 0.2, 1), nextUniform(&state, 0.2, 1),
+            nextUniform(&state, 0.2, 1));
+        fprintf(json, "        \"position\": [%.4f, %.4f, %.4f],\n",
+            plane[0] - plane[3] * shift, plane[1] - plane[4] * shift,
+            plane[2] - plane[5] * shift);
+        fprintf(json, "        \"normal\": [%g, %g, %g]\n    }", plane[3],
+            plane[4], plane[5]);
+    }
+
+    for(size_t i = 0; i < params.lights; i++) {
+        fprintf(json, ",\n    {\n        \"type\": \"light\",\n");
+        fprintf(json, "        \"position\": [%.4f, %.4f, %.4f],\n",
+            nextUniform(&state, -8, 8), nextUniform(&state, 6, 12),
+            nextUniform(&state, 0, 4 + depth));
+        fprintf(json, "        \"color\": [%.4f, %.4f, %.4f],\n",
+            nextUniform(&state, 0.5, 1.5), nextUniform(&state, 0.5, 1.5),
+            nextUniform(&state, 0.5, 1.5));
+        // Every other light is a spot light pointing down into the scene
+        if(i % 2 == 1) {
+            fprintf(json, "        \"direction\": [0, -1, 1],\n");
+            fprintf(json, "        \"theta\": 40,\n");
+            fprintf(json, "        \"angular-a0\": 2,\n");
+        }
+        else {
+            fprintf(json, "        \"theta\": 0,\n");
+        }
+        fprintf(json, "        \"radial-a2\": 0.01,\n"
+            "        \"radial-a1\": 0.05,\n"
+            "        \"radial-a0\": 0.5\n    }");
+    }
+    fprintf(json, "\n]\n");
+
+    if(fclose(json) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+double nextUniform(unsigned long long* state, double min, double max) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return min + (max - min) * ((*state >> 11) * (1.0 / 9007199254740992.0));
+}
@@ -0,0 +1,22 @@
+#ifndef CS430_SCENEGEN_H
+#define CS430_SCENEGEN_H
+
+#include <stddef.h>
+
+typedef struct sceneParams {
+    size_t spheres;
+    size_t planes;
+    size_t lights;
+    // Fraction of spheres given a nonzero reflectivity
+    double reflective;
+    // Image size, used to match the camera's aspect ratio
+    size_t width;
+    size_t height;
+    unsigned long long seed;
+} sceneParams;
+
+// Writes a random scene to 'path' in the format readScene() expects. The same
+// parameters always produce the same file.
+int generateScene(const char* path, sceneParams params);
+
+#endif // CS430_SCENEGEN_H
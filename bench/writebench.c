@@ -0,0 +1,315 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "png.h"
+#include "pnm.h"
+#include "qoi.h"
+#include "threadpool.h"
+#include "write.h"
+
+// Times writing an image to a real file through each output path and prints
+// MB/s, next to how the writer used to do it: one 1-byte fwrite() per P6
+// channel, and four fprintf() calls per P3 pixel. Every PPM path has to
+// produce the same file as the old one, which is checked byte for byte. MB/s
+// counts the raw pixels, so compressed formats compare on the same work.
+
+#define DEFAULT_SIZE 4096
+#define DEFAULT_ROUNDS 3
+// Rows per band handed to the writer thread, about a tile row
+#define PIPELINE_ROWS 64
+
+typedef int (*writeFunc)(const char* path, pnmHeader header,
+    const pixel* pixels);
+
+typedef struct writeMethod {
+    const char* name;
+    const char* format;
+    int mode;
+    writeFunc func;
+} writeMethod;
+
+int writePerChannel(const char* path, pnmHeader header, const pixel* pixels);
+int writePrintf(const char* path, pnmHeader header, const pixel* pixels);
+int writeBulk(const char* path, pnmHeader header, const pixel* pixels);
+int writeMapped(const char* path, pnmHeader header, const pixel* pixels);
+int writePipelined(const char* path, pnmHeader header, const pixel* pixels);
+int writeQoi(const char* path, pnmHeader header, const pixel* pixels);
+int writePng(const char* path, pnmHeader header, const pixel* pixels);
+int sameFile(const char* first, const char* second);
+double fileMegabytes(const char* path);
+
+// The first method of each format is the baseline for the rest
+static const writeMethod methods[] = {
+    { "per-channel", "P6", 6, writePerChannel },
+    { "bulk", "P6", 6, writeBulk },
+    { "mmap", "P6", 6, writeMapped },
+    { "pipeline", "P6", 6, writePipelined },
+    { "printf", "P3", 3, writePrintf },
+    { "table", "P3", 3, writeBulk },
+    { "pipeline", "P3", 3, writePipelined },
+    { "stripes", "QOI", 6, writeQoi },
+    { "stripes", "PNG", 6, writePng }
+};
+
+int main(int argc, char const *argv[]) {
+    size_t size = DEFAULT_SIZE;
+    size_t rounds = DEFAULT_ROUNDS;
+    if(argc > 1) {
+        size = strtoul(argv[1], NULL, 10);
+    }
+    if(argc > 2) {
+        rounds = strtoul(argv[2], NULL, 10);
+    }
+    if(argc > 3 || size == 0 || rounds == 0) {
+        fprintf(stderr, "usage: writebench [size] [rounds]\n");
+        return 1;
+    }
+
+    pixel* pixels = malloc(sizeof(*pixels) * size * size);
+    if(pixels == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return 1;
+    }
+    // A gradient with some noise, so nothing along the way can shortcut runs
+    unsigned int state = 12345;
+    for(size_t i = 0; i < size * size; i++) {
+        state = state * 1103515245 + 12345;
+        pixels[i].red = i % size * 255 / size;
+        pixels[i].green = i / size * 255 / size;
+        pixels[i].blue = state >> 24;
+    }
+
+    const char* dir = getenv("TMPDIR");
+    if(dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+
+    pnmHeader header = { 6, size, size, 255 };
+    size_t count = sizeof(methods) / sizeof(*methods);
+    char firstPath[4096];
+    char path[4096];
+    double baseline = 0;
+    double megabytes = 0;
+    double pixelMegabytes = 3.0 * size * size / (1 << 20);
+
+    printf("%zux%zu, best of %zu\n", size, size, rounds);
+    printf("%-12s %6s %10s %10s %10s %8s\n", "method", "format", "MB", "ms",
+        "MB/s", "speedup");
+    for(size_t m = 0; m < count; m++) {
+        int first = m == 0 ||
+            strcmp(methods[m].format, methods[m - 1].format) != 0;
+        header.mode = methods[m].mode;
+        snprintf(path, sizeof(path), "%s/writebench-%ld-%s-%s", dir,
+            (long)getpid(), methods[m].name, methods[m].format);
+        double best = 0;
+        for(size_t round = 0; round < rounds; round++) {
+            double start = threadpool_now();
+            if(methods[m].func(path, header, pixels) < 0) {
+                return 1;
+            }
+            double elapsed = threadpool_now() - start;
+            if(round == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        if(first) {
+            if(m > 0) {
+                remove(firstPath);
+            }
+            baseline = best;
+            strcpy(firstPath, path);
+            megabytes = fileMegabytes(path);
+        }
+        else {
+            if(!sameFile(firstPath, path)) {
+                fprintf(stderr, "Error: '%s' output differs from the "
+                    "baseline\n", methods[m].name);
+                return 1;
+            }
+            remove(path);
+        }
+
+        printf("%-12s %6s %10.1f %10.1f %10.1f %7.1fx\n", methods[m].name,
+            methods[m].format, megabytes, best * 1e3, pixelMegabytes / best,
+            baseline / best);
+    }
+    remove(firstPath);
+    free(pixels);
+
+    return 0;
+}
+
+// How writeBody() used to write P6, one 1-byte fwrite() per channel
+int writePerChannel(const char* path, pnmHeader header, const pixel* pixels) {
+    FILE* outputFd = fopen(path, "w");
+    if(outputFd == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        return -1;
+    }
+    if(writeHeader(header, outputFd) < 0) {
+        fclose(outputFd);
+        return -1;
+    }
+    for(size_t i = 0; i < header.width * header.height; i++) {
+        fwrite(&(pixels[i].red), 1, 1, outputFd);
+        fwrite(&(pixels[i].green), 1, 1, outputFd);
+        fwrite(&(pixels[i].blue), 1, 1, outputFd);
+    }
+    if(fclose(outputFd) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// How writeBody() used to write P3, four fprintf() calls per pixel
+int writePrintf(const char* path, pnmHeader header, const pixel* pixels) {
+    FILE* outputFd = fopen(path, "w");
+    if(outputFd == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        return -1;
+    }
+    if(writeHeader(header, outputFd) < 0) {
+        fclose(outputFd);
+        return -1;
+    }
+    for(size_t y = 0; y < header.height; y++) {
+        for(size_t x = 0; x < header.width; x++) {
+            fprintf(outputFd, "%u", pixels[y * header.width + x].red);
+            fprintf(outputFd, " %u", pixels[y * header.width + x].green);
+            fprintf(outputFd, " %u", pixels[y * header.width + x].blue);
+            if(x % 5 == 4) {
+                fprintf(outputFd, "\n");
+            }
+            else {
+                fprintf(outputFd, "   ");
+            }
+        }
+        fprintf(outputFd, "\n");
+    }
+    if(fclose(outputFd) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int writeBulk(const char* path, pnmHeader header, const pixel* pixels) {
+    FILE* outputFd = fopen(path, "w");
+    if(outputFd == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        return -1;
+    }
+    if(writeHeader(header, outputFd) < 0 ||
+            writeBody(header, pixels, outputFd, 0) < 0) {
+        fclose(outputFd);
+        return -1;
+    }
+    if(fclose(outputFd) != 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The renderer writes into the mapping as it goes, so the copy here stands in
+// for the pixels it would have stored anyway
+int writeMapped(const char* path, pnmHeader header, const pixel* pixels) {
+    pnmMap map;
+    if(mapImage(path, header, &map) < 0) {
+        return -1;
+    }
+    memcpy(map.pixels, pixels, sizeof(*pixels) * header.width * header.height);
+
+    return unmapImage(&map);
+}
+
+// Bands as --pipeline hands them over, formatted on this thread and written
+// on the writer's
+int writePipelined(const char* path, pnmHeader header, const pixel* pixels) {
+    pipelineWriter writer;
+    if(pipeline_open(&writer, path, 64 << 20) < 0) {
+        return -1;
+    }
+
+    char* text = malloc(PNM_HEADER_MAX);
+    int length = text == NULL ? -1 : formatHeader(header, text, PNM_HEADER_MAX);
+    int status = length < 0 ? -1 : pipeline_write(&writer, text, length);
+    for(size_t y = 0; y < header.height && status == 0; y += PIPELINE_ROWS) {
+        pnmHeader band = header;
+        band.height = header.height - y < PIPELINE_ROWS ? header.height - y :
+            PIPELINE_ROWS;
+        char* body = malloc(bodySizeMax(band));
+        if(body == NULL) {
+            status = -1;
+            break;
+        }
+        status = pipeline_write(&writer, body,
+            formatBody(band, &(pixels[y * header.width]), body));
+    }
+
+    if(pipeline_close(&writer) < 0 || status < 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int writeQoi(const char* path, pnmHeader header, const pixel* pixels) {
+    return qoi_write(path, pixels, header.width, header.height, 0);
+}
+
+int writePng(const char* path, pnmHeader header, const pixel* pixels) {
+    return png_write(path, pixels, header.width, header.height, 0);
+}
+
+int sameFile(const char* first, const char* second) {
+    FILE* firstFd = fopen(first, "rb");
+    FILE* secondFd = fopen(second, "rb");
+    int same = firstFd != NULL && secondFd != NULL;
+    char firstBlock[65536];
+    char secondBlock[65536];
+
+    while(same) {
+        size_t firstRead = fread(firstBlock, 1, sizeof(firstBlock), firstFd);
+        size_t secondRead = fread(secondBlock, 1, sizeof(secondBlock), secondFd);
+        same = firstRead == secondRead &&
+            memcmp(firstBlock, secondBlock, firstRead) == 0;
+        if(firstRead == 0) {
+            break;
+        }
+    }
+
+    if(firstFd != NULL) {
+        fclose(firstFd);
+    }
+    if(secondFd != NULL) {
+        fclose(secondFd);
+    }
+
+    return same;
+}
+
+double fileMegabytes(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL || fseek(file, 0, SEEK_END) != 0) {
+        if(file != NULL) {
+            fclose(file);
+        }
+        return 0;
+    }
+    long size = ftell(file);
+    fclose(file);
+
+    return size < 0 ? 0 : (double)size / (1 << 20);
+}
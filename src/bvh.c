@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+
+#define SAH_BINS 16
+#define SAH_TRAVERSAL_COST 1.0
+#define SAH_INTERSECT_COST 1.0
+#define LEAF_MIN_PRIMS 2
+#define LEAF_MAX_PRIMS 8
+
+typedef struct buildState {
+    bvh* bvh;
+    const aabb* bounds;
+    vector3d* centroids;
+    size_t maxLeaf;
+} buildState;
+
+size_t buildNode(buildState* state, size_t start, size_t end, size_t depth);
+size_t splitNode(buildState* state, size_t index, size_t start, size_t middle,
+    size_t end, size_t depth, int axis);
+size_t partitionPrims(buildState* state, size_t start, size_t end, int axis,
+    double split);
+int comparePrims(const void* first, const void* second);
+
+static inline double axisValue(vector3d vector, int axis) {
+    return axis == 0 ? vector.x : (axis == 1 ? vector.y : vector.z);
+}
+
+int bvh_build(bvh* bvh, const aabb* bounds, size_t count, size_t maxLeaf) {
+    memset(bvh, 0, sizeof(*bvh));
+    if(count == 0) {
+        return 0;
+    }
+
+    // A binary tree with n leaves has at most 2n - 1 nodes
+    bvh->nodes = malloc(sizeof(*(bvh->nodes)) * (2 * count - 1));
+    bvh->prims = malloc(sizeof(*(bvh->prims)) * count);
+    vector3d* centroids = malloc(sizeof(*centroids) * count);
+    if(bvh->nodes == NULL || bvh->prims == NULL || centroids == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        free(centroids);
+        bvh_free(bvh);
+        return -1;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        bvh->prims[i] = i;
+        centroids[i] = vector3d_scale(vector3d_add(bounds[i].min, bounds[i].max),
+            0.5);
+    }
+    bvh->primCount = count;
+
+    buildState state = { bvh, bounds, centroids, maxLeaf };
+    buildNode(&state, 0, count, 0);
+
+    // Leaves keep their primitives in ascending order, so a kernel that
+    // prefers the lowest position on ties also prefers the lowest index
+    for(size_t i = 0; i < bvh->nodeCount; i++) {
+        if(bvh->nodes[i].count > 0) {
+            qsort(bvh->prims + bvh->nodes[i].offset, bvh->nodes[i].count,
+                sizeof(*(bvh->prims)), comparePrims);
+        }
+    }
+
+    free(centroids);
+
+    return 0;
+}
+
+void bvh_free(bvh* bvh) {
+    free(bvh->nodes);
+    free(bvh->prims);
+    memset(bvh, 0, sizeof(*bvh));
+}
+
+size_t buildNode(buildState* state, size_t start, size_t end, size_t depth) {
+    bvh* bvh = state->bvh;
+    size_t index = bvh->nodeCount++;
+    bvhNode* node = &(bvh->nodes[index]);
+    size_t count = end - start;
+
+    aabb bounds = aabb_empty();
+    aabb centroidBounds = aabb_empty();
+    for(size_t i = start; i < end; i++) {
+        size_t prim = bvh->prims[i];
+        aabb centroid = { state->centroids[prim], state->centroids[prim] };
+        bounds = aabb_union(bounds, state->bounds[prim]);
+        centroidBounds = aabb_union(centroidBounds, centroid);
+    }
+
+    node->bounds = bounds;
+    node->offset = start;
+    node->count = count;
+    node->axis = 0;
+
+    // Traversal stacks are fixed-size, so stop splitting at the depth limit
+    if(count <= LEAF_MIN_PRIMS || depth + 1 >= BVH_MAX_DEPTH) {
+        return index;
+    }
+
+    // Split along the axis with the widest spread of centroids
+    vector3d extent = vector3d_sub(centroidBounds.max, centroidBounds.min);
+    int axis = 0;
+    if(extent.y > extent.x && extent.y >= extent.z) {
+        axis = 1;
+    }
+    else if(extent.z > extent.x && extent.z > extent.y) {
+        axis = 2;
+    }
+
+    // Leaves no plane is worth splitting are still split evenly past
+    // maxLeaf, so only the depth limit can leave one larger
+    int oversized = state->maxLeaf > 0 && count > state->maxLeaf;
+
+    double axisMin = axisValue(centroidBounds.min, axis);
+    double axisExtent = axisValue(extent, axis);
+    // Every centroid coincides, so no plane can separate them
+    if(axisExtent <= 0) {
+        return oversized ? splitNode(state, index, start, start + count / 2,
+            end, depth, axis) : index;
+    }
+
+    // Binned surface area heuristic: drop centroids into equal-width bins,
+    // then sweep the bin boundaries for the cheapest split plane.
+    size_t binCounts[SAH_BINS] = { 0 };
+    aabb binBounds[SAH_BINS];
+    for(size_t i = 0; i < SAH_BINS; i++) {
+        binBounds[i] = aabb_empty();
+    }
+
+    for(size_t i = start; i < end; i++) {
+        size_t prim = bvh->prims[i];
+        size_t bin = SAH_BINS * (axisValue(state->centroids[prim], axis) -
+            axisMin) / axisExtent;
+        if(bin >= SAH_BINS) {
+            bin = SAH_BINS - 1;
+        }
+        binCounts[bin]++;
+        binBounds[bin] = aabb_union(binBounds[bin], state->bounds[prim]);
+    }
+
+    // rightArea[i] / rightCounts[i] describe bins i..SAH_BINS-1
+    double rightArea[SAH_BINS];
+    size_t rightCounts[SAH_BINS];
+    aabb accumulated = aabb_empty();
+    size_t accumulatedCount = 0;
+    for(size_t i = SAH_BINS - 1; i > 0; i--) {
+        accumulated = aabb_union(accumulated, binBounds[i]);
+        accumulatedCount += binCounts[i];
+        rightArea[i] = aabb_area(accumulated);
+        rightCounts[i] = accumulatedCount;
+    }
+
+    double parentArea = aabb_area(bounds);
+    double bestCost = INFINITY;
+    size_t bestBin = 0;
+    accumulated = aabb_empty();
+    accumulatedCount = 0;
+    for(size_t i = 1; i < SAH_BINS; i++) {
+        accumulated = aabb_union(accumulated, binBounds[i - 1]);
+        accumulatedCount += binCounts[i - 1];
+        if(accumulatedCount == 0 || rightCounts[i] == 0) {
+            continue;
+        }
+
+        double cost = SAH_TRAVERSAL_COST + SAH_INTERSECT_COST * (
+            aabb_area(accumulated) * accumulatedCount +
+            rightArea[i] * rightCounts[i]
+        ) / (parentArea > 0 ? parentArea : 1);
+        if(cost < bestCost) {
+            bestCost = cost;
+            bestBin = i;
+        }
+    }
+
+    // Keep small nodes as leaves when splitting would not pay for itself
+    double leafCost = SAH_INTERSECT_COST * count;
+    if(bestBin == 0 || (bestCost >= leafCost && count <= LEAF_MAX_PRIMS)) {
+        return oversized ? splitNode(state, index, start, start + count / 2,
+            end, depth, axis) : index;
+    }
+
+    double split = axisMin + axisExtent * bestBin / SAH_BINS;
+    size_t middle = partitionPrims(state, start, end, axis, split);
+    // Floating point can disagree with the binning at the boundaries, so
+    // fall back to an even split rather than produce an empty child
+    if(middle == start || middle == end) {
+        middle = start + count / 2;
+    }
+
+    return splitNode(state, index, start, middle, end, depth, axis);
+}
+
+// Turns node 'index' into an interior node over [start, middle) and
+// [middle, end)
+size_t splitNode(buildState* state, size_t index, size_t start, size_t middle,
+        size_t end, size_t depth, int axis) {
+    bvhNode* node = &(state->bvh->nodes[index]);
+    node->count = 0;
+    node->axis = axis;
+    buildNode(state, start, middle, depth + 1);
+    node->offset = buildNode(state, middle, end, depth + 1);
+
+    return index;
+}
+
+int comparePrims(const void* first, const void* second) {
+    size_t a = *(const size_t*)first;
+    size_t b = *(const size_t*)second;
+
+    return (a > b) - (a < b);
+}
+
+size_t partitionPrims(buildState* state, size_t start, size_t end, int axis,
+        double split) {
+    size_t* prims = state->bvh->prims;
+    size_t i = start;
+    size_t j = end;
+
+    while(i < j) {
+        if(axisValue(state->centroids[prims[i]], axis) < split) {
+            i++;
+        }
+        else {
+            size_t temp = prims[i];
+            prims[i] = prims[--j];
+            prims[j] = temp;
+        }
+    }
+
+    return i;
+}
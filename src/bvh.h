@@ -0,0 +1,97 @@
+#ifndef CS430_BVH_H
+#define CS430_BVH_H
+
+#include <stddef.h>
+
+#include "vector3d.h"
+
+#define BVH_MAX_DEPTH 64
+
+typedef struct aabb {
+    vector3d min;
+    vector3d max;
+} aabb;
+
+typedef struct bvhNode {
+    aabb bounds;
+    // For leaves, the first index into bvh.prims. For interior nodes, the
+    // index of the right child (the left child always directly follows).
+    size_t offset;
+    // Number of primitives in a leaf, 0 for interior nodes
+    size_t count;
+    // Split axis of an interior node (0 = x, 1 = y, 2 = z)
+    int axis;
+} bvhNode;
+
+typedef struct bvh {
+    bvhNode* nodes;
+    size_t nodeCount;
+    // Primitive indices, reordered so every leaf covers a contiguous range.
+    // Within a leaf the indices stay in ascending order.
+    size_t* prims;
+    size_t primCount;
+} bvh;
+
+// Builds a BVH over 'count' boxes. Leaves holding more than 'maxLeaf'
+// primitives (0 for no limit) are split evenly short of the depth limit.
+int bvh_build(bvh* bvh, const aabb* bounds, size_t count, size_t maxLeaf);
+void bvh_free(bvh* bvh);
+
+static inline aabb aabb_empty() {
+    aabb box = {
+        { INFINITY, INFINITY, INFINITY },
+        { -INFINITY, -INFINITY, -INFINITY }
+    };
+
+    return box;
+}
+
+static inline aabb aabb_union(aabb first, aabb second) {
+    aabb box = {
+        {
+            fmin(first.min.x, second.min.x),
+            fmin(first.min.y, second.min.y),
+            fmin(first.min.z, second.min.z)
+        },
+        {
+            fmax(first.max.x, second.max.x),
+            fmax(first.max.y, second.max.y),
+            fmax(first.max.z, second.max.z)
+        }
+    };
+
+    return box;
+}
+
+static inline double aabb_area(aabb box) {
+    vector3d size = vector3d_sub(box.max, box.min);
+    if(size.x < 0 || size.y < 0 || size.z < 0) {
+        return 0;
+    }
+
+    return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+// Slab test against a ray given by its origin and component-wise inverse
+// direction. Returns 1 if the ray overlaps the box anywhere in (0, tMax].
+static inline int aabb_hit(aabb box, vector3d origin, vector3d invDir,
+        double tMax) {
+    double t1 = (box.min.x - origin.x) * invDir.x;
+    double t2 = (box.max.x - origin.x) * invDir.x;
+    double tNear = fmin(t1, t2);
+    double tFar = fmax(t1, t2);
+
+    t1 = (box.min.y - origin.y) * invDir.y;
+    t2 = (box.max.y - origin.y) * invDir.y;
+    tNear = fmax(tNear, fmin(t1, t2));
+    tFar = fmin(tFar, fmax(t1, t2));
+
+    t1 = (box.min.z - origin.z) * invDir.z;
+    t2 = (box.max.z - origin.z) * invDir.z;
+    tNear = fmax(tNear, fmin(t1, t2));
+    tFar = fmin(tFar, fmax(t1, t2));
+
+    return tNear <= tFar && tFar > 0 && tNear <= tMax;
+}
+
+#endif // CS430_BVH_H
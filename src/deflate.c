@@ -0,0 +1,612 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+
+// Farthest back and longest a match may be
+#define WINDOW_SIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+// Positions are chained by a hash of their next 4 bytes rather than the 3 a
+// match needs, which keeps chains short in noisy data for little lost
+#define HASH_BYTES 4
+#define HASH_BITS 15
+// Earlier positions with the same hash tried for each match, and the match
+// length past which the next position is not tried for a longer one
+#define MAX_CHAIN 32
+#define LAZY_LENGTH 32
+// Literals and matches gathered before a block is written
+#define BLOCK_TOKENS 32768
+#define LITLEN_CODES 286
+#define DIST_CODES 30
+#define CODELEN_CODES 19
+#define MAX_CODE_LENGTH 15
+#define MAX_CODELEN_LENGTH 7
+#define STORED_MAX 65535
+#define ADLER_BASE 65521
+// Most bytes that can be summed before the Adler-32 sums overflow
+#define ADLER_RUN 5552
+
+typedef struct token {
+    // Literal byte, or match length
+    uint16_t value;
+    // Match distance, or 0 for a literal
+    uint16_t distance;
+    uint8_t lengthCode;
+    uint8_t distCode;
+} token;
+
+typedef struct huffman {
+    uint8_t lengths[LITLEN_CODES];
+    // Canonical codes with their bits reversed, ready to write LSB first
+    uint16_t codes[LITLEN_CODES];
+} huffman;
+
+// Hash chains over the input. 'head' holds the last position seen for each
+// hash of three bytes, and 'prev' links each position in the window to the
+// one before it with the same hash.
+typedef struct matcher {
+    const unsigned char* input;
+    size_t size;
+    int32_t* head;
+    int32_t* prev;
+} matcher;
+
+static const uint16_t lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+    67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5,
+    5, 5, 5, 0
+};
+static const uint16_t distBase[DIST_CODES] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513,
+    769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distExtra[DIST_CODES] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+    11, 11, 12, 12, 13, 13
+};
+// Order the lengths of the code length code are sent in
+static const uint8_t codeLengthOrder[CODELEN_CODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+void insertPosition(matcher* matcher, size_t pos);
+size_t findMatch(const matcher* matcher, size_t pos, size_t* distance);
+uint32_t hashBytes(const unsigned char* bytes);
+token makeMatch(size_t length, size_t distance);
+void writeBlock(const token* tokens, size_t count, const unsigned char* input,
+    size_t size, int final, deflateOutput* out);
+void writeStored(const unsigned char* data, size_t size, int final,
+    deflateOutput* out);
+void buildLengths(const uint32_t* freqs, size_t count, int maxLength,
+    uint8_t* lengths);
+int huffmanLengths(const uint32_t* freqs, size_t count, uint8_t* lengths);
+void buildCodes(huffman* tree, size_t count);
+size_t encodeCodeLengths(const uint8_t* lengths, size_t count,
+    uint8_t* symbols, uint8_t* extras);
+void putBits(deflateOutput* out, uint32_t value, int count);
+void alignBits(deflateOutput* out);
+void reserveOutput(deflateOutput* out, size_t extra);
+
+void deflate_compress(const unsigned char* input, size_t size, int last,
+        deflateOutput* out) {
+    matcher matcher = { input, size, malloc(sizeof(int32_t) << HASH_BITS),
+        malloc(sizeof(int32_t) * WINDOW_SIZE) };
+    token* tokens = malloc(sizeof(*tokens) * BLOCK_TOKENS);
+    if(matcher.head == NULL || matcher.prev == NULL || tokens == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < (1 << HASH_BITS); i++) {
+        matcher.head[i] = -1;
+    }
+
+    size_t pos = 0;
+    size_t blockStart = 0;
+    size_t count = 0;
+    while(pos < size) {
+        // Each step adds at most a literal and a match
+        if(count + 2 > BLOCK_TOKENS) {
+            writeBlock(tokens, count, input + blockStart, pos - blockStart, 0,
+                out);
+            blockStart = pos;
+            count = 0;
+        }
+
+        size_t distance = 0;
+        size_t length = findMatch(&matcher, pos, &distance);
+        insertPosition(&matcher, pos);
+
+        // Lazy matching: a short match is put off by a byte if the next
+        // position starts a longer one
+        if(length > 0 && length < LAZY_LENGTH) {
+            size_t nextDistance;
+            size_t nextLength = findMatch(&matcher, pos + 1, &nextDistance);
+            if(nextLength > length) {
+                tokens[count++] = makeMatch(input[pos], 0);
+                pos++;
+                insertPosition(&matcher, pos);
+                length = nextLength;
+                distance = nextDistance;
+            }
+        }
+
+        if(length > 0) {
+            tokens[count++] = makeMatch(length, distance);
+            for(size_t i = 1; i < length; i++) {
+                insertPosition(&matcher, pos + i);
+            }
+            pos += length;
+        }
+        else {
+            tokens[count++] = makeMatch(input[pos], 0);
+            pos++;
+        }
+    }
+    writeBlock(tokens, count, input + blockStart, pos - blockStart, last, out);
+
+    if(last) {
+        alignBits(out);
+    }
+    else {
+        writeStored(NULL, 0, 0, out);
+    }
+
+    free(matcher.head);
+    free(matcher.prev);
+    free(tokens);
+}
+
+void deflate_free(deflateOutput* out) {
+    free(out->data);
+    memset(out, 0, sizeof(*out));
+}
+
+uint32_t deflate_adler32(uint32_t adler, const unsigned char* data,
+        size_t size) {
+    uint32_t sum1 = adler & 0xffff;
+    uint32_t sum2 = adler >> 16;
+
+    while(size > 0) {
+        size_t run = size < ADLER_RUN ? size : ADLER_RUN;
+        for(size_t i = 0; i < run; i++) {
+            sum1 += data[i];
+            sum2 += sum1;
+        }
+        sum1 %= ADLER_BASE;
+        sum2 %= ADLER_BASE;
+        data += run;
+        size -= run;
+    }
+
+    return sum2 << 16 | sum1;
+}
+
+// The first sum of the whole is both first sums added (each started at 1).
+// The second sum adds the first piece's first sum once for every byte of the
+// second piece, less the extra 1 the second piece started from.
+uint32_t deflate_combineAdler32(uint32_t first, uint32_t second,
+        size_t secondSize) {
+    uint32_t remainder = secondSize % ADLER_BASE;
+    uint32_t sum1 = first & 0xffff;
+    uint32_t sum2 = (uint64_t)remainder * sum1 % ADLER_BASE;
+
+    sum1 += (second & 0xffff) + ADLER_BASE - 1;
+    sum2 += (first >> 16) + (second >> 16) + ADLER_BASE - remainder;
+    while(sum1 >= ADLER_BASE) {
+        sum1 -= ADLER_BASE;
+    }
+    while(sum2 >= ADLER_BASE) {
+        sum2 -= ADLER_BASE;
+    }
+
+    return sum2 << 16 | sum1;
+}
+
+void insertPosition(matcher* matcher, size_t pos) {
+    if(pos + HASH_BYTES > matcher->size) {
+        return;
+    }
+
+    uint32_t hash = hashBytes(matcher->input + pos);
+    matcher->prev[pos & (WINDOW_SIZE - 1)] = matcher->head[hash];
+    matcher->head[hash] = pos;
+}
+
+// Longest match for the bytes at 'pos' among the last MAX_CHAIN positions
+// with the same hash, or 0 if none is at least MIN_MATCH long
+size_t findMatch(const matcher* matcher, size_t pos, size_t* distance) {
+    if(pos + HASH_BYTES > matcher->size) {
+        return 0;
+    }
+
+    const unsigned char* current = matcher->input + pos;
+    size_t maxLength = matcher->size - pos < MAX_MATCH ?
+        matcher->size - pos : MAX_MATCH;
+    int32_t candidate = matcher->head[hashBytes(current)];
+    size_t best = 0;
+
+    for(size_t chain = 0; candidate >= 0 && chain < MAX_CHAIN; chain++) {
+        size_t back = pos - candidate;
+        if(back > WINDOW_SIZE) {
+            break;
+        }
+
+        const unsigned char* match = matcher->input + candidate;
+        // Only worth comparing if it can beat the best so far
+        if(match[best] == current[best]) {
+            size_t length = 0;
+            while(length < maxLength && match[length] == current[length]) {
+                length++;
+            }
+            if(length > best) {
+                best = length;
+                *distance = back;
+                if(best == maxLength) {
+                    break;
+                }
+            }
+        }
+
+        // A link at or past the candidate belongs to a newer position that
+        // has since reused its slot
+        int32_t next = matcher->prev[candidate & (WINDOW_SIZE - 1)];
+        if(next >= candidate) {
+            break;
+        }
+        candidate = next;
+    }
+
+    return best >= MIN_MATCH ? best : 0;
+}
+
+uint32_t hashBytes(const unsigned char* bytes) {
+    uint32_t value = (uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 |
+        bytes[3];
+
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// A literal when 'distance' is 0, with 'length' as the byte
+token makeMatch(size_t length, size_t distance) {
+    token token = { length, distance, 0, 0 };
+    if(distance == 0) {
+        return token;
+    }
+
+    while(token.lengthCode + 1 < 29 &&
+            lengthBase[token.lengthCode + 1] <= length) {
+        token.lengthCode++;
+    }
+    while(token.distCode + 1 < DIST_CODES &&
+            distBase[token.distCode + 1] <= distance) {
+        token.distCode++;
+    }
+
+    return token;
+}
+
+// Writes the tokens as one block with Huffman codes built for them, or the
+// 'size' bytes they stand for as stored blocks if that comes out smaller
+void writeBlock(const token* tokens, size_t count, const unsigned char* input,
+        size_t size, int final, deflateOutput* out) {
+    uint32_t litFreqs[LITLEN_CODES] = { 0 };
+    uint32_t distFreqs[DIST_CODES] = { 0 };
+    for(size_t i = 0; i < count; i++) {
+        if(tokens[i].distance == 0) {
+            litFreqs[tokens[i].value]++;
+        }
+        else {
+            litFreqs[257 + tokens[i].lengthCode]++;
+            distFreqs[tokens[i].distCode]++;
+        }
+    }
+    // End of block
+    litFreqs[256] = 1;
+
+    huffman lit, dist, codeLen;
+    buildLengths(litFreqs, LITLEN_CODES, MAX_CODE_LENGTH, lit.lengths);
+    buildLengths(distFreqs, DIST_CODES, MAX_CODE_LENGTH, dist.lengths);
+    size_t litCount = LITLEN_CODES;
+    while(litCount > 257 && lit.lengths[litCount - 1] == 0) {
+        litCount--;
+    }
+    size_t distCount = DIST_CODES;
+    while(distCount > 1 && dist.lengths[distCount - 1] == 0) {
+        distCount--;
+    }
+
+    // Both trees' lengths are sent as one run-length coded sequence, itself
+    // Huffman coded
+    uint8_t lengths[LITLEN_CODES + DIST_CODES];
+    uint8_t symbols[LITLEN_CODES + DIST_CODES];
+    uint8_t extras[LITLEN_CODES + DIST_CODES];
+    memcpy(lengths, lit.lengths, litCount);
+    memcpy(lengths + litCount, dist.lengths, distCount);
+    size_t symbolCount = encodeCodeLengths(lengths, litCount + distCount,
+        symbols, extras);
+    uint32_t codeLenFreqs[CODELEN_CODES] = { 0 };
+    for(size_t i = 0; i < symbolCount; i++) {
+        codeLenFreqs[symbols[i]]++;
+    }
+    buildLengths(codeLenFreqs, CODELEN_CODES, MAX_CODELEN_LENGTH,
+        codeLen.lengths);
+    size_t codeLenCount = CODELEN_CODES;
+    while(codeLenCount > 4 &&
+            codeLen.lengths[codeLengthOrder[codeLenCount - 1]] == 0) {
+        codeLenCount--;
+    }
+
+    static const uint8_t repeatExtra[3] = { 2, 3, 7 };
+    uint64_t bits = 3 + 5 + 5 + 4 + 3 * codeLenCount;
+    for(size_t i = 0; i < symbolCount; i++) {
+        bits += codeLen.lengths[symbols[i]] +
+            (symbols[i] >= 16 ? repeatExtra[symbols[i] - 16] : 0);
+    }
+    for(size_t i = 0; i < LITLEN_CODES; i++) {
+        bits += (uint64_t)litFreqs[i] * (lit.lengths[i] +
+            (i > 256 ? lengthExtra[i - 257] : 0));
+    }
+    for(size_t i = 0; i < DIST_CODES; i++) {
+        bits += (uint64_t)distFreqs[i] * (dist.lengths[i] + distExtra[i]);
+    }
+    // Header, alignment, then the length and its complement per block
+    size_t storedBlocks = size / STORED_MAX + 1;
+    if((uint64_t)(size + 5 * storedBlocks) * 8 < bits) {
+        writeStored(input, size, final, out);
+        return;
+    }
+
+    buildCodes(&lit, LITLEN_CODES);
+    buildCodes(&dist, DIST_CODES);
+    buildCodes(&codeLen, CODELEN_CODES);
+
+    putBits(out, final, 1);
+    putBits(out, 2, 2);
+    putBits(out, litCount - 257, 5);
+    putBits(out, distCount - 1, 5);
+    putBits(out, codeLenCount - 4, 4);
+    for(size_t i = 0; i < codeLenCount; i++) {
+        putBits(out, codeLen.lengths[codeLengthOrder[i]], 3);
+    }
+    for(size_t i = 0; i < symbolCount; i++) {
+        putBits(out, codeLen.codes[symbols[i]], codeLen.lengths[symbols[i]]);
+        if(symbols[i] >= 16) {
+            putBits(out, extras[i], repeatExtra[symbols[i] - 16]);
+        }
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        const token* token = &(tokens[i]);
+        if(token->distance == 0) {
+            putBits(out, lit.codes[token->value], lit.lengths[token->value]);
+            continue;
+        }
+
+        size_t code = 257 + token->lengthCode;
+        putBits(out, lit.codes[code], lit.lengths[code]);
+        putBits(out, token->value - lengthBase[token->lengthCode],
+            lengthExtra[token->lengthCode]);
+        putBits(out, dist.codes[token->distCode], dist.lengths[token->distCode]);
+        putBits(out, token->distance - distBase[token->distCode],
+            distExtra[token->distCode]);
+    }
+    putBits(out, lit.codes[256], lit.lengths[256]);
+}
+
+// Stored blocks hold at most STORED_MAX bytes each. With no data this writes
+// one empty block, which byte aligns the output.
+void writeStored(const unsigned char* data, size_t size, int final,
+        deflateOutput* out) {
+    do {
+        size_t chunk = size < STORED_MAX ? size : STORED_MAX;
+        putBits(out, final && chunk == size, 1);
+        putBits(out, 0, 2);
+        alignBits(out);
+        putBits(out, chunk, 16);
+        putBits(out, chunk ^ 0xffff, 16);
+        alignBits(out);
+
+        reserveOutput(out, chunk);
+        if(chunk > 0) {
+            memcpy(out->data + out->size, data, chunk);
+        }
+        out->size += chunk;
+        data += chunk;
+        size -= chunk;
+    } while(size > 0);
+}
+
+// Huffman code lengths for the symbols, none longer than 'maxLength'. Too
+// deep a tree is flattened by halving the frequencies until it fits. At
+// least two symbols always get a code, so every code is complete.
+void buildLengths(const uint32_t* freqs, size_t count, int maxLength,
+        uint8_t* lengths) {
+    uint32_t scaled[LITLEN_CODES];
+    size_t used = 0;
+    for(size_t i = 0; i < count; i++) {
+        scaled[i] = freqs[i];
+        used += freqs[i] > 0;
+    }
+    for(size_t i = 0; used < 2; i++) {
+        if(scaled[i] == 0) {
+            scaled[i] = 1;
+            used++;
+        }
+    }
+
+    while(huffmanLengths(scaled, count, lengths) > maxLength) {
+        for(size_t i = 0; i < count; i++) {
+            if(scaled[i] > 0) {
+                scaled[i] = scaled[i] >> 1 | 1;
+            }
+        }
+    }
+}
+
+// Plain Huffman construction, merging the two lightest nodes until one is
+// left. Returns the longest code length.
+int huffmanLengths(const uint32_t* freqs, size_t count, uint8_t* lengths) {
+    uint64_t weight[2 * LITLEN_CODES];
+    int parent[2 * LITLEN_CODES];
+    size_t leaf[LITLEN_CODES];
+    size_t nodes = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        if(freqs[i] > 0) {
+            leaf[i] = nodes;
+            weight[nodes] = freqs[i];
+            parent[nodes] = -1;
+            nodes++;
+        }
+    }
+
+    for(size_t roots = nodes; roots > 1; roots--) {
+        size_t lightest[2] = { nodes, nodes };
+        for(size_t i = 0; i < nodes; i++) {
+            if(parent[i] != -1) {
+                continue;
+            }
+            if(lightest[0] == nodes || weight[i] < weight[lightest[0]]) {
+                lightest[1] = lightest[0];
+                lightest[0] = i;
+            }
+            else if(lightest[1] == nodes || weight[i] < weight[lightest[1]]) {
+                lightest[1] = i;
+            }
+        }
+        weight[nodes] = weight[lightest[0]] + weight[lightest[1]];
+        parent[nodes] = -1;
+        parent[lightest[0]] = parent[lightest[1]] = nodes;
+        nodes++;
+    }
+
+    int longest = 0;
+    for(size_t i = 0; i < count; i++) {
+        int length = 0;
+        if(freqs[i] > 0) {
+            for(int node = leaf[i]; parent[node] != -1; node = parent[node]) {
+                length++;
+            }
+        }
+        lengths[i] = length;
+        if(length > longest) {
+            longest = length;
+        }
+    }
+
+    return longest;
+}
+
+// Canonical codes from the lengths (RFC 1951 3.2.2)
+void buildCodes(huffman* tree, size_t count) {
+    uint16_t lengthCount[MAX_CODE_LENGTH + 1] = { 0 };
+    uint16_t next[MAX_CODE_LENGTH + 1];
+    for(size_t i = 0; i < count; i++) {
+        lengthCount[tree->lengths[i]]++;
+    }
+    lengthCount[0] = 0;
+
+    uint16_t code = 0;
+    for(size_t bits = 1; bits <= MAX_CODE_LENGTH; bits++) {
+        code = (code + lengthCount[bits - 1]) << 1;
+        next[bits] = code;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        int length = tree->lengths[i];
+        if(length == 0) {
+            continue;
+        }
+        uint16_t value = next[length]++;
+        uint16_t reversed = 0;
+        for(int bit = 0; bit < length; bit++) {
+            reversed = reversed << 1 | ((value >> bit) & 1);
+        }
+        tree->codes[i] = reversed;
+    }
+}
+
+// Run-length codes the lengths: 16 repeats the last length 3 to 6 times, and
+// 17 and 18 stand for 3 to 10 and 11 to 138 zeros
+size_t encodeCodeLengths(const uint8_t* lengths, size_t count,
+        uint8_t* symbols, uint8_t* extras) {
+    size_t symbolCount = 0;
+
+    for(size_t i = 0; i < count;) {
+        uint8_t length = lengths[i];
+        size_t run = 1;
+        while(i + run < count && lengths[i + run] == length) {
+            run++;
+        }
+
+        if(length == 0 && run >= 3) {
+            if(run > 138) {
+                run = 138;
+            }
+            symbols[symbolCount] = run >= 11 ? 18 : 17;
+            extras[symbolCount++] = run >= 11 ? run - 11 : run - 3;
+            i += run;
+        }
+        else if(length != 0 && run >= 4) {
+            size_t repeat = run - 1 < 6 ? run - 1 : 6;
+            symbols[symbolCount] = length;
+            extras[symbolCount++] = 0;
+            symbols[symbolCount] = 16;
+            extras[symbolCount++] = repeat - 3;
+            i += 1 + repeat;
+        }
+        else {
+            symbols[symbolCount] = length;
+            extras[symbolCount++] = 0;
+            i++;
+        }
+    }
+
+    return symbolCount;
+}
+
+void putBits(deflateOutput* out, uint32_t value, int count) {
+    out->bits |= (uint64_t)value << out->bitCount;
+    out->bitCount += count;
+    if(out->bitCount >= 32) {
+        reserveOutput(out, 4);
+        for(int i = 0; i < 4; i++) {
+            out->data[out->size++] = out->bits & 0xff;
+            out->bits >>= 8;
+        }
+        out->bitCount -= 32;
+    }
+}
+
+// Flushes every pending bit, padding the last byte with zeros
+void alignBits(deflateOutput* out) {
+    reserveOutput(out, 8);
+    while(out->bitCount > 0) {
+        out->data[out->size++] = out->bits & 0xff;
+        out->bits >>= 8;
+        out->bitCount -= 8;
+    }
+    out->bits = 0;
+    out->bitCount = 0;
+}
+
+void reserveOutput(deflateOutput* out, size_t extra) {
+    if(out->size + extra <= out->capacity) {
+        return;
+    }
+
+    size_t capacity = out->capacity > 0 ? out->capacity * 2 : 4096;
+    while(capacity < out->size + extra) {
+        capacity *= 2;
+    }
+    if((out->data = realloc(out->data, capacity)) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    out->capacity = capacity;
+}
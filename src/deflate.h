@@ -0,0 +1,33 @@
+#ifndef CS430_DEFLATE_H
+#define CS430_DEFLATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed bytes, grown as needed and written a bit at a time, least
+// significant bit first
+typedef struct deflateOutput {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    uint64_t bits;
+    int bitCount;
+} deflateOutput;
+
+// Appends 'size' bytes to 'out' as raw deflate blocks (RFC 1951). Matches
+// never reach back before 'input', so pieces of a larger buffer can be
+// compressed on their own, in parallel, and joined in order. Every piece but
+// the 'last' ends with an empty stored block, leaving it byte aligned, while
+// the last one's final block is marked as the end of the stream.
+void deflate_compress(const unsigned char* input, size_t size, int last,
+    deflateOutput* out);
+void deflate_free(deflateOutput* out);
+
+// Adler-32 as used by zlib streams (RFC 1950), starting from 1. Checksums of
+// two pieces are combined given the second piece's length.
+uint32_t deflate_adler32(uint32_t adler, const unsigned char* data,
+    size_t size);
+uint32_t deflate_combineAdler32(uint32_t first, uint32_t second,
+    size_t secondSize);
+
+#endif // CS430_DEFLATE_H
@@ -9,6 +9,7 @@
 
 #include "vector3d.h"
 #include "json.h"
+#include "mesh.h"
 
 #define CAMERA_WIDTH_FLAG 0x1
 #define CAMERA_HEIGHT_FLAG 0x2
@@ -19,6 +20,7 @@
 #define REFLECT_FLAG 0x100
 #define REFRACT_FLAG 0x200
 #define IOR_FLAG 0x400
+#define GROUP_FLAG 0x800
 
 #define SPHERE_POS_FLAG 0x8
 #define SPHERE_RAD_FLAG 0x10
@@ -26,6 +28,12 @@
 #define PLANE_POS_FLAG 0x8
 #define PLANE_NORMAL_FLAG 0x10
 
+#define MESH_FILE_FLAG 0x8
+
+#define INSTANCE_GROUP_FLAG 0x1
+#define INSTANCE_POS_FLAG 0x2
+#define INSTANCE_SCALE_FLAG 0x4
+
 #define LIGHT_POS_FLAG 0x1
 #define LIGHT_DIR_FLAG 0x2
 #define LIGHT_COLOR_FLAG 0x4
@@ -44,6 +52,11 @@ char* nextString(FILE* json, size_t* line);
 double nextNumber(FILE* json, size_t* line);
 vector3d nextVector3d(FILE* json, size_t* line);
 vector3d nextColor(FILE* json, size_t* line);
+int nextMaterial(FILE* json, size_t* line, const char* key, sceneObj* obj,
+    int* keyFlag);
+char* resolvePath(const char* base, const char* path);
+sceneGroup* findGroup(sceneGroup** groups, size_t groupsSize,
+    const char* name);
 
 jsonObj readScene(const char* path) {
     FILE* json = fopen(path, "r");
@@ -56,12 +69,24 @@ jsonObj readScene(const char* path) {
     size_t objsSize = 0;
     sceneLight* light;
     size_t lightsSize = 0;
+    sceneInstance* instance = NULL;
+    size_t instancesSize = 0;
+    size_t groupsSize = 0;
+    // Member count of each group, in the same order as jsonObj.groups
+    size_t* groupSizes = NULL;
+    // Group named by each instance and the line it was named on, looked up
+    // once the whole file is read so groups can be defined after their
+    // instances
+    char** instanceGroups = NULL;
+    size_t* instanceLines = NULL;
 
     jsonObj jsonObj = { 0 };
 
     int c;
     size_t line = 1;
     char* key, *type;
+    char* meshPath = NULL;
+    char* groupName;
     int keyFlag;
 
     // Ignore beginning whitespace
@@ -119,7 +144,8 @@ jsonObj readScene(const char* path) {
         skipWhitespace(json, &line);
         type = nextString(json, &line);
 
-        if(strcmp(type, "plane") == 0 || strcmp(type, "sphere") == 0) {
+        if(strcmp(type, "plane") == 0 || strcmp(type, "sphere") == 0 ||
+                strcmp(type, "mesh") == 0) {
             if((obj = malloc(sizeof(*obj))) == NULL) {
                 fprintf(stderr, "Error: Line %zu: Memory reallocation error\n",
                     line);
@@ -135,6 +161,9 @@ jsonObj readScene(const char* path) {
             else if(strcmp(type, "sphere") == 0) {
                 obj->type = TYPE_SPHERE;
             }
+            else if(strcmp(type, "mesh") == 0) {
+                obj->type = TYPE_MESH;
+            }
 
             obj->ns = DEFAULT_NS;
             obj->specular.x = 1;
@@ -162,6 +191,27 @@ jsonObj readScene(const char* path) {
                 sizeof(*(jsonObj.lights)));
             jsonObj.lights[lightsSize - 1] = light;
         }
+        else if(strcmp(type, "instance") == 0) {
+            if((instance = malloc(sizeof(*instance))) == NULL) {
+                fprintf(stderr, "Error: Line %zu: Memory reallocation error\n",
+                    line);
+                perror("");
+                exit(EXIT_FAILURE);
+            }
+
+            memset(instance, 0, sizeof(*instance));
+
+            instance->scale = 1;
+
+            jsonObj.instances = realloc(jsonObj.instances, ++instancesSize *
+                sizeof(*(jsonObj.instances)));
+            jsonObj.instances[instancesSize - 1] = instance;
+            instanceGroups = realloc(instanceGroups, instancesSize *
+                sizeof(*instanceGroups));
+            instanceLines = realloc(instanceLines, instancesSize *
+                sizeof(*instanceLines));
+            instanceGroups[instancesSize - 1] = NULL;
+        }
         else if(strcmp(type, "camera") != 0) {
             fprintf(stderr, "Error: Line %zu: Unknown type %s", line,
                 type);
@@ -169,6 +219,7 @@ jsonObj readScene(const char* path) {
         }
 
         keyFlag = 0;
+        groupName = NULL;
 
         skipWhitespace(json, &line);
         while((c = jsonGetC(json, &line)) == ',') {
@@ -246,69 +297,17 @@ jsonObj readScene(const char* path) {
                     }
                     keyFlag |= SPHERE_RAD_FLAG;
                 }
-                else if(strcmp(key, "diffuse_color") == 0) {
-                    if(keyFlag & DIFFUSE_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'diffuse_color' already defined\n",
+                else if(strcmp(key, "group") == 0) {
+                    if(keyFlag & GROUP_FLAG) {
+                        fprintf(stderr, "Error: Line %zu: 'group' already defined\n",
                             line);
                         exit(EXIT_FAILURE);
                     }
-                    keyFlag |= DIFFUSE_FLAG;
+                    keyFlag |= GROUP_FLAG;
 
-                    obj->diffuse = nextColor(json, &line);
+                    groupName = nextString(json, &line);
                 }
-                else if(strcmp(key, "specular_color") == 0) {
-                    if(keyFlag & SPECULAR_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'specular_color' already defined\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
-                    keyFlag |= SPECULAR_FLAG;
-
-                    obj->specular = nextColor(json, &line);
-                }
-                else if(strcmp(key, "reflectivity") == 0) {
-                    if(keyFlag & REFLECT_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'reflectivity' already defined\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
-                    keyFlag |= REFLECT_FLAG;
-
-                    obj->reflectivity = nextNumber(json, &line);
-                    if(obj->reflectivity < 0.0 || obj->reflectivity > 1.0) {
-                        fprintf(stderr, "Error: Line %zu: 'reflectivity' must be"
-                            " between 0.0 and 1.0.\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
-                }
-                else if(strcmp(key, "refractivity") == 0) {
-                    if(keyFlag & REFRACT_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'refractivity' already defined\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
-                    keyFlag |= REFRACT_FLAG;
-
-                    obj->refractivity = nextNumber(json, &line);
-                    if(obj->refractivity < 0.0 || obj->refractivity > 1.0) {
-                        fprintf(stderr, "Error: Line %zu: 'refractivity' must be"
-                            " between 0.0 and 1.0.\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
-                }
-                else if(strcmp(key, "ior") == 0) {
-                    if(keyFlag & IOR_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'ior' already defined\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
-                    keyFlag |= IOR_FLAG;
-
-                    obj->ior = nextNumber(json, &line);
-                }
-                else {
+                else if(!nextMaterial(json, &line, key, obj, &keyFlag)) {
                     fprintf(stderr, "Error: Line %zu: Key '%s' not supported "
                         "under 'sphere'\n", line, key);
                     exit(EXIT_FAILURE);
@@ -335,71 +334,80 @@ jsonObj readScene(const char* path) {
 
                     obj->plane.normal = nextVector3d(json, &line);
                 }
-                else if(strcmp(key, "diffuse_color") == 0) {
-                    if(keyFlag & DIFFUSE_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'diffuse_color' already defined\n",
+                else if(!nextMaterial(json, &line, key, obj, &keyFlag)) {
+                    fprintf(stderr, "Error: Line %zu: Key '%s' not supported "
+                        "under 'plane'\n", line, key);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if(strcmp(type, "mesh") == 0) {
+                if(strcmp(key, "file") == 0) {
+                    if(keyFlag & MESH_FILE_FLAG) {
+                        fprintf(stderr, "Error: Line %zu: 'file' already defined\n",
                             line);
                         exit(EXIT_FAILURE);
                     }
-                    keyFlag |= DIFFUSE_FLAG;
+                    keyFlag |= MESH_FILE_FLAG;
 
-                    obj->diffuse = nextColor(json, &line);
+                    meshPath = nextString(json, &line);
                 }
-                else if(strcmp(key, "specular_color") == 0) {
-                    if(keyFlag & SPECULAR_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'specular_color' already defined\n",
+                else if(strcmp(key, "group") == 0) {
+                    if(keyFlag & GROUP_FLAG) {
+                        fprintf(stderr, "Error: Line %zu: 'group' already defined\n",
                             line);
                         exit(EXIT_FAILURE);
                     }
-                    keyFlag |= SPECULAR_FLAG;
+                    keyFlag |= GROUP_FLAG;
 
-                    obj->specular = nextColor(json, &line);
+                    groupName = nextString(json, &line);
                 }
-                else if(strcmp(key, "reflectivity") == 0) {
-                    if(keyFlag & REFLECT_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'reflectivity' already defined\n",
+                else if(!nextMaterial(json, &line, key, obj, &keyFlag)) {
+                    fprintf(stderr, "Error: Line %zu: Key '%s' not supported "
+                        "under 'mesh'\n", line, key);
+                    exit(EXIT_FAILURE);
+                }
+            }
+            else if(strcmp(type, "instance") == 0) {
+                if(strcmp(key, "group") == 0) {
+                    if(keyFlag & INSTANCE_GROUP_FLAG) {
+                        fprintf(stderr, "Error: Line %zu: 'group' already defined\n",
                             line);
                         exit(EXIT_FAILURE);
                     }
-                    keyFlag |= REFLECT_FLAG;
+                    keyFlag |= INSTANCE_GROUP_FLAG;
 
-                    obj->reflectivity = nextNumber(json, &line);
-                    if(obj->reflectivity < 0.0 || obj->reflectivity > 1.0) {
-                        fprintf(stderr, "Error: Line %zu: 'reflectivity' must be"
-                            " between 0.0 and 1.0.\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
+                    instanceGroups[instancesSize - 1] = nextString(json,
+                        &line);
+                    instanceLines[instancesSize - 1] = line;
                 }
-                else if(strcmp(key, "refractivity") == 0) {
-                    if(keyFlag & REFRACT_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'refractivity' already defined\n",
+                else if(strcmp(key, "position") == 0) {
+                    if(keyFlag & INSTANCE_POS_FLAG) {
+                        fprintf(stderr, "Error: Line %zu: 'position' already defined\n",
                             line);
                         exit(EXIT_FAILURE);
                     }
-                    keyFlag |= REFRACT_FLAG;
+                    keyFlag |= INSTANCE_POS_FLAG;
 
-                    obj->refractivity = nextNumber(json, &line);
-                    if(obj->refractivity < 0.0 || obj->refractivity > 1.0) {
-                        fprintf(stderr, "Error: Line %zu: 'refractivity' must be"
-                            " between 0.0 and 1.0.\n",
-                            line);
-                        exit(EXIT_FAILURE);
-                    }
+                    instance->pos = nextVector3d(json, &line);
                 }
-                else if(strcmp(key, "ior") == 0) {
-                    if(keyFlag & IOR_FLAG) {
-                        fprintf(stderr, "Error: Line %zu: 'ior' already defined\n",
+                else if(strcmp(key, "scale") == 0) {
+                    if(keyFlag & INSTANCE_SCALE_FLAG) {
+                        fprintf(stderr, "Error: Line %zu: 'scale' already defined\n",
                             line);
                         exit(EXIT_FAILURE);
                     }
-                    keyFlag |= IOR_FLAG;
+                    keyFlag |= INSTANCE_SCALE_FLAG;
 
-                    obj->ior = nextNumber(json, &line);
+                    instance->scale = nextNumber(json, &line);
+                    if(!(instance->scale > 0)) {
+                        fprintf(stderr, "Error: Line %zu: 'scale' must be "
+                            "positive\n", line);
+                        exit(EXIT_FAILURE);
+                    }
                 }
                 else {
                     fprintf(stderr, "Error: Line %zu: Key '%s' not supported "
-                        "under 'plane'\n", line, key);
+                        "under 'instance'\n", line, key);
                     exit(EXIT_FAILURE);
                 }
             }
@@ -561,12 +569,40 @@ jsonObj readScene(const char* path) {
                 exit(EXIT_FAILURE);
             }
         }
-        else if(strcmp(type, "light") == 0) {
-            if(!(keyFlag & LIGHT_POS_FLAG)) {
-                fprintf(stderr, "Error: Line %zu: 'light' missing 'position' "
+        else if(strcmp(type, "mesh") == 0) {
+            if(!(keyFlag & MESH_FILE_FLAG)) {
+                fprintf(stderr, "Error: Line %zu: 'mesh' missing 'file' "
                     "property missing\n", line);
                 exit(EXIT_FAILURE);
             }
+            if(!(keyFlag & DIFFUSE_FLAG)) {
+                fprintf(stderr, "Error: Line %zu: 'mesh' missing 'diffuse_color' "
+                    "property missing\n", line);
+                exit(EXIT_FAILURE);
+            }
+
+            char* resolved = resolvePath(path, meshPath);
+            if((obj->mesh.data = mesh_load(resolved)) == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            free(resolved);
+            free(meshPath);
+        }
+        else if(strcmp(type, "light") == 0) {
+            // A light with only a direction is infinitely far away
+            if(!(keyFlag & LIGHT_POS_FLAG)) {
+                if(!(keyFlag & LIGHT_DIR_FLAG)) {
+                    fprintf(stderr, "Error: Line %zu: 'light' missing 'position' "
+                        "property missing\n", line);
+                    exit(EXIT_FAILURE);
+                }
+                if(light->dir.x == 0 && light->dir.y == 0 && light->dir.z == 0) {
+                    fprintf(stderr, "Error: Line %zu: Directional 'light' must "
+                        "have a nonzero 'direction'\n", line);
+                    exit(EXIT_FAILURE);
+                }
+                light->type = LIGHT_DIRECTIONAL;
+            }
             if(!(keyFlag & LIGHT_COLOR_FLAG)) {
                 fprintf(stderr, "Error: Line %zu: 'light' missing 'color' "
                     "property missing\n", line);
@@ -574,6 +610,54 @@ jsonObj readScene(const char* path) {
             }
         }
 
+        else if(strcmp(type, "instance") == 0) {
+            if(!(keyFlag & INSTANCE_GROUP_FLAG)) {
+                fprintf(stderr, "Error: Line %zu: 'instance' missing 'group' "
+                    "property missing\n", line);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Group members are taken back out of the scene's own objects
+        if(groupName != NULL) {
+            objsSize--;
+
+            sceneGroup* group = findGroup(jsonObj.groups, groupsSize,
+                groupName);
+            size_t index;
+            if(group == NULL) {
+                if((group = malloc(sizeof(*group))) == NULL) {
+                    fprintf(stderr, "Error: Line %zu: Memory reallocation "
+                        "error\n", line);
+                    exit(EXIT_FAILURE);
+                }
+                memset(group, 0, sizeof(*group));
+                group->name = groupName;
+
+                jsonObj.groups = realloc(jsonObj.groups, ++groupsSize *
+                    sizeof(*(jsonObj.groups)));
+                groupSizes = realloc(groupSizes, groupsSize *
+                    sizeof(*groupSizes));
+                jsonObj.groups[groupsSize - 1] = group;
+                index = groupsSize - 1;
+                groupSizes[index] = 0;
+            }
+            else {
+                for(index = 0; jsonObj.groups[index] != group; index++);
+                free(groupName);
+            }
+
+            group->objs = realloc(group->objs, (++groupSizes[index] + 1) *
+                sizeof(*(group->objs)));
+            if(group->objs == NULL) {
+                fprintf(stderr, "Error: Line %zu: Memory reallocation error\n",
+                    line);
+                exit(EXIT_FAILURE);
+            }
+            group->objs[groupSizes[index] - 1] = obj;
+            group->objs[groupSizes[index]] = NULL;
+        }
+
         tokenCheck(c, '}', line);
 
         skipWhitespace(json, &line);
@@ -584,14 +668,112 @@ jsonObj readScene(const char* path) {
 
     trailSpaceCheck(json, &line);
 
+    for(size_t i = 0; i < instancesSize; i++) {
+        jsonObj.instances[i]->group = findGroup(jsonObj.groups, groupsSize,
+            instanceGroups[i]);
+        if(jsonObj.instances[i]->group == NULL) {
+            fprintf(stderr, "Error: Line %zu: Unknown group '%s'\n",
+                instanceLines[i], instanceGroups[i]);
+            exit(EXIT_FAILURE);
+        }
+        free(instanceGroups[i]);
+    }
+    free(instanceGroups);
+    free(instanceLines);
+
     jsonObj.objs = realloc(jsonObj.objs, (objsSize + 1) * sizeof(*(jsonObj.objs)));
     jsonObj.objs[objsSize] = NULL;
     jsonObj.lights = realloc(jsonObj.lights, (lightsSize + 1) * sizeof(*(jsonObj.lights)));
     jsonObj.lights[lightsSize] = NULL;
+    jsonObj.groups = realloc(jsonObj.groups, (groupsSize + 1) * sizeof(*(jsonObj.groups)));
+    jsonObj.groups[groupsSize] = NULL;
+    jsonObj.instances = realloc(jsonObj.instances, (instancesSize + 1) * sizeof(*(jsonObj.instances)));
+    jsonObj.instances[instancesSize] = NULL;
+    free(groupSizes);
 
     return jsonObj;
 }
 
+// Reads the value of a material key shared by every object type. Returns 0 if
+// 'key' is not one.
+int nextMaterial(FILE* json, size_t* line, const char* key, sceneObj* obj,
+        int* keyFlag) {
+    if(strcmp(key, "diffuse_color") == 0) {
+        if(*keyFlag & DIFFUSE_FLAG) {
+            fprintf(stderr, "Error: Line %zu: 'diffuse_color' already defined\n",
+                *line);
+            exit(EXIT_FAILURE);
+        }
+        *keyFlag |= DIFFUSE_FLAG;
+
+        obj->diffuse = nextColor(json, line);
+
+        return 1;
+    }
+    if(strcmp(key, "specular_color") == 0) {
+        if(*keyFlag & SPECULAR_FLAG) {
+            fprintf(stderr, "Error: Line %zu: 'specular_color' already defined\n",
+                *line);
+            exit(EXIT_FAILURE);
+        }
+        *keyFlag |= SPECULAR_FLAG;
+
+        obj->specular = nextColor(json, line);
+
+        return 1;
+    }
+    if(strcmp(key, "reflectivity") == 0) {
+        if(*keyFlag & REFLECT_FLAG) {
+            fprintf(stderr, "Error: Line %zu: 'reflectivity' already defined\n",
+                *line);
+            exit(EXIT_FAILURE);
+        }
+        *keyFlag |= REFLECT_FLAG;
+
+        obj->reflectivity = nextNumber(json, line);
+        if(obj->reflectivity < 0.0 || obj->reflectivity > 1.0) {
+            fprintf(stderr, "Error: Line %zu: 'reflectivity' must be"
+                " between 0.0 and 1.0.\n",
+                *line);
+            exit(EXIT_FAILURE);
+        }
+
+        return 1;
+    }
+    if(strcmp(key, "refractivity") == 0) {
+        if(*keyFlag & REFRACT_FLAG) {
+            fprintf(stderr, "Error: Line %zu: 'refractivity' already defined\n",
+                *line);
+            exit(EXIT_FAILURE);
+        }
+        *keyFlag |= REFRACT_FLAG;
+
+        obj->refractivity = nextNumber(json, line);
+        if(obj->refractivity < 0.0 || obj->refractivity > 1.0) {
+            fprintf(stderr, "Error: Line %zu: 'refractivity' must be"
+                " between 0.0 and 1.0.\n",
+                *line);
+            exit(EXIT_FAILURE);
+        }
+
+        return 1;
+    }
+    if(strcmp(key, "ior") == 0) {
+        if(*keyFlag & IOR_FLAG) {
+            fprintf(stderr, "Error: Line %zu: 'ior' already defined\n",
+                *line);
+            exit(EXIT_FAILURE);
+        }
+        *keyFlag |= IOR_FLAG;
+
+        obj->ior = nextNumber(json, line);
+
+        return 1;
+    }
+
+    return 0;
+}
+
 void errorCheck(int c, FILE* fp, size_t line) {
     if(c == EOF) {
         if(feof(fp)) {
@@ -766,3 +948,32 @@ vector3d nextColor(FILE* json, size_t* line) {
 
     return color;
 }
+
+// Resolves 'path' against the directory of the file 'base', unless it is
+// already absolute
+char* resolvePath(const char* base, const char* path) {
+    const char* slash = strrchr(base, '/');
+    size_t dirSize = path[0] != '/' && slash != NULL ? slash - base + 1 : 0;
+    size_t pathSize = strlen(path);
+
+    char* resolved = malloc(dirSize + pathSize + 1);
+    if(resolved == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(resolved, base, dirSize);
+    memcpy(resolved + dirSize, path, pathSize + 1);
+
+    return resolved;
+}
+
+sceneGroup* findGroup(sceneGroup** groups, size_t groupsSize,
+        const char* name) {
+    for(size_t i = 0; i < groupsSize; i++) {
+        if(strcmp(groups[i]->name, name) == 0) {
+            return groups[i];
+        }
+    }
+
+    return NULL;
+}
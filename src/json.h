@@ -4,12 +4,15 @@
 #include <stddef.h>
 
 #include "pnm.h"
-#include "raycast.h"
+#include "scene.h"
 
 typedef struct jsonObj {
     camera camera;
     sceneObj** objs;
     sceneLight** lights;
+    // Named groups of objects, and the copies of them placed in the scene
+    sceneGroup** groups;
+    sceneInstance** instances;
 } jsonObj;
 
 jsonObj readScene(const char* path);
@@ -0,0 +1,657 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+#include "kernels.h"
+
+// All variants follow the exact operation order of sphere_intersection() in
+// raycast.c, so whichever one is picked the image does not change:
+//
+// t = dir . (pos - origin)
+// magnitude = |(origin + dir * t) - pos|
+// hit if magnitude <= radius, at t - sqrt(radius^2 - magnitude^2)
+//
+// Only hits in (tMin, tMax] count. Before any root is taken, spheres are
+// rejected if the near root, which lies in [t - radius, t], cannot reach
+// the interval, or if their squared distance is clearly past radius^2. The
+// slack is far wider than the rounding of either root, so this never
+// rejects something the exact test would keep, and batches that miss
+// entirely skip both square roots. Interval rejections are added to
+// 'rejected'.
+
+sphereKernel spheres_nearest = spheres_nearest_scalar;
+
+static const char* kernelNames[KERNEL_COUNT] = {
+    "scalar", "sse4.2", "avx2", "avx512"
+};
+
+int kernel_init(int kernel) {
+    if(kernel == KERNEL_AUTO) {
+        kernel = kernel_best();
+    }
+
+    if(!kernel_supported(kernel)) {
+        fprintf(stderr, "Error: Kernel '%s' not supported by this CPU\n",
+            kernel_name(kernel));
+        return -1;
+    }
+
+    spheres_nearest = kernel_get(kernel);
+
+    return 0;
+}
+
+int kernel_supported(int kernel) {
+    switch(kernel) {
+        case(KERNEL_SCALAR):
+            return 1;
+#ifdef KERNELS_X86
+        case(KERNEL_SSE42):
+            return __builtin_cpu_supports("sse4.2");
+        case(KERNEL_AVX2):
+            return __builtin_cpu_supports("avx2");
+        case(KERNEL_AVX512):
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return 0;
+    }
+}
+
+int kernel_best() {
+    // BVH leaves hold at most a handful of spheres, and at those batch sizes
+    // the AVX-512 variant's setup costs more than it saves (see
+    // out/kernelbench), so it is only used when asked for explicitly.
+    static const int preferred[] = { KERNEL_AVX2, KERNEL_SSE42 };
+    for(size_t i = 0; i < sizeof(preferred) / sizeof(*preferred); i++) {
+        if(kernel_supported(preferred[i])) {
+            return preferred[i];
+        }
+    }
+
+    return KERNEL_SCALAR;
+}
+
+int kernel_find(const char* name) {
+    if(strcmp(name, "auto") == 0) {
+        return KERNEL_AUTO;
+    }
+    for(int kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+        if(strcmp(name, kernelNames[kernel]) == 0) {
+            return kernel;
+        }
+    }
+
+    return -2;
+}
+
+const char* kernel_name(int kernel) {
+    if(kernel < 0 || kernel >= KERNEL_COUNT) {
+        return "unknown";
+    }
+
+    return kernelNames[kernel];
+}
+
+sphereKernel kernel_get(int kernel) {
+    switch(kernel) {
+        case(KERNEL_SSE42):
+            return spheres_nearest_sse42;
+        case(KERNEL_AVX2):
+            return spheres_nearest_avx2;
+        case(KERNEL_AVX512):
+            return spheres_nearest_avx512;
+        default:
+            return spheres_nearest_scalar;
+    }
+}
+
+int spheres_nearest_scalar(const sceneSpheres* spheres, size_t start,
+        size_t count, vector3d origin, vector3d dir, real tMin, real tMax,
+        real* t, size_t* index, size_t* rejected) {
+    real best = INFINITY;
+    size_t bestIndex = 0;
+
+    for(size_t i = start; i < start + count; i++) {
+        real offsetX = spheres->posX[i] - origin.x;
+        real offsetY = spheres->posY[i] - origin.y;
+        real offsetZ = spheres->posZ[i] - origin.z;
+        real close = dir.x * offsetX + dir.y * offsetY + dir.z * offsetZ;
+        if(close <= tMin || close - spheres->radius[i] * REJECT_SLACK >
+                tMax * REJECT_SLACK) {
+            (*rejected)++;
+            continue;
+        }
+
+        offsetX = origin.x + dir.x * close - spheres->posX[i];
+        offsetY = origin.y + dir.y * close - spheres->posY[i];
+        offsetZ = origin.z + dir.z * close - spheres->posZ[i];
+        real squared = offsetX * offsetX + offsetY * offsetY +
+            offsetZ * offsetZ;
+        if(squared > spheres->radius2[i] * REJECT_SLACK) {
+            continue;
+        }
+        real magnitude = sqrt(squared);
+        if(magnitude > spheres->radius[i]) {
+            continue;
+        }
+
+        real hit = close - sqrt(spheres->radius2[i] - magnitude * magnitude);
+        if(hit > tMin && hit <= tMax && hit < best) {
+            best = hit;
+            bestIndex = i;
+        }
+    }
+
+    if(best == INFINITY) {
+        return 0;
+    }
+
+    *t = best;
+    *index = bestIndex;
+
+    return 1;
+}
+
+int spheres_occluded(const sceneSpheres* spheres, size_t start, size_t count,
+        vector3d origin, vector3d dir, real tMin, real tMax, size_t* index,
+        size_t* rejected) {
+    for(size_t i = start; i < start + count; i++) {
+        real offsetX = spheres->posX[i] - origin.x;
+        real offsetY = spheres->posY[i] - origin.y;
+        real offsetZ = spheres->posZ[i] - origin.z;
+        real close = dir.x * offsetX + dir.y * offsetY + dir.z * offsetZ;
+
+        // Spheres centered behind the origin or wholly beyond the light are
+        // settled without a square root
+        if(close <= tMin || close - spheres->radius[i] * REJECT_SLACK >
+                tMax * REJECT_SLACK) {
+            (*rejected)++;
+            continue;
+        }
+
+        offsetX = origin.x + dir.x * close - spheres->posX[i];
+        offsetY = origin.y + dir.y * close - spheres->posY[i];
+        offsetZ = origin.z + dir.z * close - spheres->posZ[i];
+        real squared = offsetX * offsetX + offsetY * offsetY +
+            offsetZ * offsetZ;
+        if(squared > spheres->radius2[i] * REJECT_SLACK) {
+            continue;
+        }
+        real magnitude = sqrt(squared);
+        if(magnitude > spheres->radius[i]) {
+            continue;
+        }
+
+        real hit = close - sqrt(spheres->radius2[i] - magnitude * magnitude);
+        if(hit > tMin && hit <= tMax) {
+            *index = i;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef KERNELS_X86
+
+// Lane types and operations for the precision 'real' is built with, so each
+// kernel is written once for both builds. A register holds twice as many
+// floats as doubles.
+#ifdef CS430_SINGLE_PRECISION
+#define SSE_LANES 4
+typedef __m128 sseReal;
+#define sse_set1 _mm_set1_ps
+#define sse_loadu _mm_loadu_ps
+#define sse_storeu _mm_storeu_ps
+#define sse_add _mm_add_ps
+#define sse_sub _mm_sub_ps
+#define sse_mul _mm_mul_ps
+#define sse_and _mm_and_ps
+#define sse_sqrt _mm_sqrt_ps
+#define sse_cmpgt _mm_cmpgt_ps
+#define sse_cmple _mm_cmple_ps
+#define sse_movemask _mm_movemask_ps
+#define sse_blendv _mm_blendv_ps
+
+#define AVX_LANES 8
+typedef __m256 avxReal;
+#define avx_set1 _mm256_set1_ps
+#define avx_maskload _mm256_maskload_ps
+#define avx_storeu _mm256_storeu_ps
+#define avx_add _mm256_add_ps
+#define avx_sub _mm256_sub_ps
+#define avx_mul _mm256_mul_ps
+#define avx_and _mm256_and_ps
+#define avx_sqrt _mm256_sqrt_ps
+#define avx_cmp _mm256_cmp_ps
+#define avx_movemask _mm256_movemask_ps
+#define avx_blendv _mm256_blendv_ps
+#define avx_fromMask _mm256_castsi256_ps
+
+#define AVX512_LANES 16
+typedef __m512 avx512Real;
+typedef __mmask16 avx512Mask;
+#define avx512_set1 _mm512_set1_ps
+#define avx512_maskzLoadu _mm512_maskz_loadu_ps
+#define avx512_storeu _mm512_storeu_ps
+#define avx512_add _mm512_add_ps
+#define avx512_sub _mm512_sub_ps
+#define avx512_mul _mm512_mul_ps
+#define avx512_maskzSqrt _mm512_maskz_sqrt_ps
+#define avx512_cmpMask _mm512_cmp_ps_mask
+#define avx512_maskCmpMask _mm512_mask_cmp_ps_mask
+#define avx512_maskBlend _mm512_mask_blend_ps
+#else
+#define SSE_LANES 2
+typedef __m128d sseReal;
+#define sse_set1 _mm_set1_pd
+#define sse_loadu _mm_loadu_pd
+#define sse_storeu _mm_storeu_pd
+#define sse_add _mm_add_pd
+#define sse_sub _mm_sub_pd
+#define sse_mul _mm_mul_pd
+#define sse_and _mm_and_pd
+#define sse_sqrt _mm_sqrt_pd
+#define sse_cmpgt _mm_cmpgt_pd
+#define sse_cmple _mm_cmple_pd
+#define sse_movemask _mm_movemask_pd
+#define sse_blendv _mm_blendv_pd
+
+#define AVX_LANES 4
+typedef __m256d avxReal;
+#define avx_set1 _mm256_set1_pd
+#define avx_maskload _mm256_maskload_pd
+#define avx_storeu _mm256_storeu_pd
+#define avx_add _mm256_add_pd
+#define avx_sub _mm256_sub_pd
+#define avx_mul _mm256_mul_pd
+#define avx_and _mm256_and_pd
+#define avx_sqrt _mm256_sqrt_pd
+#define avx_cmp _mm256_cmp_pd
+#define avx_movemask _mm256_movemask_pd
+#define avx_blendv _mm256_blendv_pd
+#define avx_fromMask _mm256_castsi256_pd
+
+#define AVX512_LANES 8
+typedef __m512d avx512Real;
+typedef __mmask8 avx512Mask;
+#define avx512_set1 _mm512_set1_pd
+#define avx512_maskzLoadu _mm512_maskz_loadu_pd
+#define avx512_storeu _mm512_storeu_pd
+#define avx512_add _mm512_add_pd
+#define avx512_sub _mm512_sub_pd
+#define avx512_mul _mm512_mul_pd
+#define avx512_maskzSqrt _mm512_maskz_sqrt_pd
+#define avx512_cmpMask _mm512_cmp_pd_mask
+#define avx512_maskCmpMask _mm512_mask_cmp_pd_mask
+#define avx512_maskBlend _mm512_mask_blend_pd
+#endif
+
+// Hit distances for the SSE_LANES spheres at 'i', INFINITY where missed or
+// outside the interval
+__attribute__((target("sse4.2")))
+static inline sseReal sphereLanesSse42(const sceneSpheres* spheres, size_t i,
+        sseReal originX, sseReal originY, sseReal originZ, sseReal dirX,
+        sseReal dirY, sseReal dirZ, sseReal tMin, sseReal tMax,
+        size_t* rejected) {
+    sseReal posX = sse_loadu(spheres->posX + i);
+    sseReal posY = sse_loadu(spheres->posY + i);
+    sseReal posZ = sse_loadu(spheres->posZ + i);
+
+    sseReal close = sse_add(sse_add(
+        sse_mul(dirX, sse_sub(posX, originX)),
+        sse_mul(dirY, sse_sub(posY, originY))),
+        sse_mul(dirZ, sse_sub(posZ, originZ)));
+    sseReal radius = sse_loadu(spheres->radius + i);
+    sseReal slack = sse_set1(REJECT_SLACK);
+    sseReal live = sse_and(sse_cmpgt(close, tMin),
+        sse_cmple(sse_sub(close, sse_mul(radius, slack)),
+        sse_mul(tMax, slack)));
+    int liveBits = sse_movemask(live);
+    *rejected += SSE_LANES - __builtin_popcount(liveBits);
+    if(liveBits == 0) {
+        return sse_set1(INFINITY);
+    }
+
+    sseReal offsetX = sse_sub(sse_add(originX, sse_mul(dirX, close)), posX);
+    sseReal offsetY = sse_sub(sse_add(originY, sse_mul(dirY, close)), posY);
+    sseReal offsetZ = sse_sub(sse_add(originZ, sse_mul(dirZ, close)), posZ);
+    sseReal squared = sse_add(sse_add(
+        sse_mul(offsetX, offsetX), sse_mul(offsetY, offsetY)),
+        sse_mul(offsetZ, offsetZ));
+    sseReal radius2 = sse_loadu(spheres->radius2 + i);
+    if(sse_movemask(sse_and(live, sse_cmple(squared,
+            sse_mul(radius2, slack)))) == 0) {
+        return sse_set1(INFINITY);
+    }
+    sseReal magnitude = sse_sqrt(squared);
+
+    sseReal inside = sse_and(live, sse_cmple(magnitude, radius));
+    // Zero the misses before the root so they don't raise invalid
+    sseReal a = sse_sqrt(sse_and(inside, sse_sub(radius2,
+        sse_mul(magnitude, magnitude))));
+    sseReal hit = sse_sub(close, a);
+    sseReal valid = sse_and(inside, sse_and(sse_cmpgt(hit, tMin),
+        sse_cmple(hit, tMax)));
+
+    return sse_blendv(sse_set1(INFINITY), hit, valid);
+}
+
+__attribute__((target("sse4.2")))
+int spheres_nearest_sse42(const sceneSpheres* spheres, size_t start,
+        size_t count, vector3d origin, vector3d dir, real tMin, real tMax,
+        real* t, size_t* index, size_t* rejected) {
+    sseReal originX = sse_set1(origin.x);
+    sseReal originY = sse_set1(origin.y);
+    sseReal originZ = sse_set1(origin.z);
+    sseReal dirX = sse_set1(dir.x);
+    sseReal dirY = sse_set1(dir.y);
+    sseReal dirZ = sse_set1(dir.z);
+    sseReal tMinLanes = sse_set1(tMin);
+    sseReal tMaxLanes = sse_set1(tMax);
+
+    real best = INFINITY;
+    size_t bestIndex = 0;
+    real lanes[SSE_LANES * 2];
+    size_t end = start + count;
+    size_t i = start;
+
+    // Two registers of spheres per step
+    for(; i + SSE_LANES * 2 <= end; i += SSE_LANES * 2) {
+        sse_storeu(lanes, sphereLanesSse42(spheres, i, originX, originY,
+            originZ, dirX, dirY, dirZ, tMinLanes, tMaxLanes, rejected));
+        sse_storeu(lanes + SSE_LANES, sphereLanesSse42(spheres, i + SSE_LANES,
+            originX, originY, originZ, dirX, dirY, dirZ, tMinLanes, tMaxLanes,
+            rejected));
+        for(size_t lane = 0; lane < SSE_LANES * 2; lane++) {
+            if(lanes[lane] < best) {
+                best = lanes[lane];
+                bestIndex = i + lane;
+            }
+        }
+    }
+    for(; i + SSE_LANES <= end; i += SSE_LANES) {
+        sse_storeu(lanes, sphereLanesSse42(spheres, i, originX, originY,
+            originZ, dirX, dirY, dirZ, tMinLanes, tMaxLanes, rejected));
+        for(size_t lane = 0; lane < SSE_LANES; lane++) {
+            if(lanes[lane] < best) {
+                best = lanes[lane];
+                bestIndex = i + lane;
+            }
+        }
+    }
+
+    real tailT;
+    size_t tailIndex;
+    if(i < end && spheres_nearest_scalar(spheres, i, end - i, origin, dir,
+            tMin, tMax, &tailT, &tailIndex, rejected) && tailT < best) {
+        best = tailT;
+        bestIndex = tailIndex;
+    }
+
+    if(best == INFINITY) {
+        return 0;
+    }
+
+    *t = best;
+    *index = bestIndex;
+
+    return 1;
+}
+
+// All-ones lanes for the spheres left before 'end'
+__attribute__((target("avx2")))
+static inline __m256i avxLoadMask(size_t remaining) {
+#ifdef CS430_SINGLE_PRECISION
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining < AVX_LANES ?
+        remaining : AVX_LANES), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+#else
+    return _mm256_cmpgt_epi64(_mm256_set1_epi64x(remaining),
+        _mm256_set_epi64x(3, 2, 1, 0));
+#endif
+}
+
+// Hit distances for up to AVX_LANES spheres at 'i', INFINITY where missed,
+// outside the interval or past the end of the batch
+__attribute__((target("avx2")))
+static inline avxReal sphereLanesAvx2(const sceneSpheres* spheres, size_t i,
+        size_t end, avxReal originX, avxReal originY, avxReal originZ,
+        avxReal dirX, avxReal dirY, avxReal dirZ, avxReal tMin, avxReal tMax,
+        size_t* rejected) {
+    __m256i load = avxLoadMask(end - i);
+
+    avxReal posX = avx_maskload(spheres->posX + i, load);
+    avxReal posY = avx_maskload(spheres->posY + i, load);
+    avxReal posZ = avx_maskload(spheres->posZ + i, load);
+
+    avxReal close = avx_add(avx_add(
+        avx_mul(dirX, avx_sub(posX, originX)),
+        avx_mul(dirY, avx_sub(posY, originY))),
+        avx_mul(dirZ, avx_sub(posZ, originZ)));
+    avxReal radius = avx_maskload(spheres->radius + i, load);
+    avxReal slack = avx_set1(REJECT_SLACK);
+    avxReal loaded = avx_fromMask(load);
+    avxReal live = avx_and(loaded, avx_and(
+        avx_cmp(close, tMin, _CMP_GT_OQ),
+        avx_cmp(avx_sub(close, avx_mul(radius, slack)),
+        avx_mul(tMax, slack), _CMP_LE_OQ)));
+    int liveBits = avx_movemask(live);
+    *rejected += __builtin_popcount(avx_movemask(loaded)) -
+        __builtin_popcount(liveBits);
+    if(liveBits == 0) {
+        return avx_set1(INFINITY);
+    }
+
+    avxReal offsetX = avx_sub(avx_add(originX, avx_mul(dirX, close)), posX);
+    avxReal offsetY = avx_sub(avx_add(originY, avx_mul(dirY, close)), posY);
+    avxReal offsetZ = avx_sub(avx_add(originZ, avx_mul(dirZ, close)), posZ);
+    avxReal squared = avx_add(avx_add(
+        avx_mul(offsetX, offsetX), avx_mul(offsetY, offsetY)),
+        avx_mul(offsetZ, offsetZ));
+    avxReal radius2 = avx_maskload(spheres->radius2 + i, load);
+    if(avx_movemask(avx_and(live, avx_cmp(squared,
+            avx_mul(radius2, slack), _CMP_LE_OQ))) == 0) {
+        return avx_set1(INFINITY);
+    }
+    avxReal magnitude = avx_sqrt(squared);
+
+    avxReal inside = avx_and(live, avx_cmp(magnitude, radius, _CMP_LE_OQ));
+    avxReal a = avx_sqrt(avx_and(inside, avx_sub(radius2,
+        avx_mul(magnitude, magnitude))));
+    avxReal hit = avx_sub(close, a);
+    avxReal valid = avx_and(inside, avx_and(
+        avx_cmp(hit, tMin, _CMP_GT_OQ),
+        avx_cmp(hit, tMax, _CMP_LE_OQ)));
+
+    return avx_blendv(avx_set1(INFINITY), hit, valid);
+}
+
+__attribute__((target("avx2")))
+int spheres_nearest_avx2(const sceneSpheres* spheres, size_t start,
+        size_t count, vector3d origin, vector3d dir, real tMin, real tMax,
+        real* t, size_t* index, size_t* rejected) {
+    avxReal originX = avx_set1(origin.x);
+    avxReal originY = avx_set1(origin.y);
+    avxReal originZ = avx_set1(origin.z);
+    avxReal dirX = avx_set1(dir.x);
+    avxReal dirY = avx_set1(dir.y);
+    avxReal dirZ = avx_set1(dir.z);
+    avxReal tMinLanes = avx_set1(tMin);
+    avxReal tMaxLanes = avx_set1(tMax);
+
+    real best = INFINITY;
+    size_t bestIndex = 0;
+    real lanes[AVX_LANES * 2];
+    size_t end = start + count;
+
+    // Two registers of spheres per step, the last step masked down to what
+    // is left
+    for(size_t i = start; i < end; i += AVX_LANES * 2) {
+        avx_storeu(lanes, sphereLanesAvx2(spheres, i, end, originX,
+            originY, originZ, dirX, dirY, dirZ, tMinLanes, tMaxLanes,
+            rejected));
+        if(i + AVX_LANES < end) {
+            avx_storeu(lanes + AVX_LANES, sphereLanesAvx2(spheres,
+                i + AVX_LANES, end, originX, originY, originZ, dirX, dirY,
+                dirZ, tMinLanes, tMaxLanes, rejected));
+        }
+        else {
+            avx_storeu(lanes + AVX_LANES, avx_set1(INFINITY));
+        }
+        for(size_t lane = 0; lane < AVX_LANES * 2; lane++) {
+            if(lanes[lane] < best) {
+                best = lanes[lane];
+                bestIndex = i + lane;
+            }
+        }
+    }
+
+    if(best == INFINITY) {
+        return 0;
+    }
+
+    *t = best;
+    *index = bestIndex;
+
+    return 1;
+}
+
+// Hit distances for up to AVX512_LANES spheres at 'i', INFINITY where missed,
+// outside the interval or past the end of the batch
+__attribute__((target("avx512f")))
+static inline avx512Real sphereLanesAvx512(const sceneSpheres* spheres,
+        size_t i, size_t end, avx512Real originX, avx512Real originY,
+        avx512Real originZ, avx512Real dirX, avx512Real dirY, avx512Real dirZ,
+        avx512Real tMin, avx512Real tMax, size_t* rejected) {
+    size_t remaining = end - i;
+    avx512Mask load = remaining >= AVX512_LANES ? (avx512Mask)-1 :
+        (avx512Mask)((1u << remaining) - 1);
+
+    avx512Real posX = avx512_maskzLoadu(load, spheres->posX + i);
+    avx512Real posY = avx512_maskzLoadu(load, spheres->posY + i);
+    avx512Real posZ = avx512_maskzLoadu(load, spheres->posZ + i);
+
+    avx512Real close = avx512_add(avx512_add(
+        avx512_mul(dirX, avx512_sub(posX, originX)),
+        avx512_mul(dirY, avx512_sub(posY, originY))),
+        avx512_mul(dirZ, avx512_sub(posZ, originZ)));
+    avx512Real radius = avx512_maskzLoadu(load, spheres->radius + i);
+    avx512Real slack = avx512_set1(REJECT_SLACK);
+    avx512Mask live = avx512_maskCmpMask(load, close, tMin, _CMP_GT_OQ) &
+        avx512_cmpMask(avx512_sub(close, avx512_mul(radius, slack)),
+        avx512_mul(tMax, slack), _CMP_LE_OQ);
+    *rejected += __builtin_popcount(load) - __builtin_popcount(live);
+    if(live == 0) {
+        return avx512_set1(INFINITY);
+    }
+
+    avx512Real offsetX = avx512_sub(avx512_add(originX,
+        avx512_mul(dirX, close)), posX);
+    avx512Real offsetY = avx512_sub(avx512_add(originY,
+        avx512_mul(dirY, close)), posY);
+    avx512Real offsetZ = avx512_sub(avx512_add(originZ,
+        avx512_mul(dirZ, close)), posZ);
+    avx512Real squared = avx512_add(avx512_add(
+        avx512_mul(offsetX, offsetX), avx512_mul(offsetY, offsetY)),
+        avx512_mul(offsetZ, offsetZ));
+    avx512Real radius2 = avx512_maskzLoadu(load, spheres->radius2 + i);
+    avx512Mask near = avx512_maskCmpMask(live, squared,
+        avx512_mul(radius2, slack), _CMP_LE_OQ);
+    if(near == 0) {
+        return avx512_set1(INFINITY);
+    }
+    avx512Real magnitude = avx512_maskzSqrt(near, squared);
+
+    avx512Mask inside = avx512_maskCmpMask(near, magnitude, radius,
+        _CMP_LE_OQ);
+    avx512Real a = avx512_maskzSqrt(inside, avx512_sub(radius2,
+        avx512_mul(magnitude, magnitude)));
+    avx512Real hit = avx512_sub(close, a);
+    avx512Mask valid = avx512_maskCmpMask(inside, hit, tMin, _CMP_GT_OQ) &
+        avx512_cmpMask(hit, tMax, _CMP_LE_OQ);
+
+    return avx512_maskBlend(valid, avx512_set1(INFINITY), hit);
+}
+
+__attribute__((target("avx512f")))
+int spheres_nearest_avx512(const sceneSpheres* spheres, size_t start,
+        size_t count, vector3d origin, vector3d dir, real tMin, real tMax,
+        real* t, size_t* index, size_t* rejected) {
+    avx512Real originX = avx512_set1(origin.x);
+    avx512Real originY = avx512_set1(origin.y);
+    avx512Real originZ = avx512_set1(origin.z);
+    avx512Real dirX = avx512_set1(dir.x);
+    avx512Real dirY = avx512_set1(dir.y);
+    avx512Real dirZ = avx512_set1(dir.z);
+    avx512Real tMinLanes = avx512_set1(tMin);
+    avx512Real tMaxLanes = avx512_set1(tMax);
+
+    real best = INFINITY;
+    size_t bestIndex = 0;
+    real lanes[AVX512_LANES * 2];
+    size_t end = start + count;
+
+    // Two registers of spheres per step, the last step masked down to what
+    // is left
+    for(size_t i = start; i < end; i += AVX512_LANES * 2) {
+        avx512_storeu(lanes, sphereLanesAvx512(spheres, i, end, originX,
+            originY, originZ, dirX, dirY, dirZ, tMinLanes, tMaxLanes,
+            rejected));
+        if(i + AVX512_LANES < end) {
+            avx512_storeu(lanes + AVX512_LANES, sphereLanesAvx512(spheres,
+                i + AVX512_LANES, end, originX, originY, originZ, dirX, dirY,
+                dirZ, tMinLanes, tMaxLanes, rejected));
+        }
+        else {
+            avx512_storeu(lanes + AVX512_LANES, avx512_set1(INFINITY));
+        }
+        for(size_t lane = 0; lane < AVX512_LANES * 2; lane++) {
+            if(lanes[lane] < best) {
+                best = lanes[lane];
+                bestIndex = i + lane;
+            }
+        }
+    }
+
+    if(best == INFINITY) {
+        return 0;
+    }
+
+    *t = best;
+    *index = bestIndex;
+
+    return 1;
+}
+
+#else
+
+// Without x86 SIMD every variant is the scalar one; kernel_supported()
+// reports them as unavailable so they are never picked automatically.
+int spheres_nearest_sse42(const sceneSpheres* spheres, size_t start,
+        size_t count, vector3d origin, vector3d dir, real tMin, real tMax,
+        real* t, size_t* index, size_t* rejected) {
+    return spheres_nearest_scalar(spheres, start, count, origin, dir, tMin,
+        tMax, t, index, rejected);
+}
+
+int spheres_nearest_avx2(const sceneSpheres* spheres, size_t start,
+        size_t count, vector3d origin, vector3d dir, real tMin, real tMax,
+        real* t, size_t* index, size_t* rejected) {
+    return spheres_nearest_scalar(spheres, start, count, origin, dir, tMin,
+        tMax, t, index, rejected);
+}
+
+int spheres_nearest_avx512(const sceneSpheres* spheres, size_t start,
+        size_t count, vector3d origin, vector3d dir, real tMin, real tMax,
+        real* t, size_t* index, size_t* rejected) {
+    return spheres_nearest_scalar(spheres, start, count, origin, dir, tMin,
+        tMax, t, index, rejected);
+}
+
+#endif // KERNELS_X86
@@ -0,0 +1,62 @@
+#ifndef CS430_KERNELS_H
+#define CS430_KERNELS_H
+
+#include <stddef.h>
+
+#include "scene.h"
+#include "vector3d.h"
+
+#define KERNEL_AUTO -1
+#define KERNEL_SCALAR 0
+#define KERNEL_SSE42 1
+#define KERNEL_AVX2 2
+#define KERNEL_AVX512 3
+#define KERNEL_COUNT 4
+
+// Relative margin for rejecting spheres before the exact test (see
+// kernels.c), shared with the other intersection paths
+#ifdef CS430_SINGLE_PRECISION
+#define REJECT_SLACK (1 + 1e-5)
+#else
+#define REJECT_SLACK (1 + 1e-12)
+#endif
+
+// Intersects one ray with spheres [start, start + count). Returns 1 and sets
+// 't' and 'index' to the nearest hit in (tMin, tMax], preferring the lowest
+// index on ties, or returns 0 if there is none. Spheres settled by the
+// interval before any square root are counted in 'rejected'.
+typedef int (*sphereKernel)(const sceneSpheres* spheres, size_t start,
+    size_t count, vector3d origin, vector3d dir, real tMin, real tMax, real* t,
+    size_t* index, size_t* rejected);
+
+// The kernel used by the renderer, chosen by kernel_init()
+extern sphereKernel spheres_nearest;
+
+int kernel_init(int kernel);
+int kernel_supported(int kernel);
+int kernel_best();
+int kernel_find(const char* name);
+const char* kernel_name(int kernel);
+sphereKernel kernel_get(int kernel);
+
+int spheres_nearest_scalar(const sceneSpheres* spheres, size_t start,
+    size_t count, vector3d origin, vector3d dir, real tMin, real tMax, real* t,
+    size_t* index, size_t* rejected);
+int spheres_nearest_sse42(const sceneSpheres* spheres, size_t start,
+    size_t count, vector3d origin, vector3d dir, real tMin, real tMax, real* t,
+    size_t* index, size_t* rejected);
+int spheres_nearest_avx2(const sceneSpheres* spheres, size_t start,
+    size_t count, vector3d origin, vector3d dir, real tMin, real tMax, real* t,
+    size_t* index, size_t* rejected);
+int spheres_nearest_avx512(const sceneSpheres* spheres, size_t start,
+    size_t count, vector3d origin, vector3d dir, real tMin, real tMax, real* t,
+    size_t* index, size_t* rejected);
+
+// Any-hit test for shadow rays: returns 1 and sets 'index' to the first sphere
+// in [start, start + count) hit in (tMin, tMax]. Same arithmetic as the
+// nearest-hit kernels, but no closest t is tracked.
+int spheres_occluded(const sceneSpheres* spheres, size_t start, size_t count,
+    vector3d origin, vector3d dir, real tMin, real tMax, size_t* index,
+    size_t* rejected);
+
+#endif // CS430_KERNELS_H
@@ -1,77 +1,689 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "json.h"
+#include "kernels.h"
+#include "pipeline.h"
+#include "png.h"
+#include "qoi.h"
 #include "raycast.h"
 #include "pnm.h"
+#include "resample.h"
+#include "threadpool.h"
 #include "write.h"
 
+#define POSITIONAL_ARGS 4
+// Bytes of finished bands that may wait for the writer thread before the
+// renderer waits for it in turn
+#define PIPELINE_QUEUE_BYTES (64 << 20)
+
+// Output formats, picked from the output file's extension
+#define FORMAT_PPM 0
+#define FORMAT_QOI 1
+#define FORMAT_PNG 2
+
+typedef struct previewTarget {
+    const char* path;
+    int format;
+    pnmHeader header;
+    size_t threads;
+} previewTarget;
+
+typedef struct streamTarget {
+    pnmHeader header;
+    FILE* outputFd;
+    pipelineWriter* writer;
+    resampleTarget* extras;
+    size_t extraCount;
+} streamTarget;
+
+// An output besides the full image, given on the command line before the
+// image's size is known
+typedef struct extraOutput {
+    const char* path;
+    // Downscale factor, or 0 for a crop of 'width' by 'height' from (x, y)
+    size_t factor;
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+} extraOutput;
+
+int parseSize(const char* str, size_t* value);
+int parseReal(const char* str, double* value);
+int parseCrop(const char* str, extraOutput* output);
+int outputFormat(const char* path);
+int writeImage(const char* path, int format, pnmHeader header,
+    const pixel* pixels, size_t threads);
+void writePreview(const pixel* pixels, size_t pass, void* arg);
+int streamImage(const char* path, pnmHeader header, camera camera,
+    const scene* scene, renderOptions options, int pipelined,
+    resampleTarget* extras, size_t extraCount);
+void writeRows(const pixel* rows, size_t firstRow, size_t rowCount,
+    void* arg);
+size_t renderCrops(resampleTarget* crops, size_t count, size_t width,
+    size_t height, camera camera, const scene* scene, renderOptions options);
+int writeExtras(const extraOutput* outputs, resampleTarget* targets,
+    size_t count, int mode, size_t threads, const renderStats* stats);
+void addStats(renderStats* total, const renderStats* stats);
+void printStats(const renderOptions* options, size_t pixels);
+
 int main(int argc, char const *argv[]) {
-    if(argc < 5) {
-        fprintf(stderr, "usage: raycast width height /path/to/input.json "
-                "/path/to/output.ppm\n");
+    const char* positional[POSITIONAL_ARGS];
+    size_t positionalCount = 0;
+    renderOptions options = defaultRenderOptions();
+    size_t threshold;
+    renderStats stats = { 0 };
+    int kernel = KERNEL_AUTO;
+    int mapped = 0;
+    int streamed = 0;
+    int pipelined = 0;
+    int mode = 6;
+    // There can be no more extra outputs than arguments
+    extraOutput* extras = calloc(argc, sizeof(*extras));
+    size_t extraCount = 0;
+    int downscaled = 0;
+    if(extras == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
         return 1;
     }
-    jsonObj jsonObj = readScene(argv[3]);
-    if(*(jsonObj.objs) == NULL) {
-        return 0;
-    }
-
-    vector3d zeroVector = { 0 };
 
-    for(size_t i = 0; jsonObj.objs[i] != NULL; i++) {
-        if(jsonObj.objs[i]->type == TYPE_PLANE) {
-            if(vector3d_compare(jsonObj.objs[i]->plane.normal, zeroVector) != 0) {
-                jsonObj.objs[i]->plane.normal = vector3d_normalize(jsonObj.objs[i]->plane.normal);
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--threads") == 0) {
+            if(i + 1 >= argc || parseSize(argv[++i], &(options.threads)) < 0) {
+                fprintf(stderr, "Error: '--threads' requires a thread count\n");
+                return 1;
             }
         }
+        else if(strcmp(argv[i], "--kernel") == 0) {
+            if(i + 1 >= argc || (kernel = kernel_find(argv[++i])) < KERNEL_AUTO) {
+                fprintf(stderr, "Error: '--kernel' must be one of auto, scalar, "
+                    "sse4.2, avx2 or avx512\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--no-packets") == 0) {
+            options.packets = 0;
+        }
+        else if(strcmp(argv[i], "--stats") == 0) {
+            options.stats = &stats;
+        }
+        else if(strcmp(argv[i], "--progressive") == 0) {
+            options.passStride = PROGRESSIVE_STRIDE;
+        }
+        else if(strcmp(argv[i], "--aa") == 0) {
+            options.aaSamples = DEFAULT_AA_SAMPLES;
+        }
+        else if(strcmp(argv[i], "--aa-samples") == 0) {
+            if(i + 1 >= argc || parseSize(argv[++i], &(options.aaSamples)) < 0) {
+                fprintf(stderr, "Error: '--aa-samples' requires a sample count\n");
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--aa-threshold") == 0) {
+            if(i + 1 >= argc || parseSize(argv[++i], &threshold) < 0 ||
+                    threshold > 255) {
+                fprintf(stderr, "Error: '--aa-threshold' must be from 0 to 255\n");
+                return 1;
+            }
+            options.aaThreshold = threshold;
+        }
+        else if(strcmp(argv[i], "--no-light-culling") == 0) {
+            options.lightCulling = 0;
+        }
+        else if(strcmp(argv[i], "--mmap") == 0) {
+            mapped = 1;
+        }
+        else if(strcmp(argv[i], "--stream") == 0) {
+            streamed = 1;
+        }
+        else if(strcmp(argv[i], "--pipeline") == 0) {
+            streamed = 1;
+            pipelined = 1;
+        }
+        else if(strcmp(argv[i], "--ascii") == 0) {
+            mode = 3;
+        }
+        else if(strcmp(argv[i], "--wavefront") == 0) {
+            options.wavefront = 1;
+        }
+        else if(strcmp(argv[i], "--max-depth") == 0) {
+            if(i + 1 >= argc || parseSize(argv[++i], &(options.maxDepth)) < 0 ||
+                    options.maxDepth > MAX_DEPTH_LIMIT) {
+                fprintf(stderr, "Error: '--max-depth' requires a bounce count "
+                    "up to %d\n", MAX_DEPTH_LIMIT);
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--min-weight") == 0) {
+            double weight;
+            if(i + 1 >= argc || parseReal(argv[++i], &weight) < 0 ||
+                    !(weight >= 0 && weight <= 1)) {
+                fprintf(stderr, "Error: '--min-weight' must be from 0 to 1\n");
+                return 1;
+            }
+            options.minWeight = weight;
+        }
+        else if(strcmp(argv[i], "--downscale") == 0) {
+            extraOutput* output = &(extras[extraCount++]);
+            if(i + 2 >= argc || parseSize(argv[++i], &(output->factor)) < 0 ||
+                    output->factor == 0) {
+                fprintf(stderr, "Error: '--downscale' requires a factor of at "
+                    "least 1 and an output path\n");
+                return 1;
+            }
+            output->path = argv[++i];
+            downscaled = 1;
+        }
+        else if(strcmp(argv[i], "--crop") == 0) {
+            extraOutput* output = &(extras[extraCount++]);
+            if(i + 2 >= argc || parseCrop(argv[++i], output) < 0) {
+                fprintf(stderr, "Error: '--crop' requires a region "
+                    "WIDTHxHEIGHT+X+Y and an output path\n");
+                return 1;
+            }
+            output->path = argv[++i];
+        }
+        else if(strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            return 1;
+        }
+        else if(positionalCount < POSITIONAL_ARGS) {
+            positional[positionalCount++] = argv[i];
+        }
+        else {
+            fprintf(stderr, "Error: Too many arguments\n");
+            return 1;
+        }
     }
 
-    for(size_t i = 0; jsonObj.lights[i] != NULL; i++) {
-        if(vector3d_compare(jsonObj.lights[i]->dir, zeroVector) != 0) {
-            jsonObj.lights[i]->dir = vector3d_normalize(jsonObj.lights[i]->dir);
-        }
+    // The full image may be left out when something else is written instead
+    if(positionalCount < POSITIONAL_ARGS - (extraCount > 0 ? 1 : 0)) {
+        fprintf(stderr, "usage: raycast [--threads N] [--kernel NAME] "
+                "[--no-packets] [--stats] [--progressive] [--aa] "
+                "[--aa-samples N] [--aa-threshold N] [--max-depth N] "
+                "[--min-weight F] [--wavefront] [--no-light-culling] [--mmap] "
+                "[--stream] [--pipeline] [--ascii] "
+                "[--downscale N /path/to/output] "
+                "[--crop WIDTHxHEIGHT+X+Y /path/to/output] "
+                "width height /path/to/input.json "
+                "[/path/to/output.{ppm,qoi,png}]\n");
+        return 1;
+    }
+    int full = positionalCount == POSITIONAL_ARGS;
+    if(!full && (mapped || streamed || options.passStride > 1)) {
+        fprintf(stderr, "Error: '--mmap', '--stream', '--pipeline' and "
+            "'--progressive' need the full image as an output\n");
+        return 1;
+    }
+    int format = full ? outputFormat(positional[3]) : FORMAT_PPM;
+    if(format != FORMAT_PPM && (mapped || streamed || mode != 6)) {
+        fprintf(stderr, "Error: '--mmap', '--stream', '--pipeline' and "
+            "'--ascii' only apply to PPM output\n");
+        return 1;
+    }
+    if(mapped && options.passStride > 1) {
+        fprintf(stderr, "Error: '--mmap' cannot be used with '--progressive'\n");
+        return 1;
+    }
+    if(mapped && mode != 6) {
+        fprintf(stderr, "Error: '--mmap' cannot be used with '--ascii'\n");
+        return 1;
+    }
+    // Streaming never holds the whole image, which these all need
+    if(streamed && (mapped || options.passStride > 1 ||
+            options.aaSamples > 0 || options.wavefront)) {
+        fprintf(stderr, "Error: '--stream' and '--pipeline' cannot be used "
+            "with '--mmap', '--progressive', '--aa' or '--wavefront'\n");
+        return 1;
+    }
+    if(kernel_init(kernel) < 0) {
+        return 1;
+    }
+    jsonObj jsonObj = readScene(positional[2]);
+    if(*(jsonObj.objs) == NULL && *(jsonObj.instances) == NULL) {
+        return 0;
     }
 
-    char* endptr;
-    size_t width = strtoul(argv[1], &endptr, 10);
-    // If the first character is not empty and the set first invalid
-    // character is empty, then the whole string is valid. (see 'man strtol')
-    // Otherwise, part of the string is not a number.
-    if(!(*(argv[1]) != '\0' && *endptr == '\0')) {
+    scene scene = buildScene(jsonObj.objs, jsonObj.lights, jsonObj.groups,
+        jsonObj.instances);
+
+    size_t width;
+    if(parseSize(positional[0], &width) < 0) {
         fprintf(stderr, "Error: Invalid decimal value on channel\n");
         return 1;
     }
-    size_t height = strtoul(argv[2], &endptr, 10);
-    // If the first character is not empty and the set first invalid
-    // character is empty, then the whole string is valid. (see 'man strtol')
-    // Otherwise, part of the string is not a number.
-    if(!(*(argv[2]) != '\0' && *endptr == '\0')) {
+    size_t height;
+    if(parseSize(positional[1], &height) < 0) {
         fprintf(stderr, "Error: Invalid decimal value on channel\n");
         return 1;
     }
 
-    pixel* pixels = malloc(sizeof(*pixels) * width * height);
-    if(pixels == NULL) {
+    resampleTarget* targets = calloc(extraCount, sizeof(*targets));
+    if(extraCount > 0 && targets == NULL) {
         fprintf(stderr, "Error: Memory allocation error\n");
         return 1;
     }
+    for(size_t i = 0; i < extraCount; i++) {
+        extraOutput* output = &(extras[i]);
+        if(output->factor > 0) {
+            if(resample_downscale(&(targets[i]), output->factor, width,
+                    height) < 0) {
+                return 1;
+            }
+        }
+        else if(output->x > width || output->width > width - output->x ||
+                output->y > height || output->height > height - output->y) {
+            fprintf(stderr, "Error: Crop for '%s' is outside the image\n",
+                output->path);
+            return 1;
+        }
+        else if(resample_crop(&(targets[i]), output->x, output->y,
+                output->width, output->height) < 0) {
+            return 1;
+        }
+    }
 
-    raycast(pixels, width, height, jsonObj.camera, jsonObj.objs, jsonObj.lights);
+    pnmHeader header = { mode, width, height, 255 };
+    if(streamed) {
+        if(streamImage(positional[3], header, jsonObj.camera, &scene,
+                options, pipelined, targets, extraCount) < 0) {
+            return 1;
+        }
+        printStats(&options, width * height);
+        return writeExtras(extras, targets, extraCount, mode, options.threads,
+            options.stats) < 0 ? 1 : 0;
+    }
 
-    FILE* outputFd;
-    if((outputFd = fopen(argv[4], "w")) == NULL) {
-        perror("Error: Cannot open output file\n");
+    // Crops alone render only their own pixels
+    if(!full && !downscaled) {
+        size_t rendered = renderCrops(targets, extraCount, width, height,
+            jsonObj.camera, &scene, options);
+        printStats(&options, rendered);
+        return writeExtras(extras, targets, extraCount, mode, options.threads,
+            options.stats) < 0 ? 1 : 0;
+    }
+
+    pnmMap map;
+    pixel* pixels;
+    // A mapped output is rendered into in place, so there is nothing left to
+    // write afterwards
+    if(mapped) {
+        if(mapImage(positional[3], header, &map) < 0) {
+            return 1;
+        }
+        pixels = map.pixels;
+    }
+    else if((pixels = malloc(sizeof(*pixels) * width * height)) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
         return 1;
     }
 
-    pnmHeader header = { 6, width, height, 255 };
+    previewTarget preview = { full ? positional[3] : NULL, format, header,
+        options.threads };
+    if(options.passStride > 1) {
+        options.onPass = writePreview;
+        options.passArg = &preview;
+    }
+
+    raycast(pixels, width, height, jsonObj.camera, &scene, options);
+
+    printStats(&options, width * height);
+
+    // Every downscale and crop comes out of one pass over the image
+    resample_addRows(targets, extraCount, pixels, 0, height, width, height);
+
+    if(mapped) {
+        if(unmapImage(&map) < 0) {
+            return 1;
+        }
+    }
+    else if(full) {
+        double start = threadpool_now();
+        if(writeImage(positional[3], format, header, pixels,
+                options.threads) < 0) {
+            return 1;
+        }
+        // Throughput is measured against the raw pixels, so every format is
+        // compared on the same amount of work
+        if(options.stats != NULL) {
+            double elapsed = threadpool_now() - start;
+            fprintf(stderr, "Write: %.1f ms (%.1f MB/s)\n", elapsed * 1e3,
+                3.0 * width * height / (1 << 20) / elapsed);
+        }
+    }
+
+    return writeExtras(extras, targets, extraCount, mode, options.threads,
+        options.stats) < 0 ? 1 : 0;
+}
+
+// Renders each crop through a window of its own. Anti-aliasing finds edges by
+// comparing neighbours, so the window takes a pixel more on every side the
+// image allows, and the crop matches the same pixels of a full render. Returns
+// how many pixels were rendered.
+size_t renderCrops(resampleTarget* crops, size_t count, size_t width,
+        size_t height, camera camera, const scene* scene,
+        renderOptions options) {
+    renderStats* total = options.stats;
+    renderStats stats;
+    if(total != NULL) {
+        options.stats = &stats;
+    }
+    size_t margin = options.aaSamples > 0 ? 1 : 0;
+    size_t rendered = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        resampleTarget crop = crops[i];
+        size_t left = crop.x < margin ? 0 : crop.x - margin;
+        size_t top = crop.y < margin ? 0 : crop.y - margin;
+        size_t right = width - crop.x - crop.width < margin ? width :
+            crop.x + crop.width + margin;
+        size_t bottom = height - crop.y - crop.height < margin ? height :
+            crop.y + crop.height + margin;
+
+        options.windowX = left;
+        options.windowY = top;
+        options.windowWidth = right - left;
+        options.windowHeight = bottom - top;
+        pixel* window = malloc(sizeof(*window) * options.windowWidth *
+            options.windowHeight);
+        if(window == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        raycast(window, width, height, camera, scene, options);
+
+        // Cut the crop out of the window as if the window were the image
+        crop.x -= left;
+        crop.y -= top;
+        resample_addRows(&crop, 1, window, 0, options.windowHeight,
+            options.windowWidth, options.windowHeight);
+        free(window);
+
+        rendered += options.windowWidth * options.windowHeight;
+        if(total != NULL) {
+            addStats(total, &stats);
+        }
+    }
+
+    return rendered;
+}
+
+// Writes every downscale and crop, each in the format its extension names.
+// '--ascii' applies to those written as PPM.
+int writeExtras(const extraOutput* outputs, resampleTarget* targets,
+        size_t count, int mode, size_t threads, const renderStats* stats) {
+    double start = threadpool_now();
+    int status = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        resampleTarget* target = &(targets[i]);
+        pnmHeader header = { mode, target->width, target->height, 255 };
+        if(status == 0 && writeImage(outputs[i].path,
+                outputFormat(outputs[i].path), header, target->pixels,
+                threads) < 0) {
+            status = -1;
+        }
+        resample_free(target);
+    }
+    if(stats != NULL && count > 0 && status == 0) {
+        fprintf(stderr, "Extra outputs: %zu written in %.1f ms\n", count,
+            (threadpool_now() - start) * 1e3);
+    }
+
+    return status;
+}
+
+void addStats(renderStats* total, const renderStats* stats) {
+    total->primaryRays += stats->primaryRays;
+    total->secondaryRays += stats->secondaryRays;
+    total->culledRays += stats->culledRays;
+    total->shadowRays += stats->shadowRays;
+    total->occluderHits += stats->occluderHits;
+    total->rejectedTests += stats->rejectedTests;
+    total->culledLights += stats->culledLights;
+    total->refinedPixels += stats->refinedPixels;
+}
+
+void printStats(const renderOptions* options, size_t pixels) {
+    const renderStats* stats = options->stats;
+    if(stats == NULL) {
+        return;
+    }
+
+    fprintf(stderr, "Primary rays: %zu\n", stats->primaryRays);
+    fprintf(stderr, "Secondary rays: %zu\n", stats->secondaryRays);
+    fprintf(stderr, "Culled secondary rays: %zu\n", stats->culledRays);
+    fprintf(stderr, "Shadow rays: %zu\n", stats->shadowRays);
+    fprintf(stderr, "Occluder cache hits: %zu (%.1f%%)\n",
+        stats->occluderHits, stats->shadowRays == 0 ? 0.0 :
+        100.0 * stats->occluderHits / stats->shadowRays);
+    fprintf(stderr, "Culled light samples: %zu\n", stats->culledLights);
+    fprintf(stderr, "Tests rejected early: %zu\n", stats->rejectedTests);
+#ifdef CS430_COUNT_MATH
+    fprintf(stderr, "Normalizations: %zu\n",
+        atomic_load(&vector3d_normalizeCount));
+    fprintf(stderr, "Square roots: %zu\n", atomic_load(&vector3d_sqrtCount));
+#endif
+    if(options->aaSamples > 0) {
+        fprintf(stderr, "Refined pixels: %zu (%.1f%%)\n",
+            stats->refinedPixels, 100.0 * stats->refinedPixels / pixels);
+    }
+}
+
+// Anything not ending in .qoi or .png is written as a PPM, as it always was
+int outputFormat(const char* path) {
+    const char* extension = strrchr(path, '.');
+    if(extension != NULL && strcasecmp(extension, ".qoi") == 0) {
+        return FORMAT_QOI;
+    }
+    if(extension != NULL && strcasecmp(extension, ".png") == 0) {
+        return FORMAT_PNG;
+    }
+
+    return FORMAT_PPM;
+}
+
+int writeImage(const char* path, int format, pnmHeader header,
+        const pixel* pixels, size_t threads) {
+    if(format == FORMAT_QOI) {
+        return qoi_write(path, pixels, header.width, header.height, threads);
+    }
+    if(format == FORMAT_PNG) {
+        return png_write(path, pixels, header.width, header.height, threads);
+    }
+
+    FILE* outputFd;
+    if((outputFd = fopen(path, "w")) == NULL) {
+        perror("Error: Cannot open output file\n");
+        return -1;
+    }
 
     if(writeHeader(header, outputFd) < 0) {
-        return 1;
+        fclose(outputFd);
+        return -1;
     }
-    if(writeBody(header, pixels, outputFd) < 0) {
-        return 1;
+    if(writeBody(header, pixels, outputFd, threads) < 0) {
+        fclose(outputFd);
+        return -1;
+    }
+
+    if(fclose(outputFd) != 0) {
+        perror("Error: Cannot write output file\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Renders and writes the image a tile row at a time. Rows come back in order,
+// and P6 and P3 both lay out each row on its own, so every band is written
+// as a short image body right after the last. Pipelined, each band is
+// formatted into a buffer of its own and handed to a writer thread, so the
+// worker that finished it goes straight back to rendering.
+int streamImage(const char* path, pnmHeader header, camera camera,
+        const scene* scene, renderOptions options, int pipelined,
+        resampleTarget* extras, size_t extraCount) {
+    pipelineWriter writer;
+    streamTarget target = { header, NULL, NULL, extras, extraCount };
+    if(pipelined) {
+        if(pipeline_open(&writer, path, PIPELINE_QUEUE_BYTES) < 0) {
+            return -1;
+        }
+        target.writer = &writer;
+
+        char* buffer = malloc(PNM_HEADER_MAX);
+        int length;
+        if(buffer == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        if((length = formatHeader(header, buffer, PNM_HEADER_MAX)) < 0 ||
+                pipeline_write(&writer, buffer, length) < 0) {
+            pipeline_close(&writer);
+            return -1;
+        }
+    }
+    else {
+        if((target.outputFd = fopen(path, "w")) == NULL) {
+            perror("Error: Cannot open output file\n");
+            return -1;
+        }
+        if(writeHeader(header, target.outputFd) < 0) {
+            fclose(target.outputFd);
+            return -1;
+        }
+    }
+
+    double start = threadpool_now();
+    raycastStream(header.width, header.height, camera, scene, options,
+        writeRows, &target);
+
+    if(pipelined) {
+        double rendered = threadpool_now();
+        if(pipeline_close(&writer) < 0) {
+            return -1;
+        }
+        if(options.stats != NULL) {
+            fprintf(stderr, "Writer: %zu buffers, %zu through io_uring\n",
+                writer.buffers, writer.ringWrites);
+            fprintf(stderr, "Render: %.1f ms, waiting on the writer %.1f ms\n",
+                (rendered - start) * 1e3, writer.waitSeconds * 1e3);
+            fprintf(stderr, "Write after render: %.1f ms\n",
+                (threadpool_now() - rendered) * 1e3);
+        }
+    }
+    else if(fclose(target.outputFd) != 0) {
+        perror("Error: Cannot write output file\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+void writeRows(const pixel* rows, size_t firstRow, size_t rowCount,
+        void* arg) {
+    streamTarget* target = arg;
+    pnmHeader band = target->header;
+    band.height = rowCount;
+    resample_addRows(target->extras, target->extraCount, rows, firstRow,
+        rowCount, band.width, target->header.height);
+
+    int status;
+    if(target->writer != NULL) {
+        char* buffer = malloc(bodySizeMax(band));
+        if(buffer == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        status = pipeline_write(target->writer, buffer,
+            formatBody(band, rows, buffer));
+    }
+    else {
+        // Every other worker is still rendering, so the band is formatted
+        // on this one rather than on a pool of its own
+        status = writeBody(band, rows, target->outputFd, 1);
+    }
+    if(status < 0) {
+        fprintf(stderr, "Error: Cannot write rows %zu to %zu\n", firstRow,
+            firstRow + rowCount - 1);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Rewrites the output after each progressive pass. The preview goes to a
+// temporary file first and is renamed into place, so anything watching the
+// output never reads a half-written image.
+void writePreview(const pixel* pixels, size_t pass, void* arg) {
+    previewTarget* preview = arg;
+    static const char suffix[] = ".part";
+
+    char* tempPath = malloc(strlen(preview->path) + sizeof(suffix));
+    if(tempPath == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    strcpy(tempPath, preview->path);
+    strcat(tempPath, suffix);
+
+    if(writeImage(tempPath, preview->format, preview->header, pixels,
+            preview->threads) < 0 ||
+            rename(tempPath, preview->path) != 0) {
+        fprintf(stderr, "Error: Cannot write preview of pass %zu\n", pass + 1);
+        remove(tempPath);
+        exit(EXIT_FAILURE);
+    }
+
+    free(tempPath);
+}
+
+int parseSize(const char* str, size_t* value) {
+    char* endptr;
+    *value = strtoul(str, &endptr, 10);
+    // If the first character is not empty and the set first invalid
+    // character is empty, then the whole string is valid. (see 'man strtol')
+    // Otherwise, part of the string is not a number.
+    if(!(*str != '\0' && *endptr == '\0')) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Parses a region written as WIDTHxHEIGHT+X+Y, as X11 geometry is
+int parseCrop(const char* str, extraOutput* output) {
+    size_t* values[4] = { &(output->width), &(output->height), &(output->x),
+        &(output->y) };
+    const char separators[4] = { 'x', '+', '+', '\0' };
+    char* endptr;
+
+    for(int i = 0; i < 4; i++) {
+        if(*str < '0' || *str > '9') {
+            return -1;
+        }
+        *values[i] = strtoul(str, &endptr, 10);
+        if(*endptr != separators[i]) {
+            return -1;
+        }
+        str = endptr + 1;
+    }
+    if(output->width == 0 || output->height == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int parseReal(const char* str, double* value) {
+    char* endptr;
+    *value = strtod(str, &endptr);
+    // Same as parseSize(), the whole string has to be the number
+    if(!(*str != '\0' && *endptr == '\0')) {
+        return -1;
     }
 
     return 0;
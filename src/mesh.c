@@ -0,0 +1,458 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "kernels.h"
+#include "mesh.h"
+
+// Elements the vertex and index buffers start out with
+#define INITIAL_CAPACITY 4096
+// Keeps every node index of the mesh's BVH within 32 bits
+#define MESH_MAX_TRIANGLES (UINT32_MAX / 2)
+
+int growBuffer(void** buffer, size_t* capacity, size_t needed, size_t size);
+int readVertex(char** cursor, float* vertex);
+int readFaceIndex(char** cursor, size_t vertexCount, uint32_t* index);
+
+static inline real vectorAxis(vector3d vector, int axis) {
+    return axis == 0 ? vector.x : (axis == 1 ? vector.y : vector.z);
+}
+
+// Same slab test as aabb_hit(), against a packed node
+static inline int nodeHit(const meshNode* node, const meshRay* ray,
+        real tMax) {
+    real t1 = (node->min[0] - ray->origin.x) * ray->invDir.x;
+    real t2 = (node->max[0] - ray->origin.x) * ray->invDir.x;
+    real tNear = fmin(t1, t2);
+    real tFar = fmax(t1, t2);
+
+    t1 = (node->min[1] - ray->origin.y) * ray->invDir.y;
+    t2 = (node->max[1] - ray->origin.y) * ray->invDir.y;
+    tNear = fmax(tNear, fmin(t1, t2));
+    tFar = fmin(tFar, fmax(t1, t2));
+
+    t1 = (node->min[2] - ray->origin.z) * ray->invDir.z;
+    t2 = (node->max[2] - ray->origin.z) * ray->invDir.z;
+    tNear = fmax(tNear, fmin(t1, t2));
+    tFar = fmin(tFar, fmax(t1, t2));
+
+    return tNear <= tFar && tFar > 0 && tNear <= tMax;
+}
+
+sceneMesh* mesh_load(const char* path) {
+    FILE* obj = fopen(path, "r");
+    if(obj == NULL) {
+        fprintf(stderr, "Error: Cannot open mesh '%s'\n", path);
+        return NULL;
+    }
+
+    sceneMesh* mesh = calloc(1, sizeof(*mesh));
+    if(mesh == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        fclose(obj);
+        return NULL;
+    }
+
+    size_t vertexCapacity = 0;
+    size_t triangleCapacity = 0;
+    char* line = NULL;
+    size_t lineSize = 0;
+    size_t lineNumber = 0;
+    const char* error = NULL;
+
+    while(error == NULL && getline(&line, &lineSize, obj) != -1) {
+        lineNumber++;
+        char* cursor = line;
+        while(isspace((unsigned char)*cursor)) {
+            cursor++;
+        }
+
+        if(cursor[0] == 'v' && isspace((unsigned char)cursor[1])) {
+            if(mesh->vertexCount == UINT32_MAX) {
+                error = "Too many vertices";
+            }
+            else if(growBuffer((void**)&(mesh->vertices), &vertexCapacity,
+                    (mesh->vertexCount + 1) * 3, sizeof(float)) < 0) {
+                error = "Memory allocation error";
+            }
+            else if(readVertex(&cursor, &(mesh->vertices[mesh->vertexCount * 3]))
+                    < 0) {
+                error = "Invalid vertex";
+            }
+            else {
+                mesh->vertexCount++;
+            }
+        }
+        else if(cursor[0] == 'f' && isspace((unsigned char)cursor[1])) {
+            // Every corner past the second closes a triangle with the first
+            // corner and the one before it
+            uint32_t first = 0, previous = 0, current;
+            size_t corners = 0;
+            int status;
+            cursor++;
+
+            while((status = readFaceIndex(&cursor, mesh->vertexCount,
+                    &current)) > 0) {
+                if(corners == 0) {
+                    first = current;
+                }
+                else if(corners >= 2) {
+                    if(mesh->triangleCount == MESH_MAX_TRIANGLES) {
+                        error = "Too many triangles";
+                        break;
+                    }
+                    if(growBuffer((void**)&(mesh->indices), &triangleCapacity,
+                            (mesh->triangleCount + 1) * 3,
+                            sizeof(uint32_t)) < 0) {
+                        error = "Memory allocation error";
+                        break;
+                    }
+                    uint32_t* triangle = &(mesh->indices[mesh->triangleCount * 3]);
+                    triangle[0] = first;
+                    triangle[1] = previous;
+                    triangle[2] = current;
+                    mesh->triangleCount++;
+                }
+                previous = current;
+                corners++;
+            }
+
+            if(error == NULL && status < 0) {
+                error = "Invalid face vertex";
+            }
+            else if(error == NULL && corners < 3) {
+                error = "Face needs at least three vertices";
+            }
+        }
+    }
+
+    if(error == NULL && ferror(obj)) {
+        error = "Read error";
+    }
+    free(line);
+    fclose(obj);
+
+    if(error != NULL) {
+        fprintf(stderr, "Error: Mesh '%s' line %zu: %s\n", path, lineNumber,
+            error);
+        mesh_free(mesh);
+        return NULL;
+    }
+
+    if(mesh->triangleCount == 0) {
+        fprintf(stderr, "Warning: Mesh '%s' has no faces\n", path);
+    }
+    else {
+        // Give back what the last doubling did not use
+        float* vertices = realloc(mesh->vertices,
+            sizeof(*vertices) * mesh->vertexCount * 3);
+        uint32_t* indices = realloc(mesh->indices,
+            sizeof(*indices) * mesh->triangleCount * 3);
+        if(vertices != NULL) {
+            mesh->vertices = vertices;
+        }
+        if(indices != NULL) {
+            mesh->indices = indices;
+        }
+    }
+
+    return mesh;
+}
+
+void mesh_free(sceneMesh* mesh) {
+    if(mesh == NULL) {
+        return;
+    }
+
+    free(mesh->vertices);
+    free(mesh->indices);
+    free(mesh->nodes);
+    free(mesh);
+}
+
+// Makes room for 'needed' elements, doubling the capacity so a mesh of n
+// elements takes O(log n) reallocations
+int growBuffer(void** buffer, size_t* capacity, size_t needed, size_t size) {
+    if(needed <= *capacity) {
+        return 0;
+    }
+
+    size_t newCapacity = *capacity > 0 ? *capacity : INITIAL_CAPACITY;
+    while(newCapacity < needed) {
+        newCapacity *= 2;
+    }
+
+    void* grown = realloc(*buffer, newCapacity * size);
+    if(grown == NULL) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = newCapacity;
+
+    return 0;
+}
+
+// Reads the x, y and z of a 'v' line. An optional w is ignored.
+int readVertex(char** cursor, float* vertex) {
+    char* start = *cursor + 1;
+
+    for(size_t i = 0; i < 3; i++) {
+        char* end;
+        errno = 0;
+        double value = strtod(start, &end);
+        if(end == start || errno == ERANGE) {
+            return -1;
+        }
+        vertex[i] = value;
+        if(!isfinite(vertex[i])) {
+            return -1;
+        }
+        start = end;
+    }
+    *cursor = start;
+
+    return 0;
+}
+
+// Reads the vertex of the next 'v', 'v/vt', 'v//vn' or 'v/vt/vn' corner of a
+// face as a zero-based index. Returns 0 at the end of the line, and -1 if the
+// corner is malformed or refers to a vertex not defined yet.
+int readFaceIndex(char** cursor, size_t vertexCount, uint32_t* index) {
+    char* start = *cursor;
+    while(isspace((unsigned char)*start)) {
+        start++;
+    }
+    if(*start == '\0' || *start == '#') {
+        *cursor = start;
+        return 0;
+    }
+
+    char* end;
+    errno = 0;
+    long long value = strtoll(start, &end, 10);
+    if(end == start || errno == ERANGE) {
+        return -1;
+    }
+    // Negative indices count back from the latest vertex
+    if(value < 0) {
+        value += vertexCount;
+    }
+    else {
+        value--;
+    }
+    if(value < 0 || (unsigned long long)value >= vertexCount) {
+        return -1;
+    }
+    *index = value;
+
+    // Texture and normal indices are not used
+    while(*end != '\0' && !isspace((unsigned char)*end)) {
+        if(*end != '/' && *end != '-' && !isdigit((unsigned char)*end)) {
+            return -1;
+        }
+        end++;
+    }
+    *cursor = end;
+
+    return 1;
+}
+
+meshRay mesh_ray(vector3d origin, vector3d dir) {
+    meshRay ray;
+    ray.origin = origin;
+    ray.dir = dir;
+    ray.invDir.x = 1 / dir.x;
+    ray.invDir.y = 1 / dir.y;
+    ray.invDir.z = 1 / dir.z;
+
+    real absX = fabs(dir.x);
+    real absY = fabs(dir.y);
+    real absZ = fabs(dir.z);
+    ray.axisZ = absX > absY ? (absX > absZ ? 0 : 2) : (absY > absZ ? 1 : 2);
+    ray.axisX = (ray.axisZ + 1) % 3;
+    ray.axisY = (ray.axisX + 1) % 3;
+    // Swapping the other two axes keeps the winding, and so the sign of the
+    // edge functions, the same for rays heading the other way
+    real dirZ = vectorAxis(dir, ray.axisZ);
+    if(dirZ < 0) {
+        int swap = ray.axisX;
+        ray.axisX = ray.axisY;
+        ray.axisY = swap;
+    }
+
+    ray.shearX = vectorAxis(dir, ray.axisX) / dirZ;
+    ray.shearY = vectorAxis(dir, ray.axisY) / dirZ;
+    ray.shearZ = 1 / dirZ;
+
+    return ray;
+}
+
+// Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection" (JCGT
+// 2013). The vertices are moved into a space where the ray starts at the
+// origin and runs along +z, and the signs of the 2D edge functions decide the
+// hit. Neighbouring triangles compute the same value for a shared edge, so no
+// ray slips through the crack between them.
+real triangle_intersection(const sceneMesh* mesh, size_t index,
+        const meshRay* ray, real tMin, real tMax, size_t* rejected) {
+    const uint32_t* triangle = &(mesh->indices[index * 3]);
+    const float* first = &(mesh->vertices[triangle[0] * 3]);
+    const float* second = &(mesh->vertices[triangle[1] * 3]);
+    const float* third = &(mesh->vertices[triangle[2] * 3]);
+    real origin[3] = { ray->origin.x, ray->origin.y, ray->origin.z };
+    int axisX = ray->axisX, axisY = ray->axisY, axisZ = ray->axisZ;
+
+    real aZ = first[axisZ] - origin[axisZ];
+    real bZ = second[axisZ] - origin[axisZ];
+    real cZ = third[axisZ] - origin[axisZ];
+    real aX = first[axisX] - origin[axisX] - ray->shearX * aZ;
+    real aY = first[axisY] - origin[axisY] - ray->shearY * aZ;
+    real bX = second[axisX] - origin[axisX] - ray->shearX * bZ;
+    real bY = second[axisY] - origin[axisY] - ray->shearY * bZ;
+    real cX = third[axisX] - origin[axisX] - ray->shearX * cZ;
+    real cY = third[axisY] - origin[axisY] - ray->shearY * cZ;
+
+    real u = cX * bY - cY * bX;
+    real v = aX * cY - aY * cX;
+    real w = bX * aY - bY * aX;
+#ifdef CS430_SINGLE_PRECISION
+    // A float edge function that rounds to exactly zero cannot say which
+    // side the ray is on, so it is worked out again in double
+    if(u == 0 || v == 0 || w == 0) {
+        u = (double)cX * bY - (double)cY * bX;
+        v = (double)aX * cY - (double)aY * cX;
+        w = (double)bX * aY - (double)bY * aX;
+    }
+#endif
+
+    if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) {
+        return -1;
+    }
+    real det = u + v + w;
+    if(det == 0) {
+        return -1;
+    }
+
+    // t scaled by the determinant, so the interval can be checked before
+    // dividing
+    real t = ray->shearZ * (u * aZ + v * bZ + w * cZ);
+    if(det < 0) {
+        t = -t;
+        det = -det;
+    }
+    if(t <= 0 || t > tMax * det * REJECT_SLACK) {
+        (*rejected)++;
+        return -1;
+    }
+
+    t /= det;
+    if(t > tMin && t <= tMax) {
+        return t;
+    }
+
+    return -1;
+}
+
+int mesh_nearest(const sceneMesh* mesh, const meshRay* ray, real tMin,
+        real tMax, real* t, size_t* triangle, size_t* rejected) {
+    if(mesh->nodeCount == 0) {
+        return 0;
+    }
+
+    const meshNode* nodes = mesh->nodes;
+    size_t stack[BVH_MAX_DEPTH];
+    size_t stackSize = 0;
+    size_t index = 0;
+    int found = 0;
+
+    for(;;) {
+        const meshNode* node = &(nodes[index]);
+        if(nodeHit(node, ray, tMax)) {
+            if(node->count == 0) {
+                // Near child first, so the far one can be culled against the
+                // closest hit
+                if(vectorAxis(ray->dir, node->axis) < 0) {
+                    stack[stackSize++] = index + 1;
+                    index = node->offset;
+                }
+                else {
+                    stack[stackSize++] = node->offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+
+            for(size_t i = node->offset; i < node->offset + node->count; i++) {
+                real hit = triangle_intersection(mesh, i, ray, tMin, tMax,
+                    rejected);
+                if(hit > 0 && (!found || hit < *t)) {
+                    *t = hit;
+                    *triangle = i;
+                    found = 1;
+                    tMax = hit;
+                }
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        index = stack[--stackSize];
+    }
+
+    return found;
+}
+
+int mesh_occluded(const sceneMesh* mesh, const meshRay* ray, real tMin,
+        real tMax, size_t* triangle, size_t* rejected) {
+    if(mesh->nodeCount == 0) {
+        return 0;
+    }
+
+    const meshNode* nodes = mesh->nodes;
+    size_t stack[BVH_MAX_DEPTH];
+    size_t stackSize = 0;
+    size_t index = 0;
+
+    for(;;) {
+        const meshNode* node = &(nodes[index]);
+        if(nodeHit(node, ray, tMax)) {
+            if(node->count == 0) {
+                stack[stackSize++] = node->offset;
+                index = index + 1;
+                continue;
+            }
+
+            for(size_t i = node->offset; i < node->offset + node->count; i++) {
+                if(triangle_intersection(mesh, i, ray, tMin, tMax,
+                        rejected) > 0) {
+                    *triangle = i;
+                    return 1;
+                }
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        index = stack[--stackSize];
+    }
+
+    return 0;
+}
+
+vector3d mesh_normal(const sceneMesh* mesh, size_t index) {
+    const uint32_t* triangle = &(mesh->indices[index * 3]);
+    const float* first = &(mesh->vertices[triangle[0] * 3]);
+    const float* second = &(mesh->vertices[triangle[1] * 3]);
+    const float* third = &(mesh->vertices[triangle[2] * 3]);
+    vector3d edge1 = { second[0] - first[0], second[1] - first[1],
+        second[2] - first[2] };
+    vector3d edge2 = { third[0] - first[0], third[1] - first[1],
+        third[2] - first[2] };
+
+    return vector3d_normalize(vector3d_cross(edge1, edge2));
+}
@@ -0,0 +1,47 @@
+#ifndef CS430_MESH_H
+#define CS430_MESH_H
+
+#include <stddef.h>
+
+#include "scene.h"
+#include "vector3d.h"
+
+// A ray set up for the watertight triangle test. Its axes are permuted so the
+// largest direction component comes last, and the shear that maps the
+// direction onto that axis is worked out once for every triangle it meets.
+typedef struct meshRay {
+    vector3d origin;
+    vector3d dir;
+    vector3d invDir;
+    int axisX;
+    int axisY;
+    int axisZ;
+    real shearX;
+    real shearY;
+    real shearZ;
+} meshRay;
+
+// Reads the vertices and faces of an OBJ file a line at a time into growing
+// buffers. Polygons are split into fans of triangles, and everything but
+// 'v' and 'f' lines is skipped. Returns NULL after printing an error.
+sceneMesh* mesh_load(const char* path);
+void mesh_free(sceneMesh* mesh);
+
+meshRay mesh_ray(vector3d origin, vector3d dir);
+// Returns the hit's t if the ray meets triangle 'index' in (tMin, tMax], or
+// -1. Rays through a shared edge or vertex always hit one of the triangles
+// around it.
+real triangle_intersection(const sceneMesh* mesh, size_t index,
+    const meshRay* ray, real tMin, real tMax, size_t* rejected);
+// Nearest hit in (tMin, tMax] through the mesh's BVH, preferring the
+// triangle found first on ties
+int mesh_nearest(const sceneMesh* mesh, const meshRay* ray, real tMin,
+    real tMax, real* t, size_t* triangle, size_t* rejected);
+// Any-hit query for shadow rays
+int mesh_occluded(const sceneMesh* mesh, const meshRay* ray, real tMin,
+    real tMax, size_t* triangle, size_t* rejected);
+// Unit normal of a triangle, facing the side its vertices wind
+// counter-clockwise around
+vector3d mesh_normal(const sceneMesh* mesh, size_t index);
+
+#endif // CS430_MESH_H
@@ -0,0 +1,140 @@
+#ifndef CS430_PACKET_H
+#define CS430_PACKET_H
+
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#include "vector3d.h"
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Number of rays traced together. The lanes are GCC vector extensions, which
+// lower to AVX-512, AVX or pairs of SSE2 registers depending on what the
+// compiler is allowed to target. Single precision fits twice the lanes.
+#if defined(__AVX512F__)
+#define PACKET_BYTES 64
+#else
+#define PACKET_BYTES 32
+#endif
+
+#ifdef CS430_SINGLE_PRECISION
+#define PACKET_SIZE (PACKET_BYTES / 4)
+typedef int packetLane;
+#else
+#define PACKET_SIZE (PACKET_BYTES / 8)
+typedef long long packetLane;
+#endif
+
+// Once fewer lanes than this are still interested in a subtree, the packet is
+// considered diverged and the remaining lanes are traced as single rays
+#define PACKET_MIN_ACTIVE 2
+
+// Packets never cross a translation unit boundary, so GCC's note that wide
+// vectors are passed differently with and without AVX does not apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef real packetReal __attribute__((vector_size(PACKET_BYTES)));
+typedef packetLane packetMask __attribute__((vector_size(PACKET_BYTES)));
+
+typedef struct rayPacket {
+    packetReal originX, originY, originZ;
+    packetReal dirX, dirY, dirZ;
+    packetReal invDirX, invDirY, invDirZ;
+    // Bit i is set if lane i carries a ray
+    unsigned int active;
+} rayPacket;
+
+static inline packetReal packet_set1(real value) {
+    packetReal packet;
+    for(size_t i = 0; i < PACKET_SIZE; i++) {
+        packet[i] = value;
+    }
+
+    return packet;
+}
+
+// Lane-wise 'mask ? first : second', where mask lanes are all ones or zeros
+static inline packetReal packet_select(packetMask mask, packetReal first,
+        packetReal second) {
+    packetMask result = (mask & (packetMask)first) | (~mask & (packetMask)second);
+
+    return (packetReal)result;
+}
+
+static inline packetReal packet_min(packetReal first, packetReal second) {
+    return packet_select(first < second, first, second);
+}
+
+static inline packetReal packet_max(packetReal first, packetReal second) {
+    return packet_select(first > second, first, second);
+}
+
+static inline packetReal packet_sqrt(packetReal value) {
+#if defined(CS430_SINGLE_PRECISION) && defined(__AVX512F__)
+    __m512 lanes;
+    memcpy(&lanes, &value, sizeof(lanes));
+    lanes = _mm512_sqrt_ps(lanes);
+    memcpy(&value, &lanes, sizeof(lanes));
+#elif defined(CS430_SINGLE_PRECISION) && defined(__AVX__)
+    __m256 lanes;
+    memcpy(&lanes, &value, sizeof(lanes));
+    lanes = _mm256_sqrt_ps(lanes);
+    memcpy(&value, &lanes, sizeof(lanes));
+#elif defined(CS430_SINGLE_PRECISION) && defined(__SSE2__)
+    for(size_t i = 0; i < PACKET_SIZE; i += 4) {
+        __m128 lanes;
+        memcpy(&lanes, (real*)&value + i, sizeof(lanes));
+        lanes = _mm_sqrt_ps(lanes);
+        memcpy((real*)&value + i, &lanes, sizeof(lanes));
+    }
+#elif defined(__AVX512F__)
+    __m512d lanes;
+    memcpy(&lanes, &value, sizeof(lanes));
+    lanes = _mm512_sqrt_pd(lanes);
+    memcpy(&value, &lanes, sizeof(lanes));
+#elif defined(__AVX__)
+    __m256d lanes;
+    memcpy(&lanes, &value, sizeof(lanes));
+    lanes = _mm256_sqrt_pd(lanes);
+    memcpy(&value, &lanes, sizeof(lanes));
+#elif defined(__SSE2__)
+    for(size_t i = 0; i < PACKET_SIZE; i += 2) {
+        __m128d lanes = _mm_set_pd(value[i + 1], value[i]);
+        lanes = _mm_sqrt_pd(lanes);
+        value[i] = _mm_cvtsd_f64(lanes);
+        value[i + 1] = _mm_cvtsd_f64(_mm_unpackhi_pd(lanes, lanes));
+    }
+#else
+    for(size_t i = 0; i < PACKET_SIZE; i++) {
+        value[i] = sqrt(value[i]);
+    }
+#endif
+
+    return value;
+}
+
+// Collapse a lane mask into one bit per lane
+static inline unsigned int packet_bits(packetMask mask) {
+    unsigned int bits = 0;
+    for(size_t i = 0; i < PACKET_SIZE; i++) {
+        if(mask[i]) {
+            bits |= 1u << i;
+        }
+    }
+
+    return bits;
+}
+
+static inline int packet_count(unsigned int bits) {
+    int count = 0;
+    for(; bits != 0; bits &= bits - 1) {
+        count++;
+    }
+
+    return count;
+}
+
+#endif // CS430_PACKET_H
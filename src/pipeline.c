@@ -0,0 +1,447 @@
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "threadpool.h"
+
+// io_uring is used through its system calls directly, so all it needs is a
+// Linux kernel header new enough to describe it. Build with
+// -DCS430_NO_IO_URING to always use pwrite().
+#if defined(__linux__) && !defined(CS430_NO_IO_URING) && \
+    defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define PIPELINE_IO_URING
+#endif
+#endif
+#endif
+
+// Writes in flight at once through io_uring
+#define RING_ENTRIES 8
+// A write's length has to fit the submission's 32-bit field
+#define RING_WRITE_MAX (1u << 30)
+
+void* writerThread(void* arg);
+int writeBuffer(pipelineWriter* writer, pipelineBuffer* buffer,
+    size_t written);
+pipelineRing* ringOpen();
+void ringClose(pipelineRing* ring);
+int ringBusy(const pipelineWriter* writer);
+int ringPass(pipelineWriter* writer, pipelineBuffer** pending,
+    pipelineBuffer** done, int failed);
+
+int pipeline_open(pipelineWriter* writer, const char* path, size_t maxQueued) {
+    memset(writer, 0, sizeof(*writer));
+    writer->maxQueued = maxQueued;
+    if((writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        return -1;
+    }
+
+    writer->ring = ringOpen();
+    pthread_mutex_init(&(writer->lock), NULL);
+    pthread_cond_init(&(writer->queued), NULL);
+    pthread_cond_init(&(writer->drained), NULL);
+    if(pthread_create(&(writer->thread), NULL, writerThread, writer) != 0) {
+        fprintf(stderr, "Error: Cannot start writer thread\n");
+        pthread_mutex_destroy(&(writer->lock));
+        pthread_cond_destroy(&(writer->queued));
+        pthread_cond_destroy(&(writer->drained));
+        ringClose(writer->ring);
+        close(writer->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+int pipeline_write(pipelineWriter* writer, void* data, size_t size) {
+    pipelineBuffer* buffer = malloc(sizeof(*buffer));
+    if(buffer == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&(writer->lock));
+    if(writer->queuedBytes > 0 &&
+            writer->queuedBytes + size > writer->maxQueued && !writer->failed) {
+        double start = threadpool_now();
+        while(writer->queuedBytes > 0 &&
+                writer->queuedBytes + size > writer->maxQueued &&
+                !writer->failed) {
+            pthread_cond_wait(&(writer->drained), &(writer->lock));
+        }
+        writer->waitSeconds += threadpool_now() - start;
+    }
+    if(writer->failed) {
+        pthread_mutex_unlock(&(writer->lock));
+        free(buffer);
+        free(data);
+        return -1;
+    }
+
+    buffer->data = data;
+    buffer->size = size;
+    buffer->offset = writer->end;
+    buffer->next = NULL;
+    if(writer->tail == NULL) {
+        writer->head = buffer;
+    }
+    else {
+        writer->tail->next = buffer;
+    }
+    writer->tail = buffer;
+    writer->end += size;
+    writer->queuedBytes += size;
+    writer->buffers++;
+    pthread_cond_signal(&(writer->queued));
+    pthread_mutex_unlock(&(writer->lock));
+
+    return 0;
+}
+
+int pipeline_close(pipelineWriter* writer) {
+    pthread_mutex_lock(&(writer->lock));
+    writer->closing = 1;
+    pthread_cond_signal(&(writer->queued));
+    pthread_mutex_unlock(&(writer->lock));
+    pthread_join(writer->thread, NULL);
+
+    ringClose(writer->ring);
+    if(close(writer->fd) != 0 && !writer->failed) {
+        fprintf(stderr, "Error: Cannot write output file\n");
+        writer->failed = 1;
+    }
+    pthread_mutex_destroy(&(writer->lock));
+    pthread_cond_destroy(&(writer->queued));
+    pthread_cond_destroy(&(writer->drained));
+
+    return writer->failed ? -1 : 0;
+}
+
+// Moves everything queued onto a list of its own and writes it outside the
+// lock. With a ring, each pass keeps up to RING_ENTRIES writes in flight and
+// waits for at least one of them, so new buffers are picked up as the
+// earlier ones finish.
+void* writerThread(void* arg) {
+    pipelineWriter* writer = arg;
+    pipelineBuffer* pending = NULL;
+    pipelineBuffer* pendingTail = NULL;
+    int failed = 0;
+
+    pthread_mutex_lock(&(writer->lock));
+    while(1) {
+        while(writer->head == NULL && pending == NULL && !ringBusy(writer) &&
+                !writer->closing) {
+            pthread_cond_wait(&(writer->queued), &(writer->lock));
+        }
+        if(writer->head == NULL && pending == NULL && !ringBusy(writer)) {
+            break;
+        }
+        if(writer->head != NULL) {
+            if(pending == NULL) {
+                pending = writer->head;
+            }
+            else {
+                pendingTail->next = writer->head;
+            }
+            pendingTail = writer->tail;
+            writer->head = NULL;
+            writer->tail = NULL;
+        }
+        pthread_mutex_unlock(&(writer->lock));
+
+        pipelineBuffer* done = NULL;
+        if(writer->ring != NULL) {
+            if(ringPass(writer, &pending, &done, failed) < 0) {
+                failed = 1;
+            }
+        }
+        else {
+            while(pending != NULL) {
+                pipelineBuffer* buffer = pending;
+                pending = buffer->next;
+                if(!failed && writeBuffer(writer, buffer, 0) < 0) {
+                    failed = 1;
+                }
+                buffer->next = done;
+                done = buffer;
+            }
+        }
+
+        size_t doneBytes = 0;
+        while(done != NULL) {
+            pipelineBuffer* next = done->next;
+            doneBytes += done->size;
+            free(done->data);
+            free(done);
+            done = next;
+        }
+
+        pthread_mutex_lock(&(writer->lock));
+        writer->failed = failed;
+        writer->queuedBytes -= doneBytes;
+        pthread_cond_broadcast(&(writer->drained));
+    }
+    pthread_mutex_unlock(&(writer->lock));
+
+    return NULL;
+}
+
+// Writes what is left of 'buffer' past its first 'written' bytes
+int writeBuffer(pipelineWriter* writer, pipelineBuffer* buffer,
+        size_t written) {
+    const char* data = buffer->data;
+
+    while(written < buffer->size) {
+        ssize_t result = pwrite(writer->fd, data + written,
+            buffer->size - written, buffer->offset + written);
+        if(result < 0 && errno == EINTR) {
+            continue;
+        }
+        if(result <= 0) {
+            fprintf(stderr, "Error: Cannot write output file: %s\n",
+                result < 0 ? strerror(errno) : "no space written");
+            return -1;
+        }
+        written += result;
+    }
+
+    return 0;
+}
+
+#ifdef PIPELINE_IO_URING
+
+struct pipelineRing {
+    int fd;
+    unsigned entries;
+    unsigned inFlight;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+};
+
+int ringEnter(pipelineRing* ring, unsigned submit, unsigned wait);
+int ringComplete(pipelineWriter* writer, struct io_uring_cqe* cqe);
+
+// Returns NULL, so writes fall back to pwrite(), wherever the kernel or a
+// sandbox refuses io_uring
+pipelineRing* ringOpen() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    pipelineRing* ring = calloc(1, sizeof(*ring));
+    if(ring == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Newer kernels share one mapping between both rings
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single && ring->cqMapSize > ring->sqMapSize) {
+        ring->sqMapSize = ring->cqMapSize;
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cqMap = single ? ring->sqMap : mmap(NULL, ring->cqMapSize,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    // A shared mapping is only unmapped once, as the submission ring
+    if(single) {
+        ring->cqMapSize = 0;
+    }
+    if(ring->sqMap == MAP_FAILED || ring->cqMap == MAP_FAILED ||
+            ring->sqes == MAP_FAILED) {
+        ringClose(ring);
+        return NULL;
+    }
+
+    char* sq = ring->sqMap;
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    char* cq = ring->cqMap;
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+void ringClose(pipelineRing* ring) {
+    if(ring == NULL) {
+        return;
+    }
+
+    if(ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if(ring->cqMapSize > 0 && ring->cqMap != MAP_FAILED) {
+        munmap(ring->cqMap, ring->cqMapSize);
+    }
+    if(ring->sqMap != NULL && ring->sqMap != MAP_FAILED) {
+        munmap(ring->sqMap, ring->sqMapSize);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+int ringBusy(const pipelineWriter* writer) {
+    return writer->ring != NULL && writer->ring->inFlight > 0;
+}
+
+// Submits buffers from the front of 'pending' while the ring has room, then
+// waits for at least one write to finish and moves every finished buffer
+// onto 'done'. After a failure nothing new is submitted, but writes already
+// in flight are still waited for, as the kernel reads from their buffers.
+int ringPass(pipelineWriter* writer, pipelineBuffer** pending,
+        pipelineBuffer** done, int failed) {
+    pipelineRing* ring = writer->ring;
+    unsigned submit = 0;
+    unsigned tail = *(ring->sqTail);
+
+    while(*pending != NULL && (failed ||
+            ring->inFlight + submit < ring->entries)) {
+        pipelineBuffer* buffer = *pending;
+        *pending = buffer->next;
+        if(failed) {
+            buffer->next = *done;
+            *done = buffer;
+            continue;
+        }
+
+        unsigned index = tail & ring->sqMask;
+        struct io_uring_sqe* sqe = &(ring->sqes[index]);
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = writer->fd;
+        sqe->addr = (uintptr_t)buffer->data;
+        sqe->len = buffer->size < RING_WRITE_MAX ? buffer->size : RING_WRITE_MAX;
+        sqe->off = buffer->offset;
+        sqe->user_data = (uintptr_t)buffer;
+        ring->sqArray[index] = index;
+        tail++;
+        submit++;
+    }
+    if(submit > 0) {
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+    }
+    if(ring->inFlight + submit == 0) {
+        return failed ? -1 : 0;
+    }
+
+    if(ringEnter(ring, submit, 1) < 0) {
+        // Nothing can be relied on to finish now, so the buffers in flight
+        // are leaked rather than freed under the kernel
+        fprintf(stderr, "Error: Cannot submit writes: %s\n", strerror(errno));
+        ring->inFlight = 0;
+        return -1;
+    }
+    ring->inFlight += submit;
+
+    unsigned head = *(ring->cqHead);
+    while(head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe* cqe = &(ring->cqes[head & ring->cqMask]);
+        pipelineBuffer* buffer = (pipelineBuffer*)(uintptr_t)cqe->user_data;
+        if(!failed && ringComplete(writer, cqe) < 0) {
+            failed = 1;
+        }
+        ring->inFlight--;
+        head++;
+        buffer->next = *done;
+        *done = buffer;
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+
+    return failed ? -1 : 0;
+}
+
+int ringEnter(pipelineRing* ring, unsigned submit, unsigned wait) {
+    while(syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+            IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if(errno != EINTR) {
+            return -1;
+        }
+        // Anything submitted before the interruption is not submitted again
+        submit = 0;
+    }
+
+    return 0;
+}
+
+// A write the kernel cut short, or one it cannot do through the ring at
+// all (before Linux 5.6), is finished with pwrite()
+int ringComplete(pipelineWriter* writer, struct io_uring_cqe* cqe) {
+    pipelineBuffer* buffer = (pipelineBuffer*)(uintptr_t)cqe->user_data;
+    if(cqe->res >= 0) {
+        writer->ringWrites++;
+        return writeBuffer(writer, buffer, cqe->res);
+    }
+    if(cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP ||
+            cqe->res == -EAGAIN || cqe->res == -EINTR) {
+        return writeBuffer(writer, buffer, 0);
+    }
+
+    fprintf(stderr, "Error: Cannot write output file: %s\n",
+        strerror(-cqe->res));
+    return -1;
+}
+
+#else
+
+pipelineRing* ringOpen() {
+    return NULL;
+}
+
+void ringClose(pipelineRing* ring) {
+    (void)ring;
+}
+
+int ringBusy(const pipelineWriter* writer) {
+    (void)writer;
+    return 0;
+}
+
+int ringPass(pipelineWriter* writer, pipelineBuffer** pending,
+        pipelineBuffer** done, int failed) {
+    (void)writer;
+    (void)pending;
+    (void)done;
+    return failed ? -1 : 0;
+}
+
+#endif
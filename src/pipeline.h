@@ -0,0 +1,57 @@
+#ifndef CS430_PIPELINE_H
+#define CS430_PIPELINE_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+// A buffer queued to be written, and where in the file it goes
+typedef struct pipelineBuffer {
+    void* data;
+    size_t size;
+    size_t offset;
+    struct pipelineBuffer* next;
+} pipelineBuffer;
+
+// Submission and completion rings shared with the kernel, when io_uring is
+// available
+typedef struct pipelineRing pipelineRing;
+
+// Writes buffers to a file on a thread of its own while the caller goes on
+// with other work. Buffers are written one after another in the order they
+// were queued, through io_uring with several in flight where the kernel
+// allows it, or with pwrite() otherwise.
+typedef struct pipelineWriter {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Signalled when a buffer is queued or the writer is closed, and when
+    // queued bytes are written
+    pthread_cond_t queued;
+    pthread_cond_t drained;
+    pipelineBuffer* head;
+    pipelineBuffer* tail;
+    size_t queuedBytes;
+    size_t maxQueued;
+    size_t end;
+    int closing;
+    int failed;
+    pipelineRing* ring;
+
+    // Buffers queued, how many of them went through io_uring, and how long
+    // callers waited for room in the queue
+    size_t buffers;
+    size_t ringWrites;
+    double waitSeconds;
+} pipelineWriter;
+
+// Creates 'path' and starts its writer thread. Callers wait once more than
+// 'maxQueued' bytes are queued, unless the queue is empty.
+int pipeline_open(pipelineWriter* writer, const char* path, size_t maxQueued);
+// Queues 'data', allocated with malloc(), to be written after everything
+// queued so far. The writer frees it once written, or right away on error.
+int pipeline_write(pipelineWriter* writer, void* data, size_t size);
+// Waits for every queued buffer to be written and closes the file. Returns
+// -1 if any write failed.
+int pipeline_close(pipelineWriter* writer);
+
+#endif // CS430_PIPELINE_H
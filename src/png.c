@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deflate.h"
+#include "png.h"
+#include "threadpool.h"
+
+// Filtered bytes per stripe. Each stripe starts compressing with an empty
+// window, so much smaller stripes cost some compression.
+#define PNG_STRIPE_BYTES (1 << 20)
+#define PNG_FILTERS 5
+
+// One stripe's share of the zlib stream, and the checksums over it
+typedef struct pngStripe {
+    deflateOutput out;
+    uint32_t crc;
+    uint32_t adler;
+    size_t size;
+} pngStripe;
+
+// Stripe 'task' is compressed into 'stripes[task % window]' and written out
+// as an IDAT chunk when it retires
+typedef struct pngJob {
+    const pixel* pixels;
+    size_t width;
+    size_t height;
+    size_t rowsPerStripe;
+    size_t stripeCount;
+    size_t window;
+    pngStripe* stripes;
+    FILE* outputFd;
+    // Adler-32 of every stripe written so far
+    uint32_t adler;
+    int status;
+} pngJob;
+
+static const unsigned char signature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+};
+static uint32_t crcTable[256];
+
+void compressStripe(size_t task, size_t worker, void* arg);
+void writeStripeChunk(size_t task, void* arg);
+void filterRow(const unsigned char* row, const unsigned char* above,
+    size_t size, unsigned char* scratch, unsigned char* filtered);
+void packRow(const pixel* row, size_t width, unsigned char* bytes);
+int writeChunk(FILE* outputFd, const char* type, const unsigned char* data,
+    size_t size, uint32_t crc);
+uint32_t chunkCrc(const char* type, const unsigned char* data, size_t size);
+uint32_t updateCrc(uint32_t crc, const unsigned char* data, size_t size);
+void putBigEndian(unsigned char* bytes, uint32_t value);
+
+// The distances from the estimate left + up - upLeft, worked out so every
+// path is plain arithmetic and selects the compiler can vectorize
+static inline unsigned char paeth(unsigned char left, unsigned char up,
+        unsigned char upLeft) {
+    int leftDistance = abs(up - upLeft);
+    int upDistance = abs(left - upLeft);
+    int upLeftDistance = abs(left + up - 2 * upLeft);
+    unsigned char nearer = upDistance <= upLeftDistance ? up : upLeft;
+
+    return leftDistance <= upDistance && leftDistance <= upLeftDistance ?
+        left : nearer;
+}
+
+// A filtered byte's distance from 0, read as a signed byte
+static inline unsigned magnitude(unsigned char value) {
+    return value < 128 ? value : 256 - value;
+}
+
+int png_write(const char* path, const pixel* pixels, size_t width,
+        size_t height, size_t threads) {
+    if(width > 0x7fffffff || height > 0x7fffffff) {
+        fprintf(stderr, "Error: PNG images are at most %u pixels across\n",
+            0x7fffffff);
+        return -1;
+    }
+    if(threads == 0) {
+        threads = threadpool_cores();
+    }
+
+    // Built here, before any worker needs it
+    for(uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+        }
+        crcTable[i] = crc;
+    }
+
+    size_t rowBytes = 1 + width * 3;
+    pngJob job = { pixels, width, height, PNG_STRIPE_BYTES / rowBytes, 0, 0,
+        NULL, NULL, 1, 0 };
+    if(job.rowsPerStripe == 0) {
+        job.rowsPerStripe = 1;
+    }
+    job.stripeCount = (height + job.rowsPerStripe - 1) / job.rowsPerStripe;
+    job.window = job.stripeCount < threads * 2 ? job.stripeCount :
+        threads * 2;
+    if((job.stripes = calloc(job.window, sizeof(*job.stripes))) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return -1;
+    }
+
+    FILE* outputFd = fopen(path, "wb");
+    if(outputFd == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        free(job.stripes);
+        return -1;
+    }
+
+    // 8 bits per channel, RGB, deflate, adaptive filtering, no interlacing
+    unsigned char header[13] = { 0 };
+    putBigEndian(header, width);
+    putBigEndian(header + 4, height);
+    header[8] = 8;
+    header[9] = 2;
+    // The zlib stream starts with a header for deflate with a 32K window
+    static const unsigned char zlibHeader[2] = { 0x78, 0x9c };
+    job.outputFd = outputFd;
+    if(fwrite(signature, 1, sizeof(signature), outputFd) != sizeof(signature) ||
+            writeChunk(outputFd, "IHDR", header, sizeof(header),
+            chunkCrc("IHDR", header, sizeof(header))) < 0 ||
+            writeChunk(outputFd, "IDAT", zlibHeader, sizeof(zlibHeader),
+            chunkCrc("IDAT", zlibHeader, sizeof(zlibHeader))) < 0) {
+        job.status = -1;
+    }
+
+    if(job.status == 0 && threadpool_runOrdered(threads, job.stripeCount, 1,
+            job.window, compressStripe, writeStripeChunk, &job) < 0) {
+        job.status = -1;
+    }
+
+    // The Adler-32 trailer is only known once every stripe is done, so it
+    // closes the stream in an IDAT chunk of its own
+    unsigned char trailer[4];
+    putBigEndian(trailer, job.adler);
+    int status = job.status;
+    if(status == 0 && (writeChunk(outputFd, "IDAT", trailer, sizeof(trailer),
+            chunkCrc("IDAT", trailer, sizeof(trailer))) < 0 ||
+            writeChunk(outputFd, "IEND", NULL, 0, chunkCrc("IEND", NULL, 0)) < 0)) {
+        status = -1;
+    }
+
+    if(fclose(outputFd) != 0 || status < 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        status = -1;
+    }
+    free(job.stripes);
+
+    return status;
+}
+
+void compressStripe(size_t task, size_t worker, void* arg) {
+    (void)worker;
+    pngJob* job = arg;
+    size_t start = task * job->rowsPerStripe;
+    size_t end = start + job->rowsPerStripe;
+    if(end > job->height) {
+        end = job->height;
+    }
+
+    size_t size = job->width * 3;
+    size_t rowBytes = 1 + size;
+    unsigned char* filtered = malloc(rowBytes * (end - start));
+    // This row and the one above unfiltered, then a candidate for each
+    // filter that changes the bytes
+    unsigned char* rows = malloc(size * (1 + PNG_FILTERS));
+    if(filtered == NULL || rows == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned char* row = rows;
+    unsigned char* above = rows + size;
+    if(start == 0) {
+        memset(above, 0, size);
+    }
+    else {
+        packRow(&(job->pixels[(start - 1) * job->width]), job->width, above);
+    }
+
+    for(size_t y = start; y < end; y++) {
+        packRow(&(job->pixels[y * job->width]), job->width, row);
+        filterRow(row, above, size, rows + 2 * size,
+            filtered + (y - start) * rowBytes);
+        unsigned char* swap = above;
+        above = row;
+        row = swap;
+    }
+
+    pngStripe* stripe = &(job->stripes[task % job->window]);
+    stripe->size = rowBytes * (end - start);
+    stripe->adler = deflate_adler32(1, filtered, stripe->size);
+    memset(&(stripe->out), 0, sizeof(stripe->out));
+    deflate_compress(filtered, stripe->size, task + 1 == job->stripeCount,
+        &(stripe->out));
+    stripe->crc = chunkCrc("IDAT", stripe->out.data, stripe->out.size);
+
+    free(filtered);
+    free(rows);
+}
+
+// Writes a compressed stripe out as its own IDAT chunk, or after a failed
+// write only frees it
+void writeStripeChunk(size_t task, void* arg) {
+    pngJob* job = arg;
+    pngStripe* stripe = &(job->stripes[task % job->window]);
+    job->adler = deflate_combineAdler32(job->adler, stripe->adler,
+        stripe->size);
+    if(job->status == 0 && writeChunk(job->outputFd, "IDAT", stripe->out.data,
+            stripe->out.size, stripe->crc) < 0) {
+        job->status = -1;
+    }
+    deflate_free(&(stripe->out));
+}
+
+// Tries every filter on the row and keeps the one whose output has the
+// smallest sum of magnitudes (as signed bytes), the usual heuristic for
+// what compresses best. The first pixel, with nothing to its left, is done
+// apart from the rest so the loops over the others stay branch free.
+void filterRow(const unsigned char* row, const unsigned char* above,
+        size_t size, unsigned char* scratch, unsigned char* filtered) {
+    unsigned char* sub = scratch;
+    unsigned char* up = scratch + size;
+    unsigned char* average = scratch + 2 * size;
+    unsigned char* predicted = scratch + 3 * size;
+    unsigned long sums[PNG_FILTERS] = { 0 };
+
+    for(size_t i = 0; i < size && i < 3; i++) {
+        sub[i] = row[i];
+        up[i] = row[i] - above[i];
+        average[i] = row[i] - above[i] / 2;
+        predicted[i] = up[i];
+        sums[0] += magnitude(row[i]);
+        sums[1] += magnitude(sub[i]);
+        sums[2] += magnitude(up[i]);
+        sums[3] += magnitude(average[i]);
+        sums[4] += magnitude(predicted[i]);
+    }
+    for(size_t i = 3; i < size; i++) {
+        sub[i] = row[i] - row[i - 3];
+        up[i] = row[i] - above[i];
+        average[i] = row[i] - (row[i - 3] + above[i]) / 2;
+        predicted[i] = row[i] - paeth(row[i - 3], above[i], above[i - 3]);
+        sums[0] += magnitude(row[i]);
+        sums[1] += magnitude(sub[i]);
+        sums[2] += magnitude(up[i]);
+        sums[3] += magnitude(average[i]);
+        sums[4] += magnitude(predicted[i]);
+    }
+
+    int best = 0;
+    for(int filter = 1; filter < PNG_FILTERS; filter++) {
+        if(sums[filter] < sums[best]) {
+            best = filter;
+        }
+    }
+
+    filtered[0] = best;
+    memcpy(filtered + 1, best == 0 ? row : scratch + (best - 1) * size, size);
+}
+
+void packRow(const pixel* row, size_t width, unsigned char* bytes) {
+    for(size_t x = 0; x < width; x++) {
+        bytes[x * 3] = row[x].red;
+        bytes[x * 3 + 1] = row[x].green;
+        bytes[x * 3 + 2] = row[x].blue;
+    }
+}
+
+int writeChunk(FILE* outputFd, const char* type, const unsigned char* data,
+        size_t size, uint32_t crc) {
+    unsigned char length[4];
+    unsigned char checksum[4];
+    putBigEndian(length, size);
+    putBigEndian(checksum, crc);
+
+    if(fwrite(length, 1, 4, outputFd) != 4 ||
+            fwrite(type, 1, 4, outputFd) != 4 ||
+            (size > 0 && fwrite(data, 1, size, outputFd) != size) ||
+            fwrite(checksum, 1, 4, outputFd) != 4) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// CRC-32 over a chunk's type and data
+uint32_t chunkCrc(const char* type, const unsigned char* data, size_t size) {
+    uint32_t crc = updateCrc(0xffffffff, (const unsigned char*)type, 4);
+
+    return updateCrc(crc, data, size) ^ 0xffffffff;
+}
+
+uint32_t updateCrc(uint32_t crc, const unsigned char* data, size_t size) {
+    for(size_t i = 0; i < size; i++) {
+        crc = crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+void putBigEndian(unsigned char* bytes, uint32_t value) {
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
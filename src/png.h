@@ -0,0 +1,14 @@
+#ifndef CS430_PNG_H
+#define CS430_PNG_H
+
+#include <stddef.h>
+
+#include "pnm.h"
+
+// Writes the pixels as an 8-bit RGB PNG. Stripes of rows are filtered and
+// compressed on 'threads' workers (0 uses every core), each into an IDAT
+// chunk of its own. Returns -1 after printing an error.
+int png_write(const char* path, const pixel* pixels, size_t width,
+    size_t height, size_t threads);
+
+#endif // CS430_PNG_H
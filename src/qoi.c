@@ -0,0 +1,219 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qoi.h"
+#include "threadpool.h"
+
+// Pixels per stripe. Stripes share nothing but the pixel before them, so
+// only runs and index hits across a boundary are lost.
+#define QOI_STRIPE_PIXELS (1 << 18)
+// An RGB op is the largest any pixel can take
+#define QOI_PIXEL_MAX 4
+#define QOI_RUN_MAX 62
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+
+typedef struct qoiStripe {
+    unsigned char* data;
+    size_t size;
+} qoiStripe;
+
+// Stripe 'task' is encoded into 'stripes[task % window]' and written out
+// when it retires
+typedef struct qoiJob {
+    const pixel* pixels;
+    size_t pixelCount;
+    size_t stripeCount;
+    size_t window;
+    qoiStripe* stripes;
+    FILE* outputFd;
+    int status;
+} qoiJob;
+
+static const unsigned char endMarker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+void encodeStripe(size_t task, size_t worker, void* arg);
+void writeStripe(size_t task, void* arg);
+size_t encodePixels(const pixel* pixels, size_t count, pixel previous,
+    unsigned char* out);
+int colorHash(pixel color);
+int samePixel(pixel first, pixel second);
+void putQoiBigEndian(unsigned char* bytes, uint32_t value);
+
+int qoi_write(const char* path, const pixel* pixels, size_t width,
+        size_t height, size_t threads) {
+    if(width > 0xffffffff || height > 0xffffffff) {
+        fprintf(stderr, "Error: QOI images are at most %u pixels across\n",
+            0xffffffff);
+        return -1;
+    }
+    if(threads == 0) {
+        threads = threadpool_cores();
+    }
+
+    qoiJob job = { pixels, width * height, 0, 0, NULL, NULL, 0 };
+    job.stripeCount = (job.pixelCount + QOI_STRIPE_PIXELS - 1) /
+        QOI_STRIPE_PIXELS;
+    job.window = job.stripeCount < threads * 2 ? job.stripeCount :
+        threads * 2;
+    if(job.window > 0 && (job.stripes = calloc(job.window,
+            sizeof(*job.stripes))) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return -1;
+    }
+
+    FILE* outputFd = fopen(path, "wb");
+    if(outputFd == NULL) {
+        fprintf(stderr, "Error: Cannot open '%s'\n", path);
+        free(job.stripes);
+        return -1;
+    }
+
+    // Magic, size, 3 channels, sRGB with linear alpha
+    unsigned char header[14] = { 'q', 'o', 'i', 'f' };
+    putQoiBigEndian(header + 4, width);
+    putQoiBigEndian(header + 8, height);
+    header[12] = 3;
+    header[13] = 0;
+    job.outputFd = outputFd;
+    job.status = fwrite(header, 1, sizeof(header), outputFd) ==
+        sizeof(header) ? 0 : -1;
+
+    if(job.status == 0 && threadpool_runOrdered(threads, job.stripeCount, 1,
+            job.window, encodeStripe, writeStripe, &job) < 0) {
+        job.status = -1;
+    }
+
+    int status = job.status;
+    if(status == 0 && fwrite(endMarker, 1, sizeof(endMarker), outputFd) !=
+            sizeof(endMarker)) {
+        status = -1;
+    }
+    if(fclose(outputFd) != 0 || status < 0) {
+        fprintf(stderr, "Error: Cannot write '%s'\n", path);
+        status = -1;
+    }
+    free(job.stripes);
+
+    return status;
+}
+
+void encodeStripe(size_t task, size_t worker, void* arg) {
+    (void)worker;
+    qoiJob* job = arg;
+    size_t start = task * QOI_STRIPE_PIXELS;
+    size_t count = job->pixelCount - start < QOI_STRIPE_PIXELS ?
+        job->pixelCount - start : QOI_STRIPE_PIXELS;
+    // The decoder starts from opaque black
+    pixel previous = { 0, 0, 0 };
+    if(start > 0) {
+        previous = job->pixels[start - 1];
+    }
+
+    qoiStripe* stripe = &(job->stripes[task % job->window]);
+    if((stripe->data = malloc(count * QOI_PIXEL_MAX)) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    stripe->size = encodePixels(&(job->pixels[start]), count, previous,
+        stripe->data);
+}
+
+// Writes an encoded stripe out, or after a failed write only frees it
+void writeStripe(size_t task, void* arg) {
+    qoiJob* job = arg;
+    qoiStripe* stripe = &(job->stripes[task % job->window]);
+    if(job->status == 0 && fwrite(stripe->data, 1, stripe->size,
+            job->outputFd) != stripe->size) {
+        job->status = -1;
+    }
+    free(stripe->data);
+}
+
+// Encodes a run of pixels given the one the decoder saw last. The decoder's
+// index also holds colors from earlier stripes, which this stripe cannot
+// know, so only slots written within the stripe are ever referenced.
+size_t encodePixels(const pixel* pixels, size_t count, pixel previous,
+        unsigned char* out) {
+    pixel index[64];
+    uint64_t written = 0;
+    size_t size = 0;
+    int run = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        pixel color = pixels[i];
+        if(samePixel(color, previous)) {
+            if(++run == QOI_RUN_MAX) {
+                out[size++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if(run > 0) {
+            out[size++] = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        int hash = colorHash(color);
+        if((written >> hash & 1) && samePixel(index[hash], color)) {
+            out[size++] = QOI_OP_INDEX | hash;
+        }
+        else {
+            index[hash] = color;
+            written |= (uint64_t)1 << hash;
+
+            // Differences wrap around, as the decoder adds them modulo 256
+            signed char red = (signed char)(color.red - previous.red);
+            signed char green = (signed char)(color.green - previous.green);
+            signed char blue = (signed char)(color.blue - previous.blue);
+            signed char redGreen = red - green;
+            signed char blueGreen = blue - green;
+
+            if(red >= -2 && red <= 1 && green >= -2 && green <= 1 &&
+                    blue >= -2 && blue <= 1) {
+                out[size++] = QOI_OP_DIFF | (red + 2) << 4 | (green + 2) << 2 |
+                    (blue + 2);
+            }
+            else if(green >= -32 && green <= 31 && redGreen >= -8 &&
+                    redGreen <= 7 && blueGreen >= -8 && blueGreen <= 7) {
+                out[size++] = QOI_OP_LUMA | (green + 32);
+                out[size++] = (redGreen + 8) << 4 | (blueGreen + 8);
+            }
+            else {
+                out[size++] = QOI_OP_RGB;
+                out[size++] = color.red;
+                out[size++] = color.green;
+                out[size++] = color.blue;
+            }
+        }
+        previous = color;
+    }
+    if(run > 0) {
+        out[size++] = QOI_OP_RUN | (run - 1);
+    }
+
+    return size;
+}
+
+// Every pixel is opaque, so alpha always adds 255 * 11
+int colorHash(pixel color) {
+    return (color.red * 3 + color.green * 5 + color.blue * 7 + 255 * 11) % 64;
+}
+
+int samePixel(pixel first, pixel second) {
+    return first.red == second.red && first.green == second.green &&
+        first.blue == second.blue;
+}
+
+void putQoiBigEndian(unsigned char* bytes, uint32_t value) {
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
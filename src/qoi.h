@@ -0,0 +1,14 @@
+#ifndef CS430_QOI_H
+#define CS430_QOI_H
+
+#include <stddef.h>
+
+#include "pnm.h"
+
+// Writes the pixels as an RGB QOI image ("Quite OK Image" format). Stripes
+// of pixels are encoded on 'threads' workers (0 uses every core) and joined
+// in order. Returns -1 after printing an error.
+int qoi_write(const char* path, const pixel* pixels, size_t width,
+    size_t height, size_t threads);
+
+#endif // CS430_QOI_H
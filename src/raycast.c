@@ -1,162 +1,1744 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 
-#define PI 3.14159265358979323846
-#define MAX_RECURSION_LEVEL 7
 
 #include "vector3d.h"
+#include "packet.h"
+#include "kernels.h"
+#include "mesh.h"
 #include "raycast.h"
+#include "threadpool.h"
 
+// The closest hit found so far. 't' stays INFINITY until something is hit.
 typedef struct shootObj {
-    double t;
+    real t;
     sceneObj* obj;
+    // Triangle hit, for meshes
+    size_t prim;
+    // Copy of a group the object was hit in, or NULL
+    const sceneInstance* instance;
 } shootObj;
 
-double sphere_intersection(ray ray, sceneObj* obj);
-double plane_intersection(ray ray, sceneObj* obj);
-double cylinder_intersection(ray ray, sceneObj* obj);
+// An object found blocking a light, by its slot in the scene's plane, sphere,
+// mesh or instance arrays, and for meshes the triangle
+typedef struct occluder {
+    int type;
+    size_t index;
+    size_t prim;
+} occluder;
 
-shootObj shoot(ray ray, sceneObj** objs);
-pixel shade(ray ray, vector3d intersection, sceneObj* intersected, sceneObj** objs,
-    sceneLight** lights, int level);
+#define OCCLUDER_NONE -1
+#define OCCLUDER_INSTANCE -2
 
-vector3d getReflection(sceneObj* obj, vector3d pos, vector3d dir);
-vector3d getRefraction(sceneObj* obj, vector3d pos, vector3d dir);
+// A reflected or refracted ray waiting to be traced
+typedef struct pathRay {
+    ray ray;
+    // How much of whatever the ray finds reaches the pixel
+    real weight;
+    size_t depth;
+} pathRay;
 
-vector3d getIntersection(ray ray, double t);
-vector3d getNormal(vector3d intersection, sceneObj* obj);
-vector3d getColor(ray ray, vector3d intersection, sceneObj* closest,
-    sceneLight* light);
-int inShadow(vector3d intersection, sceneLight* light, sceneObj** objs,
-    sceneObj* exclude);
-double getRadialAtten(vector3d intersection, sceneLight* light);
-double getAngularAtten(vector3d intersection, sceneLight* light);
-vector3d getDiffuse(vector3d intersection, sceneObj* closest, sceneLight* light);
-vector3d getSpecular(ray ray, vector3d intersection, sceneObj* closest, sceneLight* light);
+// Lights that may reach some region, as indices into the scene's compiled
+// lights in the same class order
+typedef struct lightList {
+    const size_t* lights;
+    size_t pointCount;
+    size_t spotCount;
+    size_t directionalCount;
+} lightList;
 
-void raycast(pixel* pixels, size_t width, size_t height, camera camera,
-        sceneObj** objs, sceneLight** lights) {
-    const vector3d center = { 0, 0, 1 };
-    const double PIXEL_WIDTH = camera.width / width;
-    const double PIXEL_HEIGHT = camera.height / height;
+// A secondary ray in wavefront mode, traced in one batch with every other ray
+// of the same bounce
+typedef struct waveRay {
+    pathRay path;
+    size_t pixel;
+    // Where the ray came from: twice its parent's place in the sorted bounce
+    // before, plus one for refraction. No two rays of a bounce share it, so
+    // sorting breaks ties the same way every run.
+    size_t branch;
+    // Origin cell and direction octant, which the batch is sorted by
+    unsigned long long key;
+    // Weighted color found by the ray, added to its pixel once the batch is
+    // done
+    vector3d color;
+} waveRay;
+
+typedef struct waveQueue {
+    waveRay* rays;
+    size_t count;
+    size_t capacity;
+} waveQueue;
+
+// State private to one worker thread, so it can be updated without locking
+typedef struct traceContext {
+    const scene* scene;
+    // Pending secondary rays. Each hit pushes at most two and pops one, so
+    // 2 * (maxDepth + 1) entries always suffice.
+    pathRay* stack;
+    size_t stackSize;
+    size_t maxDepth;
+    real minWeight;
+    // Secondary rays spawned by primary hits in wavefront mode
+    waveQueue wave;
+    // Lights for primary hits in the current tile, and for everything else
+    const lightList* tileLights;
+    const lightList* allLights;
+    int cullLights;
+    // The current tile's lights, when the job keeps no per-tile lists
+    lightList ownLights;
+    size_t* ownIndices;
+    // Last occluder found for each light. Neighbouring shadow rays tend to
+    // be blocked by the same object, so it is tried before a full query.
+    occluder* occluders;
+    renderStats stats;
+} traceContext;
 
+// Surface data for one hit, computed once and shared by all of its shading
+typedef struct hitContext {
+    // The ray that found the hit
+    ray ray;
     vector3d point;
-    shootObj closest;
-    // Initialize ray as origin and dir of { 0, 0, 0 }
-    ray ray = { 0 };
-    point.z = center.z;
+    vector3d normal;
+    sceneObj* obj;
+} hitContext;
+
+// The part of shading a hit that depends on one light
+typedef struct lightSample {
+    const compiledLight* light;
+    // Normalized direction from the hit towards the light
+    vector3d dir;
+    real distance;
+} lightSample;
+
+typedef struct renderJob {
+    pixel* pixels;
+    size_t width;
+    size_t height;
+    camera camera;
+    const scene* scene;
+    size_t tileSize;
+    size_t tilesX;
+    int packets;
+    traceContext* contexts;
+    // Only pixels whose coordinates are both multiples of the stride are
+    // rendered. When refining, those already done by the previous pass (at
+    // twice the stride) are skipped.
+    size_t stride;
+    int refine;
+    // Object hit by each pixel's primary ray, kept for anti-aliasing
+    sceneObj** hits;
+    // Pixels picked for supersampling, and how many extra samples they get
+    unsigned char* edges;
+    size_t aaSamples;
+    // Unclamped color of each pixel in wavefront mode (NULL otherwise), as
+    // later bounces keep adding to it
+    vector3d* colors;
+    // One list per tile, pointing into 'lightIndices', or NULL if workers
+    // list each tile's lights as they go
+    lightList* tileLights;
+    lightList allLights;
+    size_t* lightIndices;
+    // Rows 'pixels' holds. When streaming this is a ring of a few tile rows,
+    // and finished ones are handed to 'onRows' in order.
+    size_t bufferRows;
+    rowCallback onRows;
+    void* rowArg;
+    // Size of the whole image the camera spans, and where the 'width' by
+    // 'height' pixels being rendered sit in it. Only turning pixels into rays
+    // needs these; everything else works in the rendered window's pixels.
+    size_t viewWidth;
+    size_t viewHeight;
+    size_t viewX;
+    size_t viewY;
+} renderJob;
+
+// One bounce of wavefront tracing
+typedef struct waveJob {
+    renderJob* job;
+    waveRay* rays;
+    size_t count;
+    // Two slots per ray for the reflected and refracted rays it spawns; an
+    // unused slot has zero weight
+    waveRay* next;
+} waveJob;
+
+// Fewest tile rows in flight when streaming
+#define STREAM_WINDOW 2
+
+#define WAVE_CHUNK 256
+// Bits per axis of the origin cells wavefront rays are sorted by
+#define WAVE_CELL_BITS 10
+
+size_t startJob(renderJob* job, renderOptions options, int listTiles,
+    size_t* tilesY);
+void finishJob(renderJob* job, size_t threads, renderStats* stats);
+void retireRows(size_t group, void* arg);
+pixel* jobRow(const renderJob* job, size_t y);
+void buildLightLists(renderJob* job, size_t tilesY, int cull);
+size_t listTileLights(const renderJob* job, size_t tile, lightList* list,
+    size_t* indices);
+int lightReachesTile(const renderJob* job, const compiledLight* light,
+    size_t tile);
+void tileBounds(const renderJob* job, size_t tile, size_t* startX,
+    size_t* startY, size_t* endX, size_t* endY);
+void renderTile(size_t task, size_t worker, void* arg);
+void renderSpan(renderJob* job, traceContext* context, size_t y,
+    const size_t* xs, size_t count);
+void fillPass(renderJob* job);
+size_t findEdges(renderJob* job, int threshold);
+int pixelsDiffer(const renderJob* job, size_t first, size_t second,
+    int threshold);
+void supersampleTile(size_t task, size_t worker, void* arg);
+pixel supersample(renderJob* job, traceContext* context, size_t x, size_t y);
+vector3d pixelDir(const renderJob* job, real x, real y);
+real sampleJitter(size_t x, size_t y, size_t sample, size_t axis);
+size_t gcd(size_t first, size_t second);
+
+// Each intersection returns the hit's t if it lies in (tMin, tMax], or -1
+real sphere_intersection(ray ray, const sceneSpheres* spheres, size_t index,
+    real tMin, real tMax, size_t* rejected);
+real plane_intersection(ray ray, const scenePlanes* planes, size_t index,
+    real tMin, real tMax);
+real cylinder_intersection(ray ray, sceneObj* obj, real tMin, real tMax);
+
+shootObj shoot(ray ray, const scene* scene, size_t* rejected);
+void traceScene(ray ray, const scene* scene, real tMin, shootObj* closest,
+    size_t* rejected);
+void traceClosest(ray ray, const scene* scene, size_t root, real tMin,
+    shootObj* closest, size_t* rejected);
+void traceMeshes(ray ray, const scene* scene, real tMin, shootObj* closest,
+    size_t* rejected);
+void traceInstances(ray ray, const scene* scene, real tMin, shootObj* closest,
+    size_t* rejected);
+void traceInstance(ray ray, const sceneInstance* instance, real tMin,
+    shootObj* closest, size_t* rejected);
+ray toInstance(ray ray, const sceneInstance* instance);
+int considerHit(real t, sceneObj* obj, size_t prim, shootObj* closest);
+void shootPacket(const ray* rays, size_t count, const scene* scene,
+    shootObj* closest, size_t* rejected);
+unsigned int packetBoxHits(const rayPacket* packet, aabb box,
+    const packetReal* tMax);
+void packetIntersect(const rayPacket* packet, const sceneSpheres* spheres,
+    size_t index, unsigned int mask, packetReal* closestValue, shootObj* closest,
+    size_t* rejected);
+pixel shade(ray ray, const shootObj* closest, traceContext* context);
+vector3d shadeHit(const hitContext* hit, const lightList* lights,
+    traceContext* context);
+void pushPathRay(traceContext* context, const hitContext* hit, vector3d dir,
+    real weight, size_t depth);
+int spawnPathRay(traceContext* context, const hitContext* hit, vector3d dir,
+    real weight, size_t depth, pathRay* path);
+void shadeWave(renderJob* job, traceContext* context, ray ray,
+    const shootObj* closest, size_t pixel);
+void queueWaveRay(waveQueue* queue, const pathRay* path, size_t pixel,
+    size_t branch);
+void traceWaves(renderJob* job, size_t threads);
+void traceWaveChunk(size_t task, size_t worker, void* arg);
+void sortWaveRays(waveRay* rays, size_t count);
+unsigned long long spreadBits(unsigned long long value);
+int compareWaveRays(const void* first, const void* second);
+
+hitContext getHit(ray ray, const shootObj* found);
+vector3d shadePointLight(const hitContext* hit, const compiledLight* light,
+    real directPercent, traceContext* context);
+vector3d shadeSpotLight(const hitContext* hit, const compiledLight* light,
+    real directPercent, traceContext* context);
+vector3d shadeDirectionalLight(const hitContext* hit,
+    const compiledLight* light, real directPercent, traceContext* context);
+int getLightSample(const hitContext* hit, const compiledLight* light,
+    traceContext* context, lightSample* sample);
+vector3d getReflection(const hitContext* hit);
+vector3d getRefraction(const hitContext* hit);
+
+vector3d getIntersection(ray ray, real t);
+vector3d getNormal(vector3d intersection, sceneObj* obj, size_t prim);
+vector3d getColor(const hitContext* hit, const lightSample* sample,
+    real atten);
+int inShadow(const hitContext* hit, size_t light, const lightSample* sample,
+    traceContext* context);
+int occluderBlocks(ray ray, real distance, const scene* scene,
+    occluder occluder, size_t* rejected);
+int sceneBlocks(ray ray, real tMin, real distance, const scene* scene,
+    occluder* found, size_t* rejected);
+int traceAny(ray ray, real tMin, real distance, const scene* scene,
+    size_t* index, size_t* rejected);
+int traceAnyMesh(ray ray, real tMin, real distance, const scene* scene,
+    occluder* found, size_t* rejected);
+int traceAnyInstance(ray ray, real tMin, real distance, const scene* scene,
+    size_t* index, size_t* rejected);
+int instanceBlocks(ray ray, real tMin, real distance,
+    const sceneInstance* instance, size_t* rejected);
+real getRadialAtten(const lightSample* sample);
+real getSpotAtten(const lightSample* sample);
+vector3d getDiffuse(const hitContext* hit, const lightSample* sample);
+vector3d getSpecular(const hitContext* hit, const lightSample* sample);
+real powInt(real base, unsigned exponent);
+
+renderOptions defaultRenderOptions() {
+    renderOptions options = {
+        0, DEFAULT_TILE_SIZE, 1, NULL, 1, NULL, NULL, 0, DEFAULT_AA_THRESHOLD,
+        DEFAULT_MAX_DEPTH, DEFAULT_MIN_WEIGHT, 0, 1, 0, 0, 0, 0
+    };
+
+    return options;
+}
+
+void raycast(pixel* pixels, size_t width, size_t height, camera camera,
+        const scene* scene, renderOptions options) {
+    size_t viewWidth = width;
+    size_t viewHeight = height;
+    size_t viewX = 0;
+    size_t viewY = 0;
+    if(options.windowWidth > 0 && options.windowHeight > 0) {
+        width = options.windowWidth;
+        height = options.windowHeight;
+        viewX = options.windowX;
+        viewY = options.windowY;
+    }
+    renderJob job = { pixels, width, height, camera, scene, options.tileSize,
+        0, options.packets, NULL, 1, 0, NULL, NULL, options.aaSamples, NULL,
+        NULL, { 0 }, NULL, height, NULL, NULL, viewWidth, viewHeight, viewX,
+        viewY };
+
+    size_t tilesY;
+    size_t threads = startJob(&job, options, 1, &tilesY);
+
+    // Passes halve the stride each time, so it has to be a power of two
+    while(options.passStride > 1 && (job.stride << 1) <= options.passStride) {
+        job.stride <<= 1;
+    }
+
+    if(job.aaSamples > 0) {
+        job.hits = malloc(sizeof(*job.hits) * width * height);
+        job.edges = malloc(sizeof(*job.edges) * width * height);
+        if(job.hits == NULL || job.edges == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(options.wavefront) {
+        job.colors = malloc(sizeof(*job.colors) * width * height);
+        if(job.colors == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Initialize all pixels to black
     memset(pixels, 0, sizeof(*pixels) * width * height);
 
+    for(size_t pass = 0;; pass++) {
+        // Tiles are small enough that the expensive ones (reflective spheres)
+        // get spread across workers through stealing rather than landing in
+        // one thread's static share of rows.
+        if(threadpool_run(threads, job.tilesX * tilesY, renderTile, &job) < 0) {
+            fprintf(stderr, "Error: Rendering with %zu threads failed\n",
+                threads);
+            exit(EXIT_FAILURE);
+        }
+        if(job.colors != NULL) {
+            traceWaves(&job, threads);
+        }
+        if(job.stride == 1) {
+            break;
+        }
+
+        fillPass(&job);
+        if(options.onPass != NULL) {
+            options.onPass(pixels, pass, options.passArg);
+        }
+        job.stride >>= 1;
+        job.refine = 1;
+    }
+
+    renderStats stats = { 0 };
+    if(job.aaSamples > 0) {
+        // Edges are found on the whole one-sample image before any pixel is
+        // refined, so workers never compare against a neighbour in flux
+        stats.refinedPixels = findEdges(&job, options.aaThreshold);
+        if(threadpool_run(threads, job.tilesX * tilesY, supersampleTile,
+                &job) < 0) {
+            fprintf(stderr, "Error: Rendering with %zu threads failed\n",
+                threads);
+            exit(EXIT_FAILURE);
+        }
+        free(job.hits);
+        free(job.edges);
+    }
+
+    finishJob(&job, threads, &stats);
+    if(options.stats != NULL) {
+        *options.stats = stats;
+    }
+}
+
+void raycastStream(size_t width, size_t height, camera camera,
+        const scene* scene, renderOptions options, rowCallback onRows,
+        void* rowArg) {
+    renderJob job = { NULL, width, height, camera, scene, options.tileSize,
+        0, options.packets, NULL, 1, 0, NULL, NULL, 0, NULL, NULL, { 0 }, NULL,
+        0, onRows, rowArg, width, height, 0, 0 };
+
+    size_t tilesY;
+    size_t threads = startJob(&job, options, 0, &tilesY);
+
+    // Enough tile rows in flight to keep every worker busy while the oldest
+    // one finishes, but never more than the image has
+    size_t window = STREAM_WINDOW;
+    while(window * job.tilesX < 2 * threads) {
+        window++;
+    }
+    if(window > tilesY) {
+        window = tilesY;
+    }
+    job.bufferRows = window * job.tileSize;
+    if((job.pixels = malloc(sizeof(*job.pixels) * job.bufferRows *
+            width)) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(threadpool_runOrdered(threads, tilesY, job.tilesX, window, renderTile,
+            retireRows, &job) < 0) {
+        fprintf(stderr, "Error: Rendering with %zu threads failed\n",
+            threads);
+        exit(EXIT_FAILURE);
+    }
+
+    renderStats stats = { 0 };
+    finishJob(&job, threads, &stats);
+    free(job.pixels);
+    if(options.stats != NULL) {
+        *options.stats = stats;
+    }
+}
+
+// Sets up the tiling, light lists and worker contexts shared by both ways of
+// rendering, and returns the worker count. Without 'listTiles' no per-tile
+// light lists are kept, and workers list the lights for each tile as they
+// render it.
+size_t startJob(renderJob* job, renderOptions options, int listTiles,
+        size_t* tilesY) {
+    if(job->tileSize == 0) {
+        job->tileSize = DEFAULT_TILE_SIZE;
+    }
+    job->tilesX = (job->width + job->tileSize - 1) / job->tileSize;
+    *tilesY = (job->height + job->tileSize - 1) / job->tileSize;
+
+    size_t threads = options.threads;
+    if(threads == 0) {
+        threads = threadpool_cores();
+    }
+
+    size_t lightCount = 0;
+    while(job->scene->lights[lightCount] != NULL) {
+        lightCount++;
+    }
+
+    buildLightLists(job, listTiles ? *tilesY : 0, options.lightCulling);
+
+    job->contexts = calloc(threads, sizeof(*job->contexts));
+    if(job->contexts == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < threads; i++) {
+        traceContext* context = &(job->contexts[i]);
+        context->scene = job->scene;
+        context->occluders = malloc(sizeof(occluder) * (lightCount + 1));
+        // Each bounce leaves at most two rays on the stack
+        if(options.maxDepth > (SIZE_MAX / sizeof(pathRay) - 2) / 2) {
+            fprintf(stderr, "Error: Maximum depth %zu is too large\n",
+                options.maxDepth);
+            exit(EXIT_FAILURE);
+        }
+        context->stack = malloc(sizeof(pathRay) * (2 * options.maxDepth + 2));
+        context->maxDepth = options.maxDepth;
+        context->minWeight = options.minWeight;
+        context->tileLights = &(job->allLights);
+        context->allLights = &(job->allLights);
+        context->cullLights = options.lightCulling;
+        if(!listTiles && options.lightCulling) {
+            context->ownIndices = malloc(sizeof(size_t) * (lightCount + 1));
+            if(context->ownIndices == NULL) {
+                fprintf(stderr, "Error: Memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if(context->occluders == NULL || context->stack == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        for(size_t j = 0; j < lightCount; j++) {
+            context->occluders[j].type = OCCLUDER_NONE;
+        }
+    }
+
+    return threads;
+}
+
+// Adds up the workers' counters into 'stats' and frees what startJob() set up
+void finishJob(renderJob* job, size_t threads, renderStats* stats) {
+    for(size_t i = 0; i < threads; i++) {
+        stats->primaryRays += job->contexts[i].stats.primaryRays;
+        stats->secondaryRays += job->contexts[i].stats.secondaryRays;
+        stats->shadowRays += job->contexts[i].stats.shadowRays;
+        stats->occluderHits += job->contexts[i].stats.occluderHits;
+        stats->culledLights += job->contexts[i].stats.culledLights;
+        stats->rejectedTests += job->contexts[i].stats.rejectedTests;
+        stats->culledRays += job->contexts[i].stats.culledRays;
+        free(job->contexts[i].occluders);
+        free(job->contexts[i].stack);
+        free(job->contexts[i].wave.rays);
+        free(job->contexts[i].ownIndices);
+    }
+    free(job->contexts);
+    free(job->colors);
+    free(job->tileLights);
+    free(job->lightIndices);
+}
+
+// Hands a finished tile row to the stream's callback. Its rows sit together
+// in the ring buffer, since the buffer holds a whole number of tile rows.
+void retireRows(size_t group, void* arg) {
+    renderJob* job = arg;
+    size_t first = group * job->tileSize;
+    size_t count = job->height - first < job->tileSize ?
+        job->height - first : job->tileSize;
+
+    job->onRows(jobRow(job, first), first, count, job->rowArg);
+}
+
+// Builds the full light list, then with culling on, one list per tile of
+// the lights whose reach overlaps the tile's view frustum. Primary hits of a
+// tile lie inside its frustum, so the lists only skip lights the per-sample
+// distance check would have skipped anyway.
+void buildLightLists(renderJob* job, size_t tilesY, int cull) {
+    const sceneLights* lights = &(job->scene->compiledLights);
+    size_t lightCount = lights->pointCount + lights->spotCount +
+        lights->directionalCount;
+    size_t tiles = job->tilesX * tilesY;
+
+    job->tileLights = tiles > 0 ? malloc(sizeof(*(job->tileLights)) * tiles) :
+        NULL;
+    size_t capacity = lightCount * 2;
+    size_t* indices = malloc(sizeof(*indices) * (capacity + 1));
+    if((tiles > 0 && job->tileLights == NULL) || indices == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t i = 0; i < lightCount; i++) {
+        indices[i] = i;
+    }
+    size_t count = lightCount;
+
+    // Offsets rather than pointers while the buffer may still move
+    size_t* offsets = malloc(sizeof(*offsets) * (tiles + 1));
+    if(offsets == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t tile = 0; tile < tiles; tile++) {
+        lightList* list = &(job->tileLights[tile]);
+        memset(list, 0, sizeof(*list));
+        offsets[tile] = count;
+        if(!cull) {
+            continue;
+        }
+
+        // Room for every light, so the list can be filled in place
+        if(count + lightCount > capacity) {
+            capacity = capacity * 2 > count + lightCount ? capacity * 2 :
+                count + lightCount;
+            indices = realloc(indices, sizeof(*indices) * (capacity + 1));
+            if(indices == NULL) {
+                fprintf(stderr, "Error: Memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        count += listTileLights(job, tile, list, indices + count);
+    }
+
+    job->lightIndices = indices;
+    job->allLights.lights = indices;
+    job->allLights.pointCount = lights->pointCount;
+    job->allLights.spotCount = lights->spotCount;
+    job->allLights.directionalCount = lights->directionalCount;
+    for(size_t tile = 0; tile < tiles; tile++) {
+        if(cull) {
+            job->tileLights[tile].lights = indices + offsets[tile];
+        }
+        else {
+            job->tileLights[tile] = job->allLights;
+        }
+    }
+    free(offsets);
+}
+
+// Fills 'list' with the lights that reach the tile, written to 'indices' in
+// class order, and returns how many there are
+size_t listTileLights(const renderJob* job, size_t tile, lightList* list,
+        size_t* indices) {
+    const sceneLights* lights = &(job->scene->compiledLights);
+    size_t classEnd[3] = { lights->pointCount,
+        lights->pointCount + lights->spotCount,
+        lights->pointCount + lights->spotCount + lights->directionalCount };
+    size_t* classCount[3] = { &(list->pointCount), &(list->spotCount),
+        &(list->directionalCount) };
+    size_t count = 0;
+    size_t light = 0;
+
+    list->lights = indices;
+    for(size_t type = 0; type < 3; type++) {
+        *classCount[type] = 0;
+        for(; light < classEnd[type]; light++) {
+            if(lightReachesTile(job, &(lights->lights[light]), tile)) {
+                indices[count++] = light;
+                (*classCount[type])++;
+            }
+        }
+    }
+
+    return count;
+}
+
+// Whether the light's sphere of influence overlaps the tile's frustum, the
+// region between the camera at the origin and the planes through the
+// tile's edges on the image plane z = 1
+int lightReachesTile(const renderJob* job, const compiledLight* light,
+        size_t tile) {
+    if(light->radius2 == INFINITY) {
+        return 1;
+    }
+
+    size_t startX, startY, endX, endY;
+    tileBounds(job, tile, &startX, &startY, &endX, &endY);
+
+    real pixelWidth = job->camera.width / job->viewWidth;
+    real pixelHeight = job->camera.height / job->viewHeight;
+    real left = -(job->camera.width / 2) + pixelWidth * (job->viewX + startX);
+    real right = -(job->camera.width / 2) + pixelWidth * (job->viewX + endX);
+    // Rows run down the image while y runs up
+    real top = job->camera.height / 2 - pixelHeight * (job->viewY + startY);
+    real bottom = job->camera.height / 2 - pixelHeight * (job->viewY + endY);
+
+    vector3d pos = light->pos;
+    real radius = sqrt(light->radius2);
+    // Signed distances from the inside of each side plane, which all pass
+    // through the origin
+    if(pos.z < -radius ||
+            (pos.x - left * pos.z) < -radius * sqrt(1 + left * left) ||
+            (right * pos.z - pos.x) < -radius * sqrt(1 + right * right) ||
+            (pos.y - bottom * pos.z) < -radius * sqrt(1 + bottom * bottom) ||
+            (top * pos.z - pos.y) < -radius * sqrt(1 + top * top)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+void tileBounds(const renderJob* job, size_t tile, size_t* startX,
+        size_t* startY, size_t* endX, size_t* endY) {
+    *startX = (tile % job->tilesX) * job->tileSize;
+    *startY = (tile / job->tilesX) * job->tileSize;
+    *endX = *startX + job->tileSize;
+    *endY = *startY + job->tileSize;
+    if(*endX > job->width) {
+        *endX = job->width;
+    }
+    if(*endY > job->height) {
+        *endY = job->height;
+    }
+}
+
+void renderTile(size_t task, size_t worker, void* arg) {
+    renderJob* job = arg;
+    traceContext* context = &(job->contexts[worker]);
+    if(job->tileLights != NULL) {
+        context->tileLights = &(job->tileLights[task]);
+    }
+    else if(context->ownIndices != NULL) {
+        listTileLights(job, task, &(context->ownLights), context->ownIndices);
+        context->tileLights = &(context->ownLights);
+    }
+
+    size_t startX, startY, endX, endY;
+    tileBounds(job, task, &startX, &startY, &endX, &endY);
+
+    size_t stride = job->stride;
+    size_t batch = job->packets ? PACKET_SIZE : 1;
+    size_t xs[PACKET_SIZE];
+    // Round the tile's corner up onto the pass's grid
+    size_t gridX = (startX + stride - 1) / stride * stride;
+    size_t gridY = (startY + stride - 1) / stride * stride;
+
+    for(size_t y = gridY; y < endY; y += stride) {
+        int coarseRow = job->refine && y % (2 * stride) == 0;
+        size_t count = 0;
+
+        for(size_t x = gridX; x < endX; x += stride) {
+            if(coarseRow && x % (2 * stride) == 0) {
+                continue;
+            }
+            xs[count++] = x;
+            if(count == batch) {
+                renderSpan(job, context, y, xs, count);
+                count = 0;
+            }
+        }
+        if(count > 0) {
+            renderSpan(job, context, y, xs, count);
+        }
+    }
+}
+
+// Renders up to PACKET_SIZE pixels of row 'y', traced together as a packet
+// when there is more than one
+void renderSpan(renderJob* job, traceContext* context, size_t y,
+        const size_t* xs, size_t count) {
+    ray rays[PACKET_SIZE];
+    shootObj closest[PACKET_SIZE];
+    // Initialize rays as origin and dir of { 0, 0, 0 }
+    memset(rays, 0, sizeof(rays));
+
+    for(size_t i = 0; i < count; i++) {
+        rays[i].dir = pixelDir(job, xs[i] + 0.5, y + 0.5);
+    }
+    context->stats.primaryRays += count;
+
+    if(count > 1) {
+        shootPacket(rays, count, job->scene, closest,
+            &(context->stats.rejectedTests));
+    }
+    else {
+        closest[0] = shoot(rays[0], job->scene,
+            &(context->stats.rejectedTests));
+    }
+
+    pixel* row = jobRow(job, y);
+    for(size_t i = 0; i < count; i++) {
+        pixel* pixel = &(row[xs[i]]);
+        if(job->hits != NULL) {
+            job->hits[y * job->width + xs[i]] = closest[i].obj;
+        }
+        if(closest[i].obj != NULL) {
+            if(job->colors != NULL) {
+                shadeWave(job, context, rays[i], &(closest[i]),
+                    y * job->width + xs[i]);
+            }
+            else {
+                *pixel = shade(rays[i], &(closest[i]), context);
+            }
+        }
+        else {
+            // The pixel may hold a preview color filled in by a coarser pass
+            memset(pixel, 0, sizeof(*pixel));
+        }
+    }
+}
+
+pixel* jobRow(const renderJob* job, size_t y) {
+    return &(job->pixels[y % job->bufferRows * job->width]);
+}
+
+// Copies each rendered pixel over the block it stands for until a later pass
+// renders the rest, so a preview has no holes
+void fillPass(renderJob* job) {
+    size_t stride = job->stride;
+
+    for(size_t y = 0; y < job->height; y++) {
+        pixel* row = &(job->pixels[y * job->width]);
+        const pixel* source = &(job->pixels[(y - y % stride) * job->width]);
+        for(size_t x = 0; x < job->width; x++) {
+            if(x % stride != 0 || y % stride != 0) {
+                row[x] = source[x - x % stride];
+            }
+        }
+    }
+}
+
+// Flags every pixel whose right or lower neighbour hit a different object or
+// differs by more than 'threshold' in any channel, along with that
+// neighbour. Returns how many pixels were flagged.
+size_t findEdges(renderJob* job, int threshold) {
+    size_t width = job->width;
+    size_t height = job->height;
+    size_t count = 0;
+
+    memset(job->edges, 0, sizeof(*job->edges) * width * height);
     for(size_t y = 0; y < height; y++) {
-        point.y = center.y - (camera.height / 2) + PIXEL_HEIGHT * (y + 0.5);
-        // Adjust for image inversion
-        point.y *= -1;
         for(size_t x = 0; x < width; x++) {
-            point.x = center.x - (camera.width / 2) + PIXEL_WIDTH * (x + 0.5);
-            ray.dir = vector3d_normalize(point);
-            closest = shoot(ray, objs);
-            if(closest.obj != NULL) {
-                vector3d intersection = getIntersection(ray, closest.t);
-                pixels[y * width + x] = shade(ray, intersection, closest.obj,
-                    objs, lights, 0);
+            size_t index = y * width + x;
+            if(x + 1 < width && pixelsDiffer(job, index, index + 1, threshold)) {
+                job->edges[index] = job->edges[index + 1] = 1;
+            }
+            if(y + 1 < height &&
+                    pixelsDiffer(job, index, index + width, threshold)) {
+                job->edges[index] = job->edges[index + width] = 1;
             }
         }
     }
+
+    for(size_t i = 0; i < width * height; i++) {
+        count += job->edges[i];
+    }
+
+    return count;
+}
+
+int pixelsDiffer(const renderJob* job, size_t first, size_t second,
+        int threshold) {
+    if(job->hits[first] != job->hits[second]) {
+        return 1;
+    }
+
+    pixel a = job->pixels[first];
+    pixel b = job->pixels[second];
+
+    return abs(a.red - b.red) > threshold ||
+        abs(a.green - b.green) > threshold ||
+        abs(a.blue - b.blue) > threshold;
 }
 
-shootObj shoot(ray ray, sceneObj** objs) {
-    double closestValue = INFINITY;
-    double t;
+void supersampleTile(size_t task, size_t worker, void* arg) {
+    renderJob* job = arg;
+    traceContext* context = &(job->contexts[worker]);
+    context->tileLights = &(job->tileLights[task]);
 
-    shootObj closest = { 0 };
+    size_t startX, startY, endX, endY;
+    tileBounds(job, task, &startX, &startY, &endX, &endY);
 
-    for(size_t i = 0; objs[i] != NULL; i++) {
-        switch(objs[i]->type) {
-            case(TYPE_SPHERE):
-                t = sphere_intersection(ray, objs[i]);
-                break;
-            case(TYPE_PLANE):
-                t = plane_intersection(ray, objs[i]);
-                break;
-            default:
-                fprintf(stderr, "Error: Invalid obj type\n");
-                exit(EXIT_FAILURE);
+    for(size_t y = startY; y < endY; y++) {
+        for(size_t x = startX; x < endX; x++) {
+            if(job->edges[y * job->width + x]) {
+                job->pixels[y * job->width + x] = supersample(job, context, x, y);
+            }
         }
-        if(t > 0 && t < closestValue) {
-            closestValue = t;
-            closest.t = t;
-            closest.obj = objs[i];
+    }
+}
+
+// Averages the pixel's existing center sample with job->aaSamples more. The
+// extra samples are stratified along both axes (one per row and column of
+// an N x N grid, the rows shuffled by a fixed stride) and jittered inside
+// their cell, and are traced together as packets.
+pixel supersample(renderJob* job, traceContext* context, size_t x, size_t y) {
+    size_t samples = job->aaSamples;
+    size_t batch = job->packets ? PACKET_SIZE : 1;
+    // Any stride coprime with the sample count visits every row once
+    size_t shuffle = samples / 2 + 1;
+    while(gcd(shuffle, samples) != 1) {
+        shuffle++;
+    }
+
+    pixel center = job->pixels[y * job->width + x];
+    unsigned long sum[3] = { center.red, center.green, center.blue };
+
+    ray rays[PACKET_SIZE];
+    shootObj closest[PACKET_SIZE];
+    memset(rays, 0, sizeof(rays));
+
+    for(size_t first = 0; first < samples; first += batch) {
+        size_t count = samples - first < batch ? samples - first : batch;
+        for(size_t i = 0; i < count; i++) {
+            size_t sample = first + i;
+            size_t row = sample * shuffle % samples;
+            real offsetX = (sample + sampleJitter(job->viewX + x,
+                job->viewY + y, sample, 0)) / samples;
+            real offsetY = (row + sampleJitter(job->viewX + x,
+                job->viewY + y, sample, 1)) / samples;
+            rays[i].dir = pixelDir(job, x + offsetX, y + offsetY);
+        }
+        context->stats.primaryRays += count;
+
+        if(count > 1) {
+            shootPacket(rays, count, job->scene, closest,
+                &(context->stats.rejectedTests));
+        }
+        else {
+            closest[0] = shoot(rays[0], job->scene,
+                &(context->stats.rejectedTests));
+        }
+
+        for(size_t i = 0; i < count; i++) {
+            if(closest[i].obj != NULL) {
+                pixel color = shade(rays[i], &(closest[i]), context);
+                sum[0] += color.red;
+                sum[1] += color.green;
+                sum[2] += color.blue;
+            }
         }
     }
 
+    // Round to nearest
+    unsigned long total = samples + 1;
+    pixel pixel = {
+        (sum[0] + total / 2) / total,
+        (sum[1] + total / 2) / total,
+        (sum[2] + total / 2) / total
+    };
+
+    return pixel;
+}
+
+// Direction of the primary ray through image position (x, y), measured in
+// pixels from the top left corner of the rendered window
+vector3d pixelDir(const renderJob* job, real x, real y) {
+    const vector3d center = { 0, 0, 1 };
+    const real PIXEL_WIDTH = job->camera.width / job->viewWidth;
+    const real PIXEL_HEIGHT = job->camera.height / job->viewHeight;
+
+    vector3d point;
+    point.x = center.x - (job->camera.width / 2) +
+        PIXEL_WIDTH * (job->viewX + x);
+    point.y = center.y - (job->camera.height / 2) +
+        PIXEL_HEIGHT * (job->viewY + y);
+    // Adjust for image inversion
+    point.y *= -1;
+    point.z = center.z;
+
+    return vector3d_normalize(point);
+}
+
+// Deterministic jitter in [0, 1), so anti-aliased renders are reproducible
+// and independent of the thread count
+real sampleJitter(size_t x, size_t y, size_t sample, size_t axis) {
+    unsigned long long hash = x * 0x9e3779b97f4a7c15ULL ^
+        y * 0xc2b2ae3d27d4eb4fULL ^ (sample * 2 + axis) * 0x165667b19e3779f9ULL;
+    hash ^= hash >> 31;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+
+    return (hash >> 40) * (1.0 / 16777216.0);
+}
+
+size_t gcd(size_t first, size_t second) {
+    while(second != 0) {
+        size_t remainder = first % second;
+        first = second;
+        second = remainder;
+    }
+
+    return first;
+}
+
+// Nearest hit along the ray past RAY_EPSILON, which keeps a secondary ray
+// from hitting the surface it leaves from
+shootObj shoot(ray ray, const scene* scene, size_t* rejected) {
+    shootObj closest = { INFINITY, NULL, 0, NULL };
+
+    traceScene(ray, scene, RAY_EPSILON, &closest, rejected);
+
     return closest;
 }
 
-pixel shade(ray ray, vector3d intersection, sceneObj* closest, sceneObj** objs,
-        sceneLight** lights, int level) {
-    pixel pixel = { 0 };
+// Keeps the nearest hit past tMin in 'closest', if it beats what is there
+void traceScene(ray ray, const scene* scene, real tMin, shootObj* closest,
+        size_t* rejected) {
+    for(size_t i = 0; i < scene->planes.count; i++) {
+        real t = plane_intersection(ray, &(scene->planes), i, tMin,
+            closest->t);
+        if(t > 0) {
+            considerHit(t, scene->planes.objs[i], 0, closest);
+        }
+    }
+
+    traceMeshes(ray, scene, tMin, closest, rejected);
+    traceInstances(ray, scene, tMin, closest, rejected);
 
-    if(level > MAX_RECURSION_LEVEL) {
-        return pixel;
+    if(scene->bvh.nodeCount > 0) {
+        traceClosest(ray, scene, 0, tMin, closest, rejected);
     }
+}
 
-    vector3d reflectVector = getReflection(closest, intersection, ray.dir);
-    vector3d refractVector = getRefraction(closest, intersection, ray.dir);
-    float directPercent = 1 - closest->reflectivity - closest->refractivity;
-    struct ray reflectRay = { 0 };
+void traceClosest(ray ray, const scene* scene, size_t root, real tMin,
+        shootObj* closest, size_t* rejected) {
+    const bvhNode* nodes = scene->bvh.nodes;
+    real closestValue = closest->t;
+    vector3d invDir = { 1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z };
+    size_t stack[BVH_MAX_DEPTH];
+    size_t stackSize = 0;
+    size_t index = root;
 
-    vector3d sum = { 0 };
-    vector3d color = { 0 };
-    struct pixel m_color = { 0 };
+    for(;;) {
+        const bvhNode* node = &(nodes[index]);
+        // Equal entry distances are still visited, since a tie may be won
+        // by an object that came earlier in the scene file
+        if(aabb_hit(node->bounds, ray.origin, invDir, closestValue)) {
+            if(node->count == 0) {
+                // Descend into the near child first so the far one can be
+                // culled against the closest hit found so far
+                real axisDir = node->axis == 0 ? ray.dir.x :
+                    (node->axis == 1 ? ray.dir.y : ray.dir.z);
+                if(axisDir < 0) {
+                    stack[stackSize++] = index + 1;
+                    index = node->offset;
+                }
+                else {
+                    stack[stackSize++] = node->offset;
+                    index = index + 1;
+                }
+                continue;
+            }
+
+            // Hits as far as the closest are still wanted for ties
+            real t;
+            size_t hit;
+            if(spheres_nearest(&(scene->spheres), node->offset, node->count,
+                    ray.origin, ray.dir, tMin, closestValue, &t, &hit,
+                    rejected)) {
+                considerHit(t, scene->spheres.objs[hit], 0, closest);
+                closestValue = closest->t;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        index = stack[--stackSize];
+    }
+}
 
-    shootObj shootObj = shoot(ray, objs);
-    if(shootObj.obj != NULL) {
-        reflectRay.origin.x = intersection.x;
-        reflectRay.origin.y = intersection.y;
-        reflectRay.origin.z = intersection.z;
+// Nearest hit on any mesh, kept if it beats 'closest'
+void traceMeshes(ray ray, const scene* scene, real tMin, shootObj* closest,
+        size_t* rejected) {
+    if(scene->meshes.count == 0) {
+        return;
+    }
+
+    meshRay meshRay = mesh_ray(ray.origin, ray.dir);
+    for(size_t i = 0; i < scene->meshes.count; i++) {
+        sceneObj* obj = scene->meshes.objs[i];
+        real t;
+        size_t triangle;
+        if(mesh_nearest(obj->mesh.data, &meshRay, tMin, closest->t, &t,
+                &triangle, rejected)) {
+            considerHit(t, obj, triangle, closest);
+        }
+    }
+}
+
+// Walks the BVH over the instances, tracing each one whose bounds the ray
+// meets before the closest hit
+void traceInstances(ray ray, const scene* scene, real tMin, shootObj* closest,
+        size_t* rejected) {
+    const sceneInstances* instances = &(scene->instances);
+    if(instances->count == 0) {
+        return;
+    }
+
+    const bvhNode* nodes = instances->bvh.nodes;
+    vector3d invDir = { 1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z };
+    size_t stack[BVH_MAX_DEPTH];
+    size_t stackSize = 0;
+    size_t index = 0;
 
-        reflectRay.dir.x = reflectVector.x * shootObj.t;
-        reflectRay.dir.y = reflectVector.y * shootObj.t;
-        reflectRay.dir.z = reflectVector.z * shootObj.t;
+    for(;;) {
+        const bvhNode* node = &(nodes[index]);
+        if(aabb_hit(node->bounds, ray.origin, invDir, closest->t)) {
+            if(node->count == 0) {
+                real axisDir = node->axis == 0 ? ray.dir.x :
+                    (node->axis == 1 ? ray.dir.y : ray.dir.z);
+                if(axisDir < 0) {
+                    stack[stackSize++] = index + 1;
+                    index = node->offset;
+                }
+                else {
+                    stack[stackSize++] = node->offset;
+                    index = index + 1;
+                }
+                continue;
+            }
 
-        m_color = shade(reflectRay, reflectVector, shootObj.obj, objs, lights,
-            level + 1);
+            for(size_t i = node->offset; i < node->offset + node->count; i++) {
+                traceInstance(ray, &(instances->instances[i]), tMin, closest,
+                    rejected);
+            }
+        }
 
-        color = vector3d_add(vector3d_scale(reflectVector, closest->reflectivity),
-            vector3d_scale(refractVector, closest->refractivity));
-        sum = vector3d_add(sum, color);
+        if(stackSize == 0) {
+            break;
+        }
+        index = stack[--stackSize];
     }
+}
+
+// Traces the ray through one copy of a group in the group's own space. The
+// scale is uniform, so the direction stays a unit vector and distances
+// there are the scene's divided by the scale.
+void traceInstance(ray ray, const sceneInstance* instance, real tMin,
+        shootObj* closest, size_t* rejected) {
+    real scale = instance->scale;
+    shootObj found = { closest->t / scale, NULL, 0, NULL };
 
+    traceScene(toInstance(ray, instance), instance->group->scene, tMin / scale,
+        &found, rejected);
+    if(found.obj != NULL &&
+            considerHit(found.t * scale, found.obj, found.prim, closest)) {
+        closest->instance = instance;
+    }
+}
 
-    for(size_t i = 0; lights[i] != NULL; i++) {
-        if(!inShadow(intersection, lights[i], objs, closest)) {
-            color = vector3d_scale(getColor(ray, intersection, closest, lights[i]),
-                directPercent);
-            sum = vector3d_add(sum, color);
+ray toInstance(ray ray, const sceneInstance* instance) {
+    ray.origin = vector3d_scale(vector3d_sub(ray.origin, instance->pos),
+        1 / instance->scale);
+
+    return ray;
+}
+
+void shootPacket(const ray* rays, size_t count, const scene* scene,
+        shootObj* closest, size_t* rejected) {
+    rayPacket packet;
+    packetReal closestValue = packet_set1(INFINITY);
+    packetReal zero = packet_set1(0);
+    packetReal tMin = packet_set1(RAY_EPSILON);
+
+    // Unused lanes repeat the first ray so they never produce NaNs, but are
+    // left out of the active mask
+    for(size_t i = 0; i < PACKET_SIZE; i++) {
+        const ray* ray = &(rays[i < count ? i : 0]);
+        packet.originX[i] = ray->origin.x;
+        packet.originY[i] = ray->origin.y;
+        packet.originZ[i] = ray->origin.z;
+        packet.dirX[i] = ray->dir.x;
+        packet.dirY[i] = ray->dir.y;
+        packet.dirZ[i] = ray->dir.z;
+        closest[i].t = INFINITY;
+        closest[i].obj = NULL;
+        closest[i].prim = 0;
+        closest[i].instance = NULL;
+    }
+    packet.invDirX = 1 / packet.dirX;
+    packet.invDirY = 1 / packet.dirY;
+    packet.invDirZ = 1 / packet.dirZ;
+    packet.active = (1u << count) - 1;
+
+    // Same arithmetic as plane_intersection(), one plane for every lane
+    const scenePlanes* planes = &(scene->planes);
+    for(size_t i = 0; i < planes->count; i++) {
+        real normalX = planes->normalX[i];
+        real normalY = planes->normalY[i];
+        real normalZ = planes->normalZ[i];
+        packetReal denominator = normalX * packet.dirX + normalY * packet.dirY +
+            normalZ * packet.dirZ;
+        packetReal t = -(normalX * (packet.originX - planes->posX[i]) +
+            normalY * (packet.originY - planes->posY[i]) +
+            normalZ * (packet.originZ - planes->posZ[i])) / denominator;
+        unsigned int hits = packet.active & packet_bits((denominator != zero) &
+            (t > tMin) & (t < closestValue));
+
+        for(size_t lane = 0; hits != 0; lane++, hits >>= 1) {
+            if(hits & 1) {
+                closestValue[lane] = t[lane];
+                closest[lane].t = t[lane];
+                closest[lane].obj = planes->objs[i];
+            }
         }
     }
 
+    // Triangles and instances have no packet kernel, so each lane walks
+    // them alone
+    if(scene->meshes.count > 0 || scene->instances.count > 0) {
+        for(size_t lane = 0; lane < count; lane++) {
+            traceMeshes(rays[lane], scene, RAY_EPSILON, &(closest[lane]),
+                rejected);
+            traceInstances(rays[lane], scene, RAY_EPSILON, &(closest[lane]),
+                rejected);
+            closestValue[lane] = closest[lane].t;
+        }
+    }
+
+    if(scene->bvh.nodeCount == 0) {
+        return;
+    }
+
+    const bvhNode* nodes = scene->bvh.nodes;
+    size_t stack[BVH_MAX_DEPTH];
+    unsigned int stackMasks[BVH_MAX_DEPTH];
+    size_t stackSize = 0;
+    size_t index = 0;
+    unsigned int mask = packet.active;
+
+    for(;;) {
+        const bvhNode* node = &(nodes[index]);
+        unsigned int hits = mask & packetBoxHits(&packet, node->bounds,
+            &closestValue);
+
+        if(hits != 0 && packet_count(hits) < PACKET_MIN_ACTIVE) {
+            // Too few lanes left to be worth the packet, so finish this
+            // subtree one ray at a time
+            for(size_t lane = 0; hits != 0; lane++, hits >>= 1) {
+                if(hits & 1) {
+                    traceClosest(rays[lane], scene, index, RAY_EPSILON,
+                        &(closest[lane]), rejected);
+                    closestValue[lane] = closest[lane].t;
+                }
+            }
+        }
+        else if(hits != 0 && node->count == 0) {
+            // Order children by the direction of the first live lane
+            size_t first = 0;
+            while(!(hits & (1u << first))) {
+                first++;
+            }
+            real axisDir = node->axis == 0 ? packet.dirX[first] :
+                (node->axis == 1 ? packet.dirY[first] : packet.dirZ[first]);
+            stackMasks[stackSize] = hits;
+            mask = hits;
+            if(axisDir < 0) {
+                stack[stackSize++] = index + 1;
+                index = node->offset;
+            }
+            else {
+                stack[stackSize++] = node->offset;
+                index = index + 1;
+            }
+            continue;
+        }
+        else if(hits != 0) {
+            for(size_t i = node->offset; i < node->offset + node->count; i++) {
+                packetIntersect(&packet, &(scene->spheres), i, hits,
+                    &closestValue, closest, rejected);
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        index = stack[--stackSize];
+        mask = stackMasks[stackSize];
+    }
+}
+
+unsigned int packetBoxHits(const rayPacket* packet, aabb box,
+        const packetReal* tMax) {
+    packetReal t1 = (box.min.x - packet->originX) * packet->invDirX;
+    packetReal t2 = (box.max.x - packet->originX) * packet->invDirX;
+    packetReal tNear = packet_min(t1, t2);
+    packetReal tFar = packet_max(t1, t2);
+
+    t1 = (box.min.y - packet->originY) * packet->invDirY;
+    t2 = (box.max.y - packet->originY) * packet->invDirY;
+    tNear = packet_max(tNear, packet_min(t1, t2));
+    tFar = packet_min(tFar, packet_max(t1, t2));
+
+    t1 = (box.min.z - packet->originZ) * packet->invDirZ;
+    t2 = (box.max.z - packet->originZ) * packet->invDirZ;
+    tNear = packet_max(tNear, packet_min(t1, t2));
+    tFar = packet_min(tFar, packet_max(t1, t2));
+
+    return packet_bits((tNear <= tFar) & (tFar > packet_set1(0)) &
+        (tNear <= *tMax));
+}
+
+void packetIntersect(const rayPacket* packet, const sceneSpheres* spheres,
+        size_t index, unsigned int mask, packetReal* closestValue,
+        shootObj* closest, size_t* rejected) {
+    // Same arithmetic as sphere_intersection(), so every lane produces
+    // exactly the t the single ray path would
+    vector3d pos = { spheres->posX[index], spheres->posY[index],
+        spheres->posZ[index] };
+    real radius = spheres->radius[index];
+    sceneObj* obj = spheres->objs[index];
+    packetReal t = packet->dirX * (pos.x - packet->originX) +
+        packet->dirY * (pos.y - packet->originY) +
+        packet->dirZ * (pos.z - packet->originZ);
+
+    // Lanes whose near root cannot land between RAY_EPSILON and their
+    // closest hit drop out, and the roots are skipped if none are left
+    packetReal tMin = packet_set1(RAY_EPSILON);
+    packetReal slack = packet_set1(REJECT_SLACK);
+    unsigned int live = mask & packet_bits((t > tMin) &
+        (t - radius * slack <= *closestValue * slack));
+    *rejected += packet_count(mask) - packet_count(live);
+    if(live == 0) {
+        return;
+    }
+    packetReal offsetX = packet->originX + packet->dirX * t - pos.x;
+    packetReal offsetY = packet->originY + packet->dirY * t - pos.y;
+    packetReal offsetZ = packet->originZ + packet->dirZ * t - pos.z;
+    packetReal magnitude = packet_sqrt(offsetX * offsetX + offsetY * offsetY +
+        offsetZ * offsetZ);
+    packetMask inside = magnitude <= radius;
+    // Lanes that miss would take the root of a negative, so zero them first
+    packetReal a = packet_sqrt(packet_select(inside,
+        spheres->radius2[index] - magnitude * magnitude, packet_set1(0)));
+    t = t - a;
+
+    unsigned int hits = live & packet_bits(inside & (t > tMin));
+    for(size_t lane = 0; hits != 0; lane++, hits >>= 1) {
+        if(hits & 1) {
+            if(considerHit(t[lane], obj, 0, &(closest[lane]))) {
+                (*closestValue)[lane] = closest[lane].t;
+            }
+        }
+    }
+}
+
+// Keeps the hit if it is nearer than the current closest, or equally near
+// but earlier in the scene file, which is what a linear scan would pick
+//
+// The hit is taken to be outside any instance; instances set their own
+// after a hit inside them is kept.
+int considerHit(real t, sceneObj* obj, size_t prim, shootObj* closest) {
+    real closestValue = closest->t;
+
+    if(t > 0 && (t < closestValue || (t == closestValue &&
+            closest->obj != NULL && obj->id < closest->obj->id))) {
+        closest->t = t;
+        closest->obj = obj;
+        closest->prim = prim;
+        closest->instance = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Shades a primary hit along with every reflection and refraction it leads
+// to. Rather than recursing, secondary rays go on the worker's stack with the
+// fraction of their color that reaches the pixel, and a ray whose fraction
+// drops below minWeight is never traced.
+pixel shade(ray ray, const shootObj* closest, traceContext* context) {
+    const scene* scene = context->scene;
+    hitContext hit = getHit(ray, closest);
+    real weight = 1;
+    size_t depth = 0;
+    vector3d sum = { 0 };
+
+    context->stackSize = 0;
+    for(;;) {
+        // Only the primary hit is known to lie in the tile
+        const lightList* lights = depth == 0 ? context->tileLights :
+            context->allLights;
+        sum = vector3d_add(sum, vector3d_scale(shadeHit(&hit, lights, context),
+            weight));
+        if(depth < context->maxDepth) {
+            if(hit.obj->material & MATERIAL_REFLECTIVE) {
+                pushPathRay(context, &hit, getReflection(&hit),
+                    weight * hit.obj->reflectivity, depth + 1);
+            }
+            if(hit.obj->material & MATERIAL_REFRACTIVE) {
+                pushPathRay(context, &hit, getRefraction(&hit),
+                    weight * hit.obj->refractivity, depth + 1);
+            }
+        }
+
+        // Move on to the next pending ray that hits something
+        shootObj next = { 0 };
+        pathRay path;
+        while(next.obj == NULL && context->stackSize > 0) {
+            path = context->stack[--context->stackSize];
+            next = shoot(path.ray, scene, &(context->stats.rejectedTests));
+            context->stats.secondaryRays++;
+        }
+        if(next.obj == NULL) {
+            break;
+        }
+
+        hit = getHit(path.ray, &next);
+        weight = path.weight;
+        depth = path.depth;
+    }
+
     pixel_clamp(&sum);
-    pixel = vector3d2pixel(sum);
 
-    return pixel;
+    return vector3d2pixel(sum);
 }
 
-vector3d getReflection(sceneObj* obj, vector3d pos, vector3d dir) {
-    vector3d normal = getNormal(pos, obj);
+// Direct lighting at a hit from the given lights, scaled by the share of
+// light the surface does not reflect or refract
+vector3d shadeHit(const hitContext* hit, const lightList* lights,
+        traceContext* context) {
+    const compiledLight* compiled = context->scene->compiledLights.lights;
+    const size_t* index = lights->lights;
+    sceneObj* obj = hit->obj;
+    float directPercent = 1 - obj->reflectivity - obj->refractivity;
+
+    vector3d sum = { 0 };
+    if(obj->material & MATERIAL_UNLIT) {
+        return sum;
+    }
+
+    for(size_t i = 0; i < lights->pointCount; i++, index++) {
+        sum = vector3d_add(sum, shadePointLight(hit, &(compiled[*index]),
+            directPercent, context));
+    }
+    for(size_t i = 0; i < lights->spotCount; i++, index++) {
+        sum = vector3d_add(sum, shadeSpotLight(hit, &(compiled[*index]),
+            directPercent, context));
+    }
+    for(size_t i = 0; i < lights->directionalCount; i++, index++) {
+        sum = vector3d_add(sum, shadeDirectionalLight(hit,
+            &(compiled[*index]), directPercent, context));
+    }
+
+    return sum;
+}
+
+vector3d shadePointLight(const hitContext* hit, const compiledLight* light,
+        real directPercent, traceContext* context) {
+    lightSample sample;
+    if(!getLightSample(hit, light, context, &sample) ||
+            inShadow(hit, light->index, &sample, context)) {
+        return vector3d_zero();
+    }
+
+    return vector3d_scale(getColor(hit, &sample, getRadialAtten(&sample)),
+        directPercent);
+}
+
+// The cone is checked before the shadow ray, as nothing outside it is lit
+vector3d shadeSpotLight(const hitContext* hit, const compiledLight* light,
+        real directPercent, traceContext* context) {
+    lightSample sample;
+    if(!getLightSample(hit, light, context, &sample)) {
+        return vector3d_zero();
+    }
+    real spotAtten = getSpotAtten(&sample);
+    if(spotAtten == 0 || inShadow(hit, light->index, &sample, context)) {
+        return vector3d_zero();
+    }
+
+    return vector3d_scale(getColor(hit, &sample,
+        getRadialAtten(&sample) * spotAtten), directPercent);
+}
+
+// Directional lights are infinitely far away, so they have no falloff
+vector3d shadeDirectionalLight(const hitContext* hit,
+        const compiledLight* light, real directPercent, traceContext* context) {
+    lightSample sample = { light, light->dir, INFINITY };
+    if(inShadow(hit, light->index, &sample, context)) {
+        return vector3d_zero();
+    }
+
+    return vector3d_scale(getColor(hit, &sample, 1), directPercent);
+}
+
+void pushPathRay(traceContext* context, const hitContext* hit, vector3d dir,
+        real weight, size_t depth) {
+    pathRay path;
+    if(spawnPathRay(context, hit, dir, weight, depth, &path)) {
+        context->stack[context->stackSize++] = path;
+    }
+}
+
+// Fills in 'path' and returns 1 if a ray from the hit carries enough weight
+// to be worth tracing. A ray carrying nothing never is, even with a
+// minWeight of 0.
+int spawnPathRay(traceContext* context, const hitContext* hit, vector3d dir,
+        real weight, size_t depth, pathRay* path) {
+    if(weight <= 0) {
+        return 0;
+    }
+    if(weight < context->minWeight) {
+        context->stats.culledRays++;
+        return 0;
+    }
+
+    path->ray.origin = hit->point;
+    path->ray.dir = dir;
+    path->weight = weight;
+    path->depth = depth;
+
+    return 1;
+}
+
+// Wavefront counterpart of shade(): the primary hit's direct lighting goes
+// straight to the pixel, and its secondary rays are queued for traceWaves()
+void shadeWave(renderJob* job, traceContext* context, ray ray,
+        const shootObj* closest, size_t pixel) {
+    hitContext hit = getHit(ray, closest);
+    vector3d color = shadeHit(&hit, context->tileLights, context);
+
+    job->colors[pixel] = color;
+    pixel_clamp(&color);
+    job->pixels[pixel] = vector3d2pixel(color);
+
+    pathRay path;
+    if(context->maxDepth > 0) {
+        if((hit.obj->material & MATERIAL_REFLECTIVE) &&
+                spawnPathRay(context, &hit, getReflection(&hit),
+                hit.obj->reflectivity, 1, &path)) {
+            queueWaveRay(&(context->wave), &path, pixel, 0);
+        }
+        if((hit.obj->material & MATERIAL_REFRACTIVE) &&
+                spawnPathRay(context, &hit, getRefraction(&hit),
+                hit.obj->refractivity, 1, &path)) {
+            queueWaveRay(&(context->wave), &path, pixel, 1);
+        }
+    }
+}
+
+void queueWaveRay(waveQueue* queue, const pathRay* path, size_t pixel,
+        size_t branch) {
+    if(queue->count == queue->capacity) {
+        size_t capacity = queue->capacity > 0 ? queue->capacity * 2 : 1024;
+        waveRay* rays = realloc(queue->rays, sizeof(*rays) * capacity);
+        if(rays == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        queue->rays = rays;
+        queue->capacity = capacity;
+    }
+
+    waveRay* wave = &(queue->rays[queue->count++]);
+    wave->path = *path;
+    wave->pixel = pixel;
+    wave->branch = branch;
+}
+
+// Traces the secondary rays queued by a pass one bounce at a time. Each
+// bounce is sorted so rays starting near each other and heading the same
+// way are traced together, split into chunks for the workers, and its
+// colors are then added to the pixels in sorted order, so the image does
+// not depend on the thread count.
+void traceWaves(renderJob* job, size_t threads) {
+    waveQueue queue = { 0 };
+    for(size_t i = 0; i < threads; i++) {
+        waveQueue* own = &(job->contexts[i].wave);
+        for(size_t j = 0; j < own->count; j++) {
+            queueWaveRay(&queue, &(own->rays[j].path), own->rays[j].pixel,
+                own->rays[j].branch);
+        }
+        own->count = 0;
+    }
+
+    waveRay* next = NULL;
+    while(queue.count > 0) {
+        sortWaveRays(queue.rays, queue.count);
+
+        next = realloc(next, sizeof(*next) * queue.count * 2);
+        if(next == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+
+        waveJob wave = { job, queue.rays, queue.count, next };
+        size_t chunks = (queue.count + WAVE_CHUNK - 1) / WAVE_CHUNK;
+        if(threadpool_run(threads, chunks, traceWaveChunk, &wave) < 0) {
+            fprintf(stderr, "Error: Rendering with %zu threads failed\n",
+                threads);
+            exit(EXIT_FAILURE);
+        }
+
+        for(size_t i = 0; i < queue.count; i++) {
+            size_t pixel = queue.rays[i].pixel;
+            vector3d color = vector3d_add(job->colors[pixel],
+                queue.rays[i].color);
+            job->colors[pixel] = color;
+            pixel_clamp(&color);
+            job->pixels[pixel] = vector3d2pixel(color);
+        }
+
+        // Every ray can leave two behind, so the queue has room for them
+        // all before any is copied in
+        if(queue.capacity < wave.count * 2) {
+            queue.capacity = wave.count * 2;
+            queue.rays = realloc(queue.rays, sizeof(*queue.rays) *
+                queue.capacity);
+            if(queue.rays == NULL) {
+                fprintf(stderr, "Error: Memory allocation error\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        size_t count = 0;
+        for(size_t i = 0; i < wave.count * 2; i++) {
+            if(next[i].path.weight > 0) {
+                queue.rays[count++] = next[i];
+            }
+        }
+        queue.count = count;
+    }
+
+    free(next);
+    free(queue.rays);
+}
+
+void traceWaveChunk(size_t task, size_t worker, void* arg) {
+    waveJob* wave = arg;
+    traceContext* context = &(wave->job->contexts[worker]);
+    const scene* scene = context->scene;
+
+    size_t end = (task + 1) * WAVE_CHUNK;
+    if(end > wave->count) {
+        end = wave->count;
+    }
+
+    for(size_t i = task * WAVE_CHUNK; i < end; i++) {
+        waveRay* ray = &(wave->rays[i]);
+        waveRay* reflected = &(wave->next[i * 2]);
+        waveRay* refracted = &(wave->next[i * 2 + 1]);
+        reflected->path.weight = 0;
+        refracted->path.weight = 0;
+
+        shootObj shootObj = shoot(ray->path.ray, scene,
+            &(context->stats.rejectedTests));
+        context->stats.secondaryRays++;
+        if(shootObj.obj == NULL) {
+            ray->color = vector3d_zero();
+            continue;
+        }
+
+        hitContext hit = getHit(ray->path.ray, &shootObj);
+        ray->color = vector3d_scale(shadeHit(&hit, context->allLights, context),
+            ray->path.weight);
+
+        size_t depth = ray->path.depth;
+        if(depth < context->maxDepth) {
+            real weight = ray->path.weight;
+            int material = hit.obj->material;
+            if((material & MATERIAL_REFLECTIVE) &&
+                    spawnPathRay(context, &hit, getReflection(&hit),
+                    weight * hit.obj->reflectivity, depth + 1,
+                    &(reflected->path))) {
+                reflected->pixel = ray->pixel;
+                reflected->branch = i * 2;
+            }
+            if((material & MATERIAL_REFRACTIVE) &&
+                    spawnPathRay(context, &hit, getRefraction(&hit),
+                    weight * hit.obj->refractivity, depth + 1,
+                    &(refracted->path))) {
+                refracted->pixel = ray->pixel;
+                refracted->branch = i * 2 + 1;
+            }
+        }
+    }
+}
+
+// Sorts a bounce by the Morton code of the ray's origin within the bounds of
+// all origins, then by direction octant
+void sortWaveRays(waveRay* rays, size_t count) {
+    if(count == 0) {
+        return;
+    }
+
+    vector3d min = rays[0].path.ray.origin;
+    vector3d max = min;
+    for(size_t i = 1; i < count; i++) {
+        vector3d origin = rays[i].path.ray.origin;
+        min.x = fmin(min.x, origin.x);
+        min.y = fmin(min.y, origin.y);
+        min.z = fmin(min.z, origin.z);
+        max.x = fmax(max.x, origin.x);
+        max.y = fmax(max.y, origin.y);
+        max.z = fmax(max.z, origin.z);
+    }
+
+    const real cells = (1 << WAVE_CELL_BITS) - 1;
+    vector3d extent = vector3d_sub(max, min);
+    vector3d scale = {
+        extent.x > 0 ? cells / extent.x : 0,
+        extent.y > 0 ? cells / extent.y : 0,
+        extent.z > 0 ? cells / extent.z : 0
+    };
+
+    for(size_t i = 0; i < count; i++) {
+        vector3d origin = rays[i].path.ray.origin;
+        vector3d dir = rays[i].path.ray.dir;
+        unsigned long long cell =
+            spreadBits((origin.x - min.x) * scale.x) |
+            spreadBits((origin.y - min.y) * scale.y) << 1 |
+            spreadBits((origin.z - min.z) * scale.z) << 2;
+        unsigned long long octant = (dir.x < 0) | (dir.y < 0) << 1 |
+            (dir.z < 0) << 2;
+        rays[i].key = cell << 3 | octant;
+    }
+
+    qsort(rays, count, sizeof(*rays), compareWaveRays);
+}
+
+// Moves the low WAVE_CELL_BITS bits of 'value' two bits apart, ready to be
+// interleaved with the other two axes
+unsigned long long spreadBits(unsigned long long value) {
+    unsigned long long spread = 0;
+    for(size_t bit = 0; bit < WAVE_CELL_BITS; bit++) {
+        spread |= (value >> bit & 1) << (bit * 3);
+    }
+
+    return spread;
+}
+
+int compareWaveRays(const void* first, const void* second) {
+    const waveRay* a = first;
+    const waveRay* b = second;
+
+    if(a->key != b->key) {
+        return a->key < b->key ? -1 : 1;
+    }
+    if(a->pixel != b->pixel) {
+        return a->pixel < b->pixel ? -1 : 1;
+    }
+    if(a->branch != b->branch) {
+        return a->branch < b->branch ? -1 : 1;
+    }
+
+    return 0;
+}
+
+hitContext getHit(ray ray, const shootObj* found) {
+    vector3d intersection = getIntersection(ray, found->t);
+    // Members of a group are shaped in the group's space. Uniform scaling
+    // leaves their normals as they are.
+    vector3d local = intersection;
+    if(found->instance != NULL) {
+        local = vector3d_scale(vector3d_sub(intersection,
+            found->instance->pos), 1 / found->instance->scale);
+    }
+    hitContext hit = { ray, intersection, getNormal(local, found->obj,
+        found->prim), found->obj };
+
+    return hit;
+}
+
+// Fills in the sample, or returns 0 if the hit is beyond the light's reach
+int getLightSample(const hitContext* hit, const compiledLight* light,
+        traceContext* context, lightSample* sample) {
+    vector3d toLight = vector3d_sub(light->pos, hit->point);
+    if(context->cullLights &&
+            vector3d_dot(toLight, toLight) > light->radius2) {
+        context->stats.culledLights++;
+        return 0;
+    }
+
+    // The length found while normalizing is the distance to the light, so
+    // one square root serves both
+    real distance = vector3d_magnitude(toLight);
+    sample->light = light;
+    sample->dir.x = toLight.x / distance;
+    sample->dir.y = toLight.y / distance;
+    sample->dir.z = toLight.z / distance;
+    sample->distance = distance;
+
+    return 1;
+}
+
+vector3d getReflection(const hitContext* hit) {
+    vector3d dir = hit->ray.dir;
+    vector3d normal = hit->normal;
 
     vector3d u_m = vector3d_sub(dir, vector3d_scale(normal, 2 * vector3d_dot(dir, normal)));
 
     return u_m;
 }
 
-vector3d getRefraction(sceneObj* obj, vector3d pos, vector3d dir) {
-    vector3d normal = getNormal(pos, obj);
-    vector3d a = vector3d_normalize(vector3d_cross(normal, dir));
+vector3d getRefraction(const hitContext* hit) {
+    sceneObj* obj = hit->obj;
+    vector3d dir = hit->ray.dir;
+    vector3d normal = hit->normal;
+    vector3d cross = vector3d_cross(normal, dir);
+    // Straight on, the ray passes through unbent
+    if(cross.x == 0 && cross.y == 0 && cross.z == 0) {
+        return dir;
+    }
+    vector3d a = vector3d_normalize(cross);
     vector3d b = vector3d_cross(a, normal);
 
     float extIor = 1;
@@ -168,32 +1750,31 @@ vector3d getRefraction(sceneObj* obj, vector3d pos, vector3d dir) {
     return dir_t;
 }
 
-vector3d getIntersection(ray ray, double t) {
+vector3d getIntersection(ray ray, real t) {
     return vector3d_add(ray.origin, vector3d_scale(ray.dir, t));
 }
 
-vector3d getNormal(vector3d intersection, sceneObj* obj) {
+vector3d getNormal(vector3d intersection, sceneObj* obj, size_t prim) {
     switch(obj->type) {
         case(TYPE_SPHERE):
             return vector3d_normalize(vector3d_sub(intersection, obj->sphere.pos));
         case(TYPE_PLANE):
             return obj->plane.normal;
+        case(TYPE_MESH):
+            return mesh_normal(obj->mesh.data, prim);
         default:
             fprintf(stderr, "Error: Invalid obj type\n");
             exit(EXIT_FAILURE);
     }
 }
 
-vector3d getColor(ray ray, vector3d intersection, sceneObj* closest,
-        sceneLight* light) {
-    double radialAtten = getRadialAtten(intersection, light);
-    double angularAtten = getAngularAtten(intersection, light);
-
-    vector3d sum = vector3d_add(
-        getDiffuse(intersection, closest, light),
-        getSpecular(ray, intersection, closest, light)
-    );
-    sum = vector3d_scale(sum, radialAtten * angularAtten);
+vector3d getColor(const hitContext* hit, const lightSample* sample,
+        real atten) {
+    vector3d sum = getDiffuse(hit, sample);
+    if(hit->obj->material & MATERIAL_SPECULAR) {
+        sum = vector3d_add(sum, getSpecular(hit, sample));
+    }
+    sum = vector3d_scale(sum, atten);
 
     sum.x = clamp(sum.x, 0, INFINITY);
     sum.y = clamp(sum.y, 0, INFINITY);
@@ -202,68 +1783,231 @@ vector3d getColor(ray ray, vector3d intersection, sceneObj* closest,
     return sum;
 }
 
-int inShadow(vector3d intersection, sceneLight* light, sceneObj** objs,
-        sceneObj* exclude) {
-    vector3d dir = vector3d_normalize(vector3d_sub(light->pos, intersection));
-    double distance = vector3d_distance(light->pos, intersection);
-    ray ray = { intersection, dir };
-    double t;
-    for(size_t i = 0; objs[i] != NULL; i++) {
-        switch(objs[i]->type) {
-            case(TYPE_SPHERE):
-                t = sphere_intersection(ray, objs[i]);
-                break;
-            case(TYPE_PLANE):
-                t = plane_intersection(ray, objs[i]);
-                break;
-            default:
-                fprintf(stderr, "Error: Invalid obj type\n");
-                exit(EXIT_FAILURE);
-        }
-        if(t > 0 && t < distance && objs[i] != exclude) {
+int inShadow(const hitContext* hit, size_t light, const lightSample* sample,
+        traceContext* context) {
+    const scene* scene = context->scene;
+    real distance = sample->distance;
+    ray ray = { hit->point, sample->dir };
+    occluder* cached = &(context->occluders[light]);
+    size_t* rejected = &(context->stats.rejectedTests);
+
+    context->stats.shadowRays++;
+    if(cached->type != OCCLUDER_NONE &&
+            occluderBlocks(ray, distance, scene, *cached, rejected)) {
+        context->stats.occluderHits++;
+        return 1;
+    }
+
+    return sceneBlocks(ray, RAY_EPSILON, distance, scene, cached, rejected);
+}
+
+// Any-hit query over everything in the scene, recording what was hit in
+// 'found'
+int sceneBlocks(ray ray, real tMin, real distance, const scene* scene,
+        occluder* found, size_t* rejected) {
+    for(size_t i = 0; i < scene->planes.count; i++) {
+        if(plane_intersection(ray, &(scene->planes), i, tMin, distance) > 0) {
+            found->type = TYPE_PLANE;
+            found->index = i;
             return 1;
         }
     }
+
+    size_t index;
+    if(traceAny(ray, tMin, distance, scene, &index, rejected)) {
+        found->type = TYPE_SPHERE;
+        found->index = index;
+        return 1;
+    }
+
+    if(traceAnyMesh(ray, tMin, distance, scene, found, rejected)) {
+        return 1;
+    }
+
+    if(traceAnyInstance(ray, tMin, distance, scene, &index, rejected)) {
+        found->type = OCCLUDER_INSTANCE;
+        found->index = index;
+        return 1;
+    }
+
     return 0;
 }
 
-double getRadialAtten(vector3d intersection, sceneLight* light) {
-    double distance = vector3d_distance(light->pos, intersection);
+// Whether a previously found occluder also blocks this shadow ray
+int occluderBlocks(ray ray, real distance, const scene* scene,
+        occluder occluder, size_t* rejected) {
+    real t;
 
-    if(distance == INFINITY) {
-        return 1;
+    switch(occluder.type) {
+        case(TYPE_PLANE):
+            t = plane_intersection(ray, &(scene->planes), occluder.index,
+                RAY_EPSILON, distance);
+            break;
+        case(TYPE_SPHERE):
+            t = sphere_intersection(ray, &(scene->spheres), occluder.index,
+                RAY_EPSILON, distance, rejected);
+            break;
+        case(TYPE_MESH): {
+            meshRay meshRay = mesh_ray(ray.origin, ray.dir);
+            t = triangle_intersection(scene->meshes.objs[occluder.index]->mesh.data,
+                occluder.prim, &meshRay, RAY_EPSILON, distance, rejected);
+            break;
+        }
+        case(OCCLUDER_INSTANCE):
+            return instanceBlocks(ray, RAY_EPSILON, distance,
+                &(scene->instances.instances[occluder.index]), rejected);
+        default:
+            return 0;
     }
-    else {
-        return (1 / (
-            (light->radialAtten[2] * distance * distance) +
-            (light->radialAtten[1] * distance) +
-            light->radialAtten[0]
-        ));
+
+    return t > 0;
+}
+
+// Any-hit BVH query: returns 1 and sets 'index' to some sphere hit in
+// (tMin, distance]. The first one found will do, so there is no need to
+// order the children or track the closest one.
+int traceAny(ray ray, real tMin, real distance, const scene* scene,
+        size_t* index, size_t* rejected) {
+    if(scene->bvh.nodeCount == 0) {
+        return 0;
+    }
+
+    const bvhNode* nodes = scene->bvh.nodes;
+    vector3d invDir = { 1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z };
+    size_t stack[BVH_MAX_DEPTH];
+    size_t stackSize = 0;
+    size_t node = 0;
+
+    for(;;) {
+        const bvhNode* current = &(nodes[node]);
+        if(aabb_hit(current->bounds, ray.origin, invDir, distance)) {
+            if(current->count == 0) {
+                stack[stackSize++] = current->offset;
+                node = node + 1;
+                continue;
+            }
+
+            if(spheres_occluded(&(scene->spheres), current->offset,
+                    current->count, ray.origin, ray.dir, tMin, distance, index,
+                    rejected)) {
+                return 1;
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        node = stack[--stackSize];
     }
+
+    return 0;
 }
 
-double getAngularAtten(vector3d intersection, sceneLight* light) {
-    // Not spot light
-    if(light->theta == 0 || light->angularAtten == 0 || (
-            light->dir.x == 0 && light->dir.y == 0 && light->dir.z == 0)) {
-        return 1;
+// Any-hit query over the meshes, recording the triangle found in 'found'
+int traceAnyMesh(ray ray, real tMin, real distance, const scene* scene,
+        occluder* found, size_t* rejected) {
+    if(scene->meshes.count == 0) {
+        return 0;
+    }
+
+    meshRay meshRay = mesh_ray(ray.origin, ray.dir);
+    for(size_t i = 0; i < scene->meshes.count; i++) {
+        size_t triangle;
+        if(mesh_occluded(scene->meshes.objs[i]->mesh.data, &meshRay, tMin,
+                distance, &triangle, rejected)) {
+            found->type = TYPE_MESH;
+            found->index = i;
+            found->prim = triangle;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Any-hit query over the instances, setting 'index' to the one hit
+int traceAnyInstance(ray ray, real tMin, real distance, const scene* scene,
+        size_t* index, size_t* rejected) {
+    const sceneInstances* instances = &(scene->instances);
+    if(instances->count == 0) {
+        return 0;
+    }
+
+    const bvhNode* nodes = instances->bvh.nodes;
+    vector3d invDir = { 1 / ray.dir.x, 1 / ray.dir.y, 1 / ray.dir.z };
+    size_t stack[BVH_MAX_DEPTH];
+    size_t stackSize = 0;
+    size_t node = 0;
+
+    for(;;) {
+        const bvhNode* current = &(nodes[node]);
+        if(aabb_hit(current->bounds, ray.origin, invDir, distance)) {
+            if(current->count == 0) {
+                stack[stackSize++] = current->offset;
+                node = node + 1;
+                continue;
+            }
+
+            for(size_t i = current->offset;
+                    i < current->offset + current->count; i++) {
+                if(instanceBlocks(ray, tMin, distance,
+                        &(instances->instances[i]), rejected)) {
+                    *index = i;
+                    return 1;
+                }
+            }
+        }
+
+        if(stackSize == 0) {
+            break;
+        }
+        node = stack[--stackSize];
     }
 
-    vector3d objVector = vector3d_normalize(vector3d_sub(intersection, light->pos));
-    double cosAlpha = vector3d_dot(objVector, light->dir);
-    double cosTheta = cos(light->theta * PI / 180.0);
-    if(cosAlpha > cosTheta) {
+    return 0;
+}
+
+int instanceBlocks(ray ray, real tMin, real distance,
+        const sceneInstance* instance, size_t* rejected) {
+    real scale = instance->scale;
+    occluder found;
+
+    return sceneBlocks(toInstance(ray, instance), tMin / scale,
+        distance / scale, instance->group->scene, &found, rejected);
+}
+
+real getRadialAtten(const lightSample* sample) {
+    const compiledLight* light = sample->light;
+    real distance = sample->distance;
+
+    return (1 / (
+        (light->radialAtten[2] * distance * distance) +
+        (light->radialAtten[1] * distance) +
+        light->radialAtten[0]
+    ));
+}
+
+real getSpotAtten(const lightSample* sample) {
+    const compiledLight* light = sample->light;
+
+    // From the light towards the hit
+    vector3d objVector = vector3d_scale(sample->dir, -1);
+    real cosAlpha = vector3d_dot(objVector, light->dir);
+    if(cosAlpha > light->cosTheta) {
         return 0;
     }
 
-    return pow(clamp(vector3d_dot(objVector, light->pos), 0, INFINITY),
-        light->angularAtten);
+    real base = clamp(vector3d_dot(objVector, light->pos), 0, INFINITY);
+    return light->angularInt >= 0 ? powInt(base, light->angularInt) :
+        pow(base, light->angularAtten);
 }
 
-vector3d getDiffuse(vector3d intersection, sceneObj* closest, sceneLight* light) {
-    vector3d dir = vector3d_normalize(vector3d_sub(light->pos, intersection));
-    vector3d normal = getNormal(intersection, closest);
-    double cosAlpha = vector3d_dot(normal, dir);
+vector3d getDiffuse(const hitContext* hit, const lightSample* sample) {
+    sceneObj* closest = hit->obj;
+    const compiledLight* light = sample->light;
+    vector3d dir = sample->dir;
+    vector3d normal = hit->normal;
+    real cosAlpha = vector3d_dot(normal, dir);
 
     if(cosAlpha > 0) {
         return vector3d_scale(vector3d_product(closest->diffuse, light->color),
@@ -274,21 +2018,24 @@ vector3d getDiffuse(vector3d intersection, sceneObj* closest, sceneLight* light)
     }
 }
 
-vector3d getSpecular(ray ray, vector3d intersection, sceneObj* closest, sceneLight* light) {
-    vector3d dir = vector3d_normalize(vector3d_sub(light->pos, intersection));
-    vector3d normal = getNormal(intersection, closest);
-    vector3d v = vector3d_scale(ray.dir, -1);
-    double cosAlpha = vector3d_dot(normal, dir);
+vector3d getSpecular(const hitContext* hit, const lightSample* sample) {
+    sceneObj* closest = hit->obj;
+    const compiledLight* light = sample->light;
+    vector3d dir = sample->dir;
+    vector3d normal = hit->normal;
+    vector3d v = vector3d_scale(hit->ray.dir, -1);
+    real cosAlpha = vector3d_dot(normal, dir);
     vector3d r = vector3d_sub(
         vector3d_scale(normal, vector3d_dot(vector3d_scale(normal, 2), dir)),
         dir
     );
-    double cosBeta = vector3d_dot(v, r);
+    real cosBeta = vector3d_dot(v, r);
 
     if(cosBeta > 0 && cosAlpha > 0) {
         return vector3d_scale(
             vector3d_product(closest->specular, light->color),
-            pow(cosBeta, closest->ns)
+            closest->material & MATERIAL_FAST_NS ?
+                powInt(cosBeta, closest->nsInt) : pow(cosBeta, closest->ns)
         );
     }
     else {
@@ -296,45 +2043,63 @@ vector3d getSpecular(ray ray, vector3d intersection, sceneObj* closest, sceneLig
     }
 }
 
-double plane_intersection(ray ray, sceneObj* obj) {
-    double denominator = vector3d_dot(obj->plane.normal, ray.dir);
+real plane_intersection(ray ray, const scenePlanes* planes, size_t index,
+        real tMin, real tMax) {
+    vector3d normal = { planes->normalX[index], planes->normalY[index],
+        planes->normalZ[index] };
+    vector3d pos = { planes->posX[index], planes->posY[index],
+        planes->posZ[index] };
+    real denominator = vector3d_dot(normal, ray.dir);
     // If the denominator is 0, then ray is parallel to plane
     if(denominator == 0) {
         return -1;
     }
-    double t = - vector3d_dot(obj->plane.normal,
-        vector3d_sub(ray.origin, obj->plane.pos)) / denominator;
+    real t = - vector3d_dot(normal, vector3d_sub(ray.origin, pos)) /
+        denominator;
 
-    if(t > 0) {
+    if(t > tMin && t <= tMax) {
         return t;
     }
 
     return -1;
 }
 
-double sphere_intersection(ray ray, sceneObj* obj) {
+// Spheres that cannot reach the interval are counted in 'rejected'
+real sphere_intersection(ray ray, const sceneSpheres* spheres, size_t index,
+        real tMin, real tMax, size_t* rejected) {
+    vector3d pos = { spheres->posX[index], spheres->posY[index],
+        spheres->posZ[index] };
+    real radius = spheres->radius[index];
+
     // t_close = Rd * (C - Ro) closest apprach along ray
     // x_close = Ro + t_close*Rd closest point from circle center
     // d = ||x_close - C|| distance from circle center
     // a = sqrt(rad^2 - d^2)
     // t = t_close - a
-    double t = vector3d_dot(ray.dir, vector3d_sub(obj->sphere.pos, ray.origin));
+    real t = vector3d_dot(ray.dir, vector3d_sub(pos, ray.origin));
+    // The near root lies in [t_close - rad, t_close], so this settles the
+    // sphere before either square root
+    if(t <= tMin || t - radius * REJECT_SLACK > tMax * REJECT_SLACK) {
+        (*rejected)++;
+        return -1;
+    }
     vector3d point = getIntersection(ray, t);
-    double magnitude = vector3d_magnitude(vector3d_sub(point, obj->sphere.pos));
-    if(magnitude > obj->sphere.radius) {
+    real magnitude = vector3d_magnitude(vector3d_sub(point, pos));
+    if(magnitude > radius) {
         return -1;
     }
-    else if(magnitude < obj->sphere.radius) {
-        double a = sqrt(pow(obj->sphere.radius, 2) - pow(magnitude, 2));
-
-        return t - a;
+    else if(magnitude < radius) {
+        t -= sqrt(spheres->radius2[index] - magnitude * magnitude);
     }
-    else {
+
+    if(t > tMin && t <= tMax) {
         return t;
     }
+
+    return -1;
 }
 
-double cylinder_intersection(ray ray, sceneObj* obj) {
+real cylinder_intersection(ray ray, sceneObj* obj, real tMin, real tMax) {
     // Step 1. Find the equation for the object you are innterested in
     // x^2 + y^2 = r^2
     //
@@ -369,35 +2134,51 @@ double cylinder_intersection(ray ray, sceneObj* obj) {
     // Use the quadratic equation to solve for t
     //
 
-    double a = pow(ray.dir.x, 2) + pow(ray.dir.x, 2);
-    double b = 2 * (
+    real a = ray.dir.x * ray.dir.x + ray.dir.x * ray.dir.x;
+    real b = 2 * (
         ray.origin.x * ray.dir.x -
         ray.dir.z * obj->cylinder.pos.x +
         ray.origin.z * ray.dir.z -
         ray.dir.z * obj->cylinder.pos.z
     );
-    double c = pow(ray.origin.z, 2) -
+    real c = ray.origin.z * ray.origin.z -
         2 * ray.origin.x * obj->cylinder.pos.x +
-        pow(obj->cylinder.pos.x, 2) + pow(ray.origin.z, 2) -
+        obj->cylinder.pos.x * obj->cylinder.pos.x +
+        ray.origin.z * ray.origin.z -
         2 * ray.origin.z * obj->cylinder.pos.z +
-        pow(obj->cylinder.pos.z, 2);
+        obj->cylinder.pos.z * obj->cylinder.pos.z;
 
-    double determinant = pow(b, 2) - 4 * a *c;
+    real determinant = b * b - 4 * a *c;
     if (determinant < 0) {
         return -1;
     }
 
     determinant = sqrt(determinant);
 
-    double t0 = (-b - determinant) / (2 * a);
-    if(t0 > 0) {
+    real t0 = (-b - determinant) / (2 * a);
+    if(t0 > tMin && t0 <= tMax) {
         return t0;
     }
 
-    double t1 = (-b + determinant) / (2 * a);
-    if (t1 > 0) {
+    real t1 = (-b + determinant) / (2 * a);
+    if (t1 > tMin && t1 <= tMax) {
         return t1;
     }
 
     return -1;
 }
+
+// Raises 'base' to a whole power by squaring, which is much cheaper than
+// pow() for the small exponents materials use
+real powInt(real base, unsigned exponent) {
+    real result = 1;
+    while(exponent > 0) {
+        if(exponent & 1) {
+            result *= base;
+        }
+        base *= base;
+        exponent >>= 1;
+    }
+
+    return result;
+}
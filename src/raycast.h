@@ -4,58 +4,112 @@
 #include <stddef.h>
 
 #include "pnm.h"
+#include "scene.h"
 #include "vector3d.h"
 
-#define TYPE_SPHERE 0
-#define TYPE_PLANE 1
-
-#define DEFAULT_NS 20
-
-typedef struct sceneObj {
-    int type;
-    vector3d diffuse;
-    vector3d specular;
-    float reflectivity;
-    float refractivity;
-    float ior;
-    double ns;
-    union {
-        struct {
-            vector3d pos;
-            double radius;
-        } sphere;
-        struct {
-            vector3d pos;
-            vector3d normal;
-        } plane;
-        struct {
-            vector3d pos;
-            double radius;
-            double height;
-        } cylinder;
-    };
-} sceneObj;
-
-typedef struct sceneLight {
-    vector3d pos;
-    vector3d dir;
-    double theta;
-    vector3d color;
-    double radialAtten[3];
-    double angularAtten;
-} sceneLight;
-
-typedef struct camera {
-    float width;
-    float height;
-} camera;
+#define DEFAULT_TILE_SIZE 16
+// First pass stride for progressive rendering, covering 1/16 of the pixels
+#define PROGRESSIVE_STRIDE 4
+// Extra samples per edge pixel and the per-channel difference (out of 255)
+// that marks an edge, when anti-aliasing
+#define DEFAULT_AA_SAMPLES 8
+#define DEFAULT_AA_THRESHOLD 16
+// Bounces followed past a primary hit, and the smallest share of a pixel's
+// color a reflected or refracted ray must carry to be traced at all (below
+// half of one 8-bit step it cannot change the output on its own)
+#define DEFAULT_MAX_DEPTH 7
+// Most bounces '--max-depth' accepts, far past where any ray keeps weight
+#define MAX_DEPTH_LIMIT (1 << 16)
+#define DEFAULT_MIN_WEIGHT (1.0 / 512)
 
 typedef struct ray {
     vector3d origin;
     vector3d dir;
 } ray;
 
+// Counters gathered while rendering, summed across workers
+typedef struct renderStats {
+    // Camera rays, including extra anti-aliasing samples
+    size_t primaryRays;
+    // Reflected and refracted rays traced
+    size_t secondaryRays;
+    // Reflected and refracted rays dropped for carrying too little weight
+    size_t culledRays;
+    // Shadow rays cast towards lights
+    size_t shadowRays;
+    // Shadow rays answered by the light's cached occluder
+    size_t occluderHits;
+    // Intersection tests settled by the ray's [tMin, tMax] interval before
+    // any square root
+    size_t rejectedTests;
+    // Light samples skipped because the hit was beyond the light's reach
+    size_t culledLights;
+    // Pixels found on an edge and supersampled
+    size_t refinedPixels;
+} renderStats;
+
+// Called once the first 'pass' + 1 passes of a progressive render are done,
+// with every pixel not rendered yet filled in from a neighbour
+typedef void (*passCallback)(const pixel* pixels, size_t pass, void* arg);
+// Called with each tile row of a streamed render once it is done, top to
+// bottom. 'rows' holds 'rowCount' full rows starting at row 'firstRow', and
+// is reused as soon as the callback returns.
+typedef void (*rowCallback)(const pixel* rows, size_t firstRow,
+    size_t rowCount, void* arg);
+
+typedef struct renderOptions {
+    // Worker threads to render with (0 uses every available core)
+    size_t threads;
+    // Width and height in pixels of the square tiles handed to workers
+    size_t tileSize;
+    // Trace neighbouring primary rays together as SIMD packets
+    int packets;
+    // Filled in after rendering if not NULL
+    renderStats* stats;
+    // Pixel stride of the first pass of a progressive render (1 renders
+    // everything in one pass). Each further pass halves it, only tracing
+    // the pixels earlier passes skipped.
+    size_t passStride;
+    // Called after every pass but the last, if not NULL
+    passCallback onPass;
+    void* passArg;
+    // Extra samples traced for each pixel whose neighbours hit another
+    // object or differ by more than aaThreshold in a channel (0 disables
+    // anti-aliasing)
+    size_t aaSamples;
+    int aaThreshold;
+    // Reflection and refraction bounces followed past a primary hit
+    size_t maxDepth;
+    // Secondary rays carrying less of the pixel's color than this are not
+    // traced
+    real minWeight;
+    // Trace secondary rays breadth first: every bounce of the image is
+    // gathered, sorted by where rays start and which way they head, and
+    // traced as one batch
+    int wavefront;
+    // Skip lights too far away to visibly light a hit, and shade primary
+    // hits with only the lights that can reach their tile
+    int lightCulling;
+    // Render only the window of 'windowWidth' by 'windowHeight' pixels whose
+    // top left corner is at (windowX, windowY), into pixels that hold just
+    // the window. A width of 0 renders the whole image. Anti-aliasing finds
+    // edges by comparing neighbours, so the window's border pixels can differ
+    // from the same pixels of a whole render.
+    size_t windowX;
+    size_t windowY;
+    size_t windowWidth;
+    size_t windowHeight;
+} renderOptions;
+
+renderOptions defaultRenderOptions();
 void raycast(pixel* pixels, size_t width, size_t height, camera camera,
-        sceneObj** objs, sceneLight** lights);
+        const scene* scene, renderOptions options);
+// Renders without a full framebuffer, keeping only the few tile rows in
+// flight, so memory depends on the width and tile size but not the height.
+// Progressive passes, anti-aliasing and wavefront tracing all need the whole
+// image, so their options are ignored.
+void raycastStream(size_t width, size_t height, camera camera,
+        const scene* scene, renderOptions options, rowCallback onRows,
+        void* rowArg);
 
 #endif // CS430_RAYCAST_H
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+
+void downscaleRow(resampleTarget* target, const pixel* row, size_t y,
+    size_t sourceWidth, size_t sourceHeight);
+
+int resample_downscale(resampleTarget* target, size_t factor,
+        size_t sourceWidth, size_t sourceHeight) {
+    if(factor == 0) {
+        fprintf(stderr, "Error: Downscale factor must be at least 1\n");
+        return -1;
+    }
+
+    // Rounded up without adding to the size first, which a huge factor would
+    // overflow
+    size_t width = sourceWidth / factor + (sourceWidth % factor != 0);
+    size_t height = sourceHeight / factor + (sourceHeight % factor != 0);
+    resampleTarget downscale = { factor, 0, 0, width, height, NULL, NULL };
+    if((downscale.pixels = malloc(sizeof(pixel) * width * height)) == NULL ||
+            (downscale.sums = calloc(width * 3, sizeof(unsigned long))) ==
+            NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        free(downscale.pixels);
+        return -1;
+    }
+
+    *target = downscale;
+    return 0;
+}
+
+int resample_crop(resampleTarget* target, size_t x, size_t y, size_t width,
+        size_t height) {
+    resampleTarget crop = { 1, x, y, width, height, NULL, NULL };
+    if((crop.pixels = malloc(sizeof(pixel) * width * height)) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return -1;
+    }
+
+    *target = crop;
+    return 0;
+}
+
+void resample_addRows(resampleTarget* targets, size_t count,
+        const pixel* rows, size_t firstRow, size_t rowCount, size_t sourceWidth,
+        size_t sourceHeight) {
+    for(size_t i = 0; i < rowCount; i++) {
+        const pixel* row = &(rows[i * sourceWidth]);
+        size_t y = firstRow + i;
+
+        for(size_t j = 0; j < count; j++) {
+            resampleTarget* target = &(targets[j]);
+            if(target->sums != NULL) {
+                downscaleRow(target, row, y, sourceWidth, sourceHeight);
+            }
+            else if(y >= target->y && y - target->y < target->height) {
+                memcpy(&(target->pixels[(y - target->y) * target->width]),
+                    &(row[target->x]), sizeof(pixel) * target->width);
+            }
+        }
+    }
+}
+
+void resample_free(resampleTarget* target) {
+    free(target->pixels);
+    free(target->sums);
+    target->pixels = NULL;
+    target->sums = NULL;
+}
+
+// Adds the row to the sums of the output row it falls in, and finishes that
+// row once its last source row is in
+void downscaleRow(resampleTarget* target, const pixel* row, size_t y,
+        size_t sourceWidth, size_t sourceHeight) {
+    size_t factor = target->factor;
+    unsigned long* sums = target->sums;
+
+    for(size_t outX = 0; outX < target->width; outX++) {
+        size_t end = (outX + 1) * factor < sourceWidth ? (outX + 1) * factor :
+            sourceWidth;
+        unsigned long red = 0;
+        unsigned long green = 0;
+        unsigned long blue = 0;
+        for(size_t x = outX * factor; x < end; x++) {
+            red += row[x].red;
+            green += row[x].green;
+            blue += row[x].blue;
+        }
+        sums[outX * 3] += red;
+        sums[outX * 3 + 1] += green;
+        sums[outX * 3 + 2] += blue;
+    }
+
+    size_t outY = y / factor;
+    if((y + 1) % factor != 0 && y + 1 != sourceHeight) {
+        return;
+    }
+
+    size_t boxRows = y + 1 - outY * factor;
+    pixel* out = &(target->pixels[outY * target->width]);
+    for(size_t outX = 0; outX < target->width; outX++) {
+        size_t boxColumns = sourceWidth - outX * factor < factor ?
+            sourceWidth - outX * factor : factor;
+        unsigned long area = boxRows * boxColumns;
+        // Rounded to the nearest value, as truncating would darken the
+        // image by half a step on average
+        out[outX].red = (sums[outX * 3] + area / 2) / area;
+        out[outX].green = (sums[outX * 3 + 1] + area / 2) / area;
+        out[outX].blue = (sums[outX * 3 + 2] + area / 2) / area;
+    }
+    memset(sums, 0, sizeof(*sums) * target->width * 3);
+}
@@ -0,0 +1,40 @@
+#ifndef CS430_RESAMPLE_H
+#define CS430_RESAMPLE_H
+
+#include <stddef.h>
+
+#include "pnm.h"
+
+// An image taken from the rows of a larger one as they go by: a box-filtered
+// downscale or a crop
+typedef struct resampleTarget {
+    // Source pixels per output pixel along each axis, 1 for crops
+    size_t factor;
+    // Where the output starts in the source, always (0, 0) for downscales
+    size_t x;
+    size_t y;
+    size_t width;
+    size_t height;
+    pixel* pixels;
+    // Channel sums of the output row a downscale is filling
+    unsigned long* sums;
+} resampleTarget;
+
+// Sets up a downscale of a 'sourceWidth' by 'sourceHeight' image, averaging
+// each 'factor' by 'factor' box into one pixel. Boxes cut short by the right
+// or bottom edge average the pixels they have, so a factor past the image's
+// size gives one pixel averaging all of it.
+int resample_downscale(resampleTarget* target, size_t factor,
+    size_t sourceWidth, size_t sourceHeight);
+// Sets up a crop of 'width' by 'height' pixels from (x, y)
+int resample_crop(resampleTarget* target, size_t x, size_t y, size_t width,
+    size_t height);
+// Feeds source rows 'firstRow' onwards to every target. Each row goes to all
+// the targets before the next is read, so the source is only read once
+// however many targets there are. Rows must come top to bottom.
+void resample_addRows(resampleTarget* targets, size_t count,
+    const pixel* rows, size_t firstRow, size_t rowCount, size_t sourceWidth,
+    size_t sourceHeight);
+void resample_free(resampleTarget* target);
+
+#endif // CS430_RESAMPLE_H
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scene.h"
+
+#define PI 3.14159265358979323846
+
+// Relative padding for primitive bounds, so a ray that grazes a box face
+// with a zero direction component never ends up exactly on the slab
+#ifdef CS430_SINGLE_PRECISION
+#define BOUNDS_EPSILON 1e-5
+#else
+#define BOUNDS_EPSILON 1e-9
+#endif
+
+// Most triangles a mesh BVH leaf keeps when no plane is worth splitting it
+#define MESH_LEAF_MAX 8
+
+size_t layoutObjects(scene* scene, sceneObj** objs, size_t firstId);
+void layoutInstances(scene* scene, sceneInstance** instances);
+aabb getBounds(sceneObj* obj);
+aabb getSceneBounds(const scene* scene);
+aabb padBounds(aabb box);
+void buildMesh(sceneMesh* mesh);
+real* allocColumn(size_t count);
+void classifyMaterial(sceneObj* obj);
+real getResponse(sceneObj** objs, real response);
+sceneLights compileLights(sceneLight** lights, real response);
+real getLightRadius2(const compiledLight* light, int type, real response);
+int getLightType(const sceneLight* light);
+
+scene buildScene(sceneObj** objs, sceneLight** lights, sceneGroup** groups,
+        sceneInstance** instances) {
+    scene scene;
+    memset(&scene, 0, sizeof(scene));
+    scene.lights = lights;
+    scene.groups = groups;
+
+    vector3d zeroVector = { 0 };
+
+    for(size_t i = 0; lights[i] != NULL; i++) {
+        if(vector3d_compare(lights[i]->dir, zeroVector) != 0) {
+            lights[i]->dir = vector3d_normalize(lights[i]->dir);
+        }
+    }
+
+    // Group members are numbered after the scene's own objects, so ties
+    // between them are still broken by file order within each list
+    size_t nextId = layoutObjects(&scene, objs, 0);
+    real response = getResponse(objs, 0);
+    for(size_t i = 0; groups[i] != NULL; i++) {
+        sceneGroup* group = groups[i];
+        if((group->scene = malloc(sizeof(*(group->scene)))) == NULL) {
+            fprintf(stderr, "Error: Memory allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(group->scene, 0, sizeof(*(group->scene)));
+        nextId = layoutObjects(group->scene, group->objs, nextId);
+        group->bounds = getSceneBounds(group->scene);
+        response = getResponse(group->objs, response);
+    }
+    layoutInstances(&scene, instances);
+
+    scene.compiledLights = compileLights(lights, response);
+
+    return scene;
+}
+
+// Normalizes and classifies the objects, then builds the plane and sphere
+// columns, the sphere BVH and every mesh's BVH. Returns the id after the
+// last object's.
+size_t layoutObjects(scene* scene, sceneObj** objs, size_t firstId) {
+    scene->objs = objs;
+
+    vector3d zeroVector = { 0 };
+
+    for(size_t i = 0; objs[i] != NULL; i++) {
+        classifyMaterial(objs[i]);
+        if(objs[i]->type == TYPE_PLANE) {
+            if(vector3d_compare(objs[i]->plane.normal, zeroVector) != 0) {
+                objs[i]->plane.normal = vector3d_normalize(objs[i]->plane.normal);
+            }
+        }
+    }
+
+    size_t objsSize = 0;
+    size_t planesSize = 0;
+    size_t meshesSize = 0;
+    for(; objs[objsSize] != NULL; objsSize++) {
+        objs[objsSize]->id = firstId + objsSize;
+        if(objs[objsSize]->type == TYPE_PLANE) {
+            planesSize++;
+        }
+        else if(objs[objsSize]->type == TYPE_MESH) {
+            meshesSize++;
+        }
+    }
+    size_t spheresSize = objsSize - planesSize - meshesSize;
+
+    scenePlanes* planes = &(scene->planes);
+    planes->count = planesSize;
+    planes->normalX = allocColumn(planesSize);
+    planes->normalY = allocColumn(planesSize);
+    planes->normalZ = allocColumn(planesSize);
+    planes->posX = allocColumn(planesSize);
+    planes->posY = allocColumn(planesSize);
+    planes->posZ = allocColumn(planesSize);
+    planes->objs = malloc(sizeof(*(planes->objs)) * (planesSize + 1));
+
+    sceneSpheres* spheres = &(scene->spheres);
+    spheres->count = spheresSize;
+    spheres->posX = allocColumn(spheresSize);
+    spheres->posY = allocColumn(spheresSize);
+    spheres->posZ = allocColumn(spheresSize);
+    spheres->radius = allocColumn(spheresSize);
+    spheres->radius2 = allocColumn(spheresSize);
+    spheres->objs = malloc(sizeof(*(spheres->objs)) * (spheresSize + 1));
+
+    sceneMeshes* meshes = &(scene->meshes);
+    meshes->count = meshesSize;
+    meshes->objs = malloc(sizeof(*(meshes->objs)) * (meshesSize + 1));
+
+    sceneObj** bounded = malloc(sizeof(*bounded) * (spheresSize + 1));
+    aabb* bounds = malloc(sizeof(*bounds) * (spheresSize + 1));
+    if(planes->objs == NULL || spheres->objs == NULL || meshes->objs == NULL ||
+            bounded == NULL || bounds == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t planeIndex = 0;
+    size_t meshIndex = 0;
+    size_t boundedIndex = 0;
+    for(size_t i = 0; i < objsSize; i++) {
+        if(objs[i]->type == TYPE_PLANE) {
+            planes->normalX[planeIndex] = objs[i]->plane.normal.x;
+            planes->normalY[planeIndex] = objs[i]->plane.normal.y;
+            planes->normalZ[planeIndex] = objs[i]->plane.normal.z;
+            planes->posX[planeIndex] = objs[i]->plane.pos.x;
+            planes->posY[planeIndex] = objs[i]->plane.pos.y;
+            planes->posZ[planeIndex] = objs[i]->plane.pos.z;
+            planes->objs[planeIndex++] = objs[i];
+        }
+        else if(objs[i]->type == TYPE_MESH) {
+            buildMesh(objs[i]->mesh.data);
+            meshes->objs[meshIndex++] = objs[i];
+        }
+        else {
+            bounds[boundedIndex] = getBounds(objs[i]);
+            bounded[boundedIndex++] = objs[i];
+        }
+    }
+
+    if(bvh_build(&(scene->bvh), bounds, spheresSize, 0) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Lay the spheres out in leaf order, so traversal reads them front to back
+    for(size_t i = 0; i < spheresSize; i++) {
+        sceneObj* obj = bounded[scene->bvh.prims[i]];
+        spheres->posX[i] = obj->sphere.pos.x;
+        spheres->posY[i] = obj->sphere.pos.y;
+        spheres->posZ[i] = obj->sphere.pos.z;
+        spheres->radius[i] = obj->sphere.radius;
+        spheres->radius2[i] = obj->sphere.radius * obj->sphere.radius;
+        spheres->objs[i] = obj;
+    }
+
+    free(bounded);
+    free(bounds);
+
+    return firstId + objsSize;
+}
+
+// Builds a BVH over the instances, by their bounds in scene space. Instances
+// of empty groups are left out.
+void layoutInstances(scene* scene, sceneInstance** instances) {
+    size_t count = 0;
+    for(size_t i = 0; instances[i] != NULL; i++) {
+        aabb bounds = instances[i]->group->bounds;
+        count += bounds.min.x <= bounds.max.x;
+    }
+
+    sceneInstance** placed = malloc(sizeof(*placed) * (count + 1));
+    aabb* bounds = malloc(sizeof(*bounds) * (count + 1));
+    scene->instances.instances = malloc(sizeof(*(scene->instances.instances)) *
+        (count + 1));
+    if(placed == NULL || bounds == NULL ||
+            scene->instances.instances == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t index = 0;
+    for(size_t i = 0; instances[i] != NULL; i++) {
+        sceneInstance* instance = instances[i];
+        aabb local = instance->group->bounds;
+        if(local.min.x > local.max.x) {
+            continue;
+        }
+        aabb box = {
+            vector3d_add(vector3d_scale(local.min, instance->scale),
+                instance->pos),
+            vector3d_add(vector3d_scale(local.max, instance->scale),
+                instance->pos)
+        };
+        bounds[index] = padBounds(box);
+        placed[index++] = instance;
+    }
+
+    if(bvh_build(&(scene->instances.bvh), bounds, count, 0) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    scene->instances.count = count;
+    for(size_t i = 0; i < count; i++) {
+        scene->instances.instances[i] = *(placed[scene->instances.bvh.prims[i]]);
+    }
+
+    free(placed);
+    free(bounds);
+}
+
+void classifyMaterial(sceneObj* obj) {
+    vector3d zeroVector = { 0 };
+    int material = 0;
+
+    if(vector3d_compare(obj->specular, zeroVector) != 0) {
+        material |= MATERIAL_SPECULAR;
+    }
+    if(obj->reflectivity > 0) {
+        material |= MATERIAL_REFLECTIVE;
+    }
+    if(obj->refractivity > 0) {
+        material |= MATERIAL_REFRACTIVE;
+    }
+    if(obj->ns >= 0 && obj->ns <= MAX_FAST_NS && obj->ns == floor(obj->ns)) {
+        material |= MATERIAL_FAST_NS;
+        obj->nsInt = obj->ns;
+    }
+    if(1 - obj->reflectivity - obj->refractivity == 0 ||
+            (!(material & MATERIAL_SPECULAR) &&
+            vector3d_compare(obj->diffuse, zeroVector) == 0)) {
+        material |= MATERIAL_UNLIT;
+    }
+
+    obj->material = material;
+}
+
+// The most any of the objects, or a previous 'response', gives back per
+// channel, diffuse plus specular, which bounds how far a light can reach
+real getResponse(sceneObj** objs, real response) {
+    for(size_t i = 0; objs[i] != NULL; i++) {
+        response = fmax(response, objs[i]->diffuse.x + objs[i]->specular.x);
+        response = fmax(response, objs[i]->diffuse.y + objs[i]->specular.y);
+        response = fmax(response, objs[i]->diffuse.z + objs[i]->specular.z);
+    }
+
+    return response;
+}
+
+// Sorts the lights into classes and precomputes what their shading kernels
+// would otherwise work out per sample
+sceneLights compileLights(sceneLight** lights, real response) {
+    sceneLights compiled = { 0 };
+
+    size_t count = 0;
+    for(; lights[count] != NULL; count++) {
+        lights[count]->type = getLightType(lights[count]);
+        switch(lights[count]->type) {
+            case(LIGHT_POINT):
+                compiled.pointCount++;
+                break;
+            case(LIGHT_SPOT):
+                compiled.spotCount++;
+                break;
+            default:
+                compiled.directionalCount++;
+                break;
+        }
+    }
+
+    compiled.lights = malloc(sizeof(*(compiled.lights)) * (count + 1));
+    if(compiled.lights == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t next[3] = { 0, compiled.pointCount,
+        compiled.pointCount + compiled.spotCount };
+    for(size_t i = 0; i < count; i++) {
+        sceneLight* light = lights[i];
+        compiledLight* target = &(compiled.lights[next[light->type]++]);
+
+        target->index = i;
+        target->pos = light->pos;
+        target->dir = light->dir;
+        target->color = light->color;
+        memcpy(target->radialAtten, light->radialAtten,
+            sizeof(target->radialAtten));
+        target->cosTheta = cos(light->theta * PI / 180.0);
+        target->angularAtten = light->angularAtten;
+        target->angularInt = -1;
+        if(light->angularAtten >= 0 && light->angularAtten <= MAX_FAST_NS &&
+                light->angularAtten == floor(light->angularAtten)) {
+            target->angularInt = light->angularAtten;
+        }
+        if(light->type == LIGHT_DIRECTIONAL) {
+            // Shading wants the direction towards the light
+            target->dir = vector3d_scale(light->dir, -1);
+        }
+        target->radius2 = getLightRadius2(target, light->type, response);
+    }
+
+    return compiled;
+}
+
+// Solves a2 * d^2 + a1 * d + a0 = peak / LIGHT_CUTOFF for the distance d,
+// where 'peak' bounds what the light gives a surface before radial falloff
+real getLightRadius2(const compiledLight* light, int type, real response) {
+    if(type == LIGHT_DIRECTIONAL) {
+        return INFINITY;
+    }
+
+    real peak = fmax(light->color.x, fmax(light->color.y, light->color.z)) *
+        response;
+    // The spot falloff is a power of the dot product of a unit vector with
+    // the light's position, so it can be no larger than this
+    if(type == LIGHT_SPOT) {
+        peak *= pow(vector3d_magnitude(light->pos), light->angularAtten);
+    }
+
+    real a0 = light->radialAtten[0];
+    real a1 = light->radialAtten[1];
+    real a2 = light->radialAtten[2];
+    real limit = peak / LIGHT_CUTOFF;
+    if(limit <= a0) {
+        return 0;
+    }
+
+    real radius;
+    if(a2 > 0) {
+        radius = (-a1 + sqrt(a1 * a1 + 4 * a2 * (limit - a0))) / (2 * a2);
+    }
+    else if(a1 > 0) {
+        radius = (limit - a0) / a1;
+    }
+    else {
+        return INFINITY;
+    }
+
+    return radius * radius;
+}
+
+int getLightType(const sceneLight* light) {
+    if(light->type == LIGHT_DIRECTIONAL) {
+        return LIGHT_DIRECTIONAL;
+    }
+    // Without an angle, a falloff or an axis, a spot light lights every
+    // direction the same
+    if(light->theta == 0 || light->angularAtten == 0 || (light->dir.x == 0 &&
+            light->dir.y == 0 && light->dir.z == 0)) {
+        return LIGHT_POINT;
+    }
+
+    return LIGHT_SPOT;
+}
+
+aabb getBounds(sceneObj* obj) {
+    switch(obj->type) {
+        case(TYPE_SPHERE): {
+            real radius = obj->sphere.radius;
+            vector3d pos = obj->sphere.pos;
+            real pad = BOUNDS_EPSILON * (fabs(pos.x) + fabs(pos.y) +
+                fabs(pos.z) + radius + 1);
+            vector3d extent = { radius + pad, radius + pad, radius + pad };
+            aabb box = { vector3d_sub(pos, extent), vector3d_add(pos, extent) };
+
+            return box;
+        }
+        default:
+            fprintf(stderr, "Error: Invalid obj type\n");
+            exit(EXIT_FAILURE);
+    }
+}
+
+// Builds the mesh's own BVH and moves its triangles into leaf order
+void buildMesh(sceneMesh* mesh) {
+    size_t count = mesh->triangleCount;
+    if(count == 0) {
+        return;
+    }
+
+    aabb* bounds = malloc(sizeof(*bounds) * (count + 1));
+    uint32_t* indices = malloc(sizeof(*indices) * (count * 3 + 1));
+    if(bounds == NULL || indices == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        aabb box = aabb_empty();
+        for(size_t corner = 0; corner < 3; corner++) {
+            const float* vertex = &(mesh->vertices[mesh->indices[i * 3 +
+                corner] * 3]);
+            vector3d point = { vertex[0], vertex[1], vertex[2] };
+            aabb pointBox = { point, point };
+            box = aabb_union(box, pointBox);
+        }
+        // Flat triangles still get boxes with some thickness
+        bounds[i] = padBounds(box);
+    }
+
+    // Triangles sharing a centroid, such as repeated faces, cannot be told
+    // apart by any plane, so they are split evenly into small leaves
+    bvh bvh;
+    if(bvh_build(&bvh, bounds, count, MESH_LEAF_MAX) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        memcpy(&(indices[i * 3]), &(mesh->indices[bvh.prims[i] * 3]),
+            sizeof(*indices) * 3);
+    }
+    free(mesh->indices);
+    mesh->indices = indices;
+
+    mesh->nodeCount = bvh.nodeCount;
+    mesh->nodes = malloc(sizeof(*(mesh->nodes)) * bvh.nodeCount);
+    if(mesh->nodes == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    for(size_t i = 0; i < bvh.nodeCount; i++) {
+        const bvhNode* node = &(bvh.nodes[i]);
+        meshNode* packed = &(mesh->nodes[i]);
+        real min[3] = { node->bounds.min.x, node->bounds.min.y,
+            node->bounds.min.z };
+        real max[3] = { node->bounds.max.x, node->bounds.max.y,
+            node->bounds.max.z };
+        for(size_t axis = 0; axis < 3; axis++) {
+            // Round outwards, so the float box still holds every triangle
+            packed->min[axis] = min[axis];
+            if(packed->min[axis] > min[axis]) {
+                packed->min[axis] = nextafterf(packed->min[axis], -INFINITY);
+            }
+            packed->max[axis] = max[axis];
+            if(packed->max[axis] < max[axis]) {
+                packed->max[axis] = nextafterf(packed->max[axis], INFINITY);
+            }
+        }
+        if(node->count > MESH_LEAF_COUNT_MAX) {
+            fprintf(stderr, "Error: Mesh BVH leaf holds %zu triangles, more "
+                "than the %u it can\n", node->count, MESH_LEAF_COUNT_MAX);
+            exit(EXIT_FAILURE);
+        }
+        packed->offset = node->offset;
+        packed->count = node->count;
+        packed->axis = node->axis;
+    }
+
+    bvh_free(&bvh);
+    free(bounds);
+}
+
+// Union of everything a ray can hit in the scene, apart from planes. Empty
+// if there is nothing.
+aabb getSceneBounds(const scene* scene) {
+    aabb box = aabb_empty();
+    if(scene->bvh.nodeCount > 0) {
+        box = aabb_union(box, scene->bvh.nodes[0].bounds);
+    }
+    for(size_t i = 0; i < scene->meshes.count; i++) {
+        const sceneMesh* mesh = scene->meshes.objs[i]->mesh.data;
+        if(mesh->nodeCount > 0) {
+            const meshNode* root = &(mesh->nodes[0]);
+            aabb rootBox = {
+                { root->min[0], root->min[1], root->min[2] },
+                { root->max[0], root->max[1], root->max[2] }
+            };
+            box = aabb_union(box, rootBox);
+        }
+    }
+
+    return box;
+}
+
+// Grows a box by the relative margin every primitive's bounds get
+aabb padBounds(aabb box) {
+    real pad = BOUNDS_EPSILON * (fabs(box.min.x) + fabs(box.min.y) +
+        fabs(box.min.z) + fabs(box.max.x) + fabs(box.max.y) +
+        fabs(box.max.z) + 1);
+    vector3d extent = { pad, pad, pad };
+    aabb padded = { vector3d_sub(box.min, extent),
+        vector3d_add(box.max, extent) };
+
+    return padded;
+}
+
+real* allocColumn(size_t count) {
+    // Always allocate at least one element so an empty column is not NULL
+    real* column = malloc(sizeof(*column) * (count + 1));
+    if(column == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return column;
+}
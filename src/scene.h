@@ -0,0 +1,234 @@
+#ifndef CS430_SCENE_H
+#define CS430_SCENE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bvh.h"
+#include "vector3d.h"
+
+#define TYPE_SPHERE 0
+#define TYPE_PLANE 1
+#define TYPE_MESH 2
+
+#define DEFAULT_NS 20
+// Largest whole 'ns' or spot falloff exponent raised by repeated
+// multiplication instead of pow()
+#define MAX_FAST_NS 64
+
+// Material flags, set by buildScene() so shading can skip terms a surface
+// does not use. A material with none of them is diffuse only.
+#define MATERIAL_SPECULAR 0x1
+#define MATERIAL_REFLECTIVE 0x2
+#define MATERIAL_REFRACTIVE 0x4
+// 'ns' is a whole number up to MAX_FAST_NS, kept in 'nsInt'
+#define MATERIAL_FAST_NS 0x8
+// Reflects and refracts everything, or has no color, so direct light adds
+// nothing and needs no shadow rays
+#define MATERIAL_UNLIT 0x10
+
+// Contribution below which a light is treated as not reaching a point, half
+// of one 8-bit step
+#define LIGHT_CUTOFF (1.0 / 512)
+
+// Light classes, each shaded by its own kernel
+#define LIGHT_POINT 0
+#define LIGHT_SPOT 1
+#define LIGHT_DIRECTIONAL 2
+
+// Largest number of triangles a mesh BVH leaf can hold
+#define MESH_LEAF_COUNT_MAX ((1u << 30) - 1)
+
+// Meshes can be far larger than the rest of a scene, so their BVH nodes are
+// packed into 32 bytes: float bounds, rounded outwards, and 32-bit offsets
+typedef struct meshNode {
+    float min[3];
+    float max[3];
+    // For leaves, the first triangle. For interior nodes, the index of the
+    // right child (the left child always directly follows).
+    uint32_t offset;
+    // Number of triangles in a leaf, 0 for interior nodes
+    uint32_t count : 30;
+    // Split axis of an interior node
+    uint32_t axis : 2;
+} meshNode;
+
+// Indexed triangle mesh loaded from an OBJ file. Triangles share one vertex
+// buffer and are stored in the order of the mesh's own BVH, so a leaf covers
+// the triangles [offset, offset + count).
+typedef struct sceneMesh {
+    size_t vertexCount;
+    // x, y and z of each vertex
+    float* vertices;
+    size_t triangleCount;
+    // Three vertex indices per triangle
+    uint32_t* indices;
+    meshNode* nodes;
+    size_t nodeCount;
+} sceneMesh;
+
+typedef struct sceneObj {
+    int type;
+    // Position in the scene file, used to break ties between equally
+    // distant hits the same way a front-to-back scan of 'objs' would
+    size_t id;
+    vector3d diffuse;
+    vector3d specular;
+    float reflectivity;
+    float refractivity;
+    float ior;
+    real ns;
+    int material;
+    unsigned nsInt;
+    union {
+        struct {
+            vector3d pos;
+            real radius;
+        } sphere;
+        struct {
+            vector3d pos;
+            vector3d normal;
+        } plane;
+        struct {
+            vector3d pos;
+            real radius;
+            real height;
+        } cylinder;
+        struct {
+            sceneMesh* data;
+        } mesh;
+    };
+} sceneObj;
+
+typedef struct sceneLight {
+    // LIGHT_DIRECTIONAL for lights given a direction but no position; the
+    // rest are sorted into point and spot lights by buildScene()
+    int type;
+    vector3d pos;
+    vector3d dir;
+    real theta;
+    vector3d color;
+    real radialAtten[3];
+    real angularAtten;
+} sceneLight;
+
+// A light with everything that does not depend on the hit worked out ahead
+// of shading
+typedef struct compiledLight {
+    // Position in the scene's light list, which shadow caches are keyed by
+    size_t index;
+    vector3d pos;
+    // Spot axis, or for directional lights the direction towards the light
+    vector3d dir;
+    vector3d color;
+    real radialAtten[3];
+    // Cosine of the spot angle, compared against directly
+    real cosTheta;
+    real angularAtten;
+    // 'angularAtten' when it is a whole number up to MAX_FAST_NS, or -1 when
+    // spot falloff needs pow()
+    int angularInt;
+    // Squared distance past which the light adds less than LIGHT_CUTOFF to
+    // any surface in the scene (INFINITY if it never falls that low)
+    real radius2;
+} compiledLight;
+
+// Lights grouped by class: point lights first, then spot lights, then
+// directional lights
+typedef struct sceneLights {
+    compiledLight* lights;
+    size_t pointCount;
+    size_t spotCount;
+    size_t directionalCount;
+} sceneLights;
+
+typedef struct camera {
+    float width;
+    float height;
+} camera;
+
+// Spheres in structure-of-arrays form, stored in BVH leaf order so a leaf
+// covers the contiguous range [offset, offset + count)
+typedef struct sceneSpheres {
+    size_t count;
+    real* posX;
+    real* posY;
+    real* posZ;
+    real* radius;
+    // radius * radius, so kernels don't need to square it per ray
+    real* radius2;
+    // Material and identity of each sphere
+    sceneObj** objs;
+} sceneSpheres;
+
+// Planes in structure-of-arrays form. Planes are unbounded, so they are kept
+// out of the BVH and always tested.
+typedef struct scenePlanes {
+    size_t count;
+    real* normalX;
+    real* normalY;
+    real* normalZ;
+    real* posX;
+    real* posY;
+    real* posZ;
+    sceneObj** objs;
+} scenePlanes;
+
+// Meshes are kept out of the sphere BVH. Each is tested in turn through its
+// own hierarchy.
+typedef struct sceneMeshes {
+    size_t count;
+    sceneObj** objs;
+} sceneMeshes;
+
+struct scene;
+
+// Spheres and meshes defined once under a name, and placed in the scene any
+// number of times by instances. Members are traced in the group's own space,
+// so copies cost no more memory than the instances themselves.
+typedef struct sceneGroup {
+    char* name;
+    // NULL-terminated
+    sceneObj** objs;
+    // The members laid out for tracing, with no planes, lights or instances
+    struct scene* scene;
+    // Bounds of every member, in the group's space
+    aabb bounds;
+} sceneGroup;
+
+// A copy of a group, scaled by 'scale' and then moved to 'pos'
+typedef struct sceneInstance {
+    sceneGroup* group;
+    vector3d pos;
+    real scale;
+} sceneInstance;
+
+// Instances in BVH leaf order, so a leaf covers the contiguous range
+// [offset, offset + count)
+typedef struct sceneInstances {
+    size_t count;
+    sceneInstance* instances;
+    bvh bvh;
+} sceneInstances;
+
+typedef struct scene {
+    // NULL-terminated lists as read from the scene file
+    sceneObj** objs;
+    sceneLight** lights;
+    sceneGroup** groups;
+    scenePlanes planes;
+    sceneSpheres spheres;
+    sceneMeshes meshes;
+    sceneInstances instances;
+    sceneLights compiledLights;
+    // Hierarchy over the spheres
+    bvh bvh;
+} scene;
+
+// Normalizes plane normals and light directions in place, classifies
+// materials, then lays the objects and every group out for tracing and
+// compiles the lights. 'instances' is NULL-terminated.
+scene buildScene(sceneObj** objs, sceneLight** lights, sceneGroup** groups,
+    sceneInstance** instances);
+
+#endif // CS430_SCENE_H
@@ -0,0 +1,334 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "threadpool.h"
+
+// Every worker owns a deque of task indices. Since all tasks are known up
+// front, the deque is just the contiguous range [head, tail). The owner pops
+// from the head (keeping neighbouring tiles together for the cache), while
+// idle workers steal from the tail of someone else's range.
+typedef struct taskQueue {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+} taskQueue;
+
+typedef struct poolState {
+    taskQueue* queues;
+    size_t threads;
+    taskFunc func;
+    void* arg;
+} poolState;
+
+typedef struct workerArg {
+    poolState* pool;
+    size_t worker;
+} workerArg;
+
+// Ordered runs hand tasks out from one shared counter instead, since a task
+// can only start once its group fits in the window. Each window slot counts
+// the tasks its group is still waiting on.
+typedef struct orderedState {
+    pthread_mutex_t lock;
+    pthread_cond_t moved;
+    size_t taskCount;
+    size_t groupCount;
+    size_t groupSize;
+    size_t window;
+    size_t nextTask;
+    size_t retired;
+    int retiring;
+    size_t* remaining;
+    taskFunc func;
+    retireFunc retire;
+    void* arg;
+} orderedState;
+
+typedef struct orderedArg {
+    orderedState* state;
+    size_t worker;
+} orderedArg;
+
+int popTask(taskQueue* queue, size_t* task);
+int stealTask(taskQueue* queue, size_t* task);
+void* workerMain(void* arg);
+void* orderedMain(void* arg);
+size_t groupTasks(const orderedState* state, size_t group);
+
+size_t threadpool_cores() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long cores = info.dwNumberOfProcessors;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(cores < 1) {
+        return 1;
+    }
+
+    return cores;
+}
+
+double threadpool_now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+int threadpool_run(size_t threads, size_t taskCount, taskFunc func, void* arg) {
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(threads > taskCount) {
+        threads = taskCount > 0 ? taskCount : 1;
+    }
+
+    poolState pool = { NULL, threads, func, arg };
+
+    if((pool.queues = malloc(sizeof(*pool.queues) * threads)) == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return -1;
+    }
+
+    pthread_t* handles = malloc(sizeof(*handles) * threads);
+    workerArg* args = malloc(sizeof(*args) * threads);
+    if(handles == NULL || args == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        free(pool.queues);
+        free(handles);
+        free(args);
+        return -1;
+    }
+
+    // Deal the tasks out as evenly sized contiguous blocks
+    for(size_t i = 0; i < threads; i++) {
+        pthread_mutex_init(&(pool.queues[i].lock), NULL);
+        pool.queues[i].head = taskCount * i / threads;
+        pool.queues[i].tail = taskCount * (i + 1) / threads;
+        args[i].pool = &pool;
+        args[i].worker = i;
+    }
+
+    int status = 0;
+    size_t started = 1;
+    // The calling thread acts as worker 0, so only spawn the rest
+    for(; started < threads; started++) {
+        if(pthread_create(&(handles[started]), NULL, workerMain,
+                &(args[started])) != 0) {
+            fprintf(stderr, "Error: Could not create worker thread\n");
+            status = -1;
+            break;
+        }
+    }
+
+    // Even if some threads failed to spawn, the remaining workers steal
+    // their tasks, so the job still completes.
+    workerMain(&(args[0]));
+
+    for(size_t i = 1; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+
+    for(size_t i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&(pool.queues[i].lock));
+    }
+
+    free(pool.queues);
+    free(handles);
+    free(args);
+
+    return status;
+}
+
+int threadpool_runOrdered(size_t threads, size_t groupCount, size_t groupSize,
+        size_t window, taskFunc func, retireFunc retire, void* arg) {
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(window < 1) {
+        window = 1;
+    }
+
+    orderedState state;
+    state.taskCount = groupCount * groupSize;
+    state.groupCount = groupCount;
+    state.groupSize = groupSize;
+    state.window = window;
+    state.nextTask = 0;
+    state.retired = 0;
+    state.retiring = 0;
+    state.func = func;
+    state.retire = retire;
+    state.arg = arg;
+    if(threads > state.taskCount) {
+        threads = state.taskCount > 0 ? state.taskCount : 1;
+    }
+
+    state.remaining = malloc(sizeof(*state.remaining) * window);
+    pthread_t* handles = malloc(sizeof(*handles) * threads);
+    orderedArg* args = malloc(sizeof(*args) * threads);
+    if(state.remaining == NULL || handles == NULL || args == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        free(state.remaining);
+        free(handles);
+        free(args);
+        return -1;
+    }
+    for(size_t i = 0; i < window; i++) {
+        state.remaining[i] = groupTasks(&state, i);
+    }
+    pthread_mutex_init(&(state.lock), NULL);
+    pthread_cond_init(&(state.moved), NULL);
+
+    int status = 0;
+    size_t started = 1;
+    for(size_t i = 0; i < threads; i++) {
+        args[i].state = &state;
+        args[i].worker = i;
+    }
+    for(; started < threads; started++) {
+        if(pthread_create(&(handles[started]), NULL, orderedMain,
+                &(args[started])) != 0) {
+            fprintf(stderr, "Error: Could not create worker thread\n");
+            status = -1;
+            break;
+        }
+    }
+
+    // As with threadpool_run(), the calling thread is worker 0 and finishes
+    // the job alone if no other thread could be started
+    orderedMain(&(args[0]));
+
+    for(size_t i = 1; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+
+    pthread_cond_destroy(&(state.moved));
+    pthread_mutex_destroy(&(state.lock));
+    free(state.remaining);
+    free(handles);
+    free(args);
+
+    return status;
+}
+
+int popTask(taskQueue* queue, size_t* task) {
+    int found = 0;
+
+    pthread_mutex_lock(&(queue->lock));
+    if(queue->head < queue->tail) {
+        *task = queue->head++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return found;
+}
+
+int stealTask(taskQueue* queue, size_t* task) {
+    int found = 0;
+
+    pthread_mutex_lock(&(queue->lock));
+    if(queue->head < queue->tail) {
+        *task = --queue->tail;
+        found = 1;
+    }
+    pthread_mutex_unlock(&(queue->lock));
+
+    return found;
+}
+
+void* workerMain(void* arg) {
+    workerArg* self = arg;
+    poolState* pool = self->pool;
+    size_t task;
+
+    for(;;) {
+        if(popTask(&(pool->queues[self->worker]), &task)) {
+            pool->func(task, self->worker, pool->arg);
+            continue;
+        }
+
+        // Own queue is drained, so try every other worker once before
+        // giving up. No new tasks are ever queued, so empty means done.
+        int stolen = 0;
+        for(size_t i = 1; i < pool->threads && !stolen; i++) {
+            size_t victim = (self->worker + i) % pool->threads;
+            stolen = stealTask(&(pool->queues[victim]), &task);
+        }
+        if(!stolen) {
+            break;
+        }
+
+        pool->func(task, self->worker, pool->arg);
+    }
+
+    return NULL;
+}
+
+void* orderedMain(void* arg) {
+    orderedArg* self = arg;
+    orderedState* state = self->state;
+
+    pthread_mutex_lock(&(state->lock));
+    while(state->nextTask < state->taskCount) {
+        size_t task = state->nextTask;
+        size_t group = task / state->groupSize;
+        if(group >= state->retired + state->window) {
+            // The window is full until the oldest group is retired
+            pthread_cond_wait(&(state->moved), &(state->lock));
+            continue;
+        }
+        state->nextTask++;
+
+        pthread_mutex_unlock(&(state->lock));
+        state->func(task, self->worker, state->arg);
+        pthread_mutex_lock(&(state->lock));
+
+        state->remaining[group % state->window]--;
+        if(state->retiring) {
+            // Whoever is retiring picks this group up when it gets to it
+            continue;
+        }
+
+        // Retire every finished group at the front of the window. The lock
+        // is dropped around the callback so other workers keep going.
+        state->retiring = 1;
+        while(state->retired < state->groupCount &&
+                state->remaining[state->retired % state->window] == 0) {
+            size_t done = state->retired;
+            pthread_mutex_unlock(&(state->lock));
+            state->retire(done, state->arg);
+            pthread_mutex_lock(&(state->lock));
+
+            state->remaining[done % state->window] = groupTasks(state,
+                done + state->window);
+            state->retired++;
+            pthread_cond_broadcast(&(state->moved));
+        }
+        state->retiring = 0;
+    }
+    pthread_mutex_unlock(&(state->lock));
+
+    return NULL;
+}
+
+size_t groupTasks(const orderedState* state, size_t group) {
+    if(group >= state->groupCount) {
+        return 0;
+    }
+
+    return state->groupSize;
+}
@@ -0,0 +1,24 @@
+#ifndef CS430_THREADPOOL_H
+#define CS430_THREADPOOL_H
+
+#include <stddef.h>
+
+// Called once for every task index in [0, taskCount). 'worker' is the index
+// (0 to threads - 1) of the thread running the task, so callers can keep
+// per-thread state without locking.
+typedef void (*taskFunc)(size_t task, size_t worker, void* arg);
+// Called once a group of tasks and every group before it are done
+typedef void (*retireFunc)(size_t group, void* arg);
+
+size_t threadpool_cores();
+// Seconds on a monotonic clock, for timing work against another reading
+double threadpool_now();
+int threadpool_run(size_t threads, size_t taskCount, taskFunc func, void* arg);
+// Runs 'groupCount' groups of 'groupSize' tasks in order, with at most
+// 'window' groups started but not yet retired. Groups are retired one at a
+// time in order, by whichever worker finished the last task they were
+// waiting on.
+int threadpool_runOrdered(size_t threads, size_t groupCount, size_t groupSize,
+    size_t window, taskFunc func, retireFunc retire, void* arg);
+
+#endif // CS430_THREADPOOL_H
@@ -0,0 +1,6 @@
+#include "vector3d.h"
+
+#ifdef CS430_COUNT_MATH
+atomic_size_t vector3d_normalizeCount;
+atomic_size_t vector3d_sqrtCount;
+#endif
@@ -3,10 +3,45 @@
 
 #include <math.h>
 
+// Precision used for geometry and shading. Building with
+// -DCS430_SINGLE_PRECISION (see 'make single') renders with float vectors;
+// <tgmath.h> then routes sqrt(), pow() and friends to their float versions.
+#ifdef CS430_SINGLE_PRECISION
+#include <tgmath.h>
+
+typedef float real;
+
+// Rays ignore hits closer than this, so a secondary or shadow ray never
+// finds the surface it leaves from. A float hit point can also land a
+// little on the wrong side of a neighbouring surface, hence the wide margin.
+#define RAY_EPSILON 1e-4f
+#else
+typedef double real;
+
+// Rays ignore hits closer than this, so a secondary or shadow ray never
+// finds the surface it leaves from
+#define RAY_EPSILON 1e-6
+#endif
+
+// Building with -DCS430_COUNT_MATH (see 'make mathcount') counts every
+// normalization and square root taken through these helpers, to measure how
+// much work shading repeats. The counters are shared by all threads.
+#ifdef CS430_COUNT_MATH
+#include <stdatomic.h>
+
+extern atomic_size_t vector3d_normalizeCount;
+extern atomic_size_t vector3d_sqrtCount;
+
+#define VECTOR3D_COUNT(counter) \
+    atomic_fetch_add_explicit(&(counter), 1, memory_order_relaxed)
+#else
+#define VECTOR3D_COUNT(counter)
+#endif
+
 typedef struct vector3d {
-    double x;
-    double y;
-    double z;
+    real x;
+    real y;
+    real z;
 } vector3d;
 
 static inline vector3d vector3d_add(vector3d first, vector3d second) {
@@ -19,12 +54,12 @@ static inline vector3d vector3d_sub(vector3d first, vector3d second) {
     return result;
 }
 
-static inline vector3d vector3d_scale(vector3d vector, double scaler) {
+static inline vector3d vector3d_scale(vector3d vector, real scaler) {
     vector3d result = { vector.x * scaler, vector.y * scaler, vector.z * scaler };
     return result;
 }
 
-static inline double vector3d_dot(vector3d first, vector3d second) {
+static inline real vector3d_dot(vector3d first, vector3d second) {
     return first.x * second.x + first.y * second.y + first.z * second.z;
 }
 
@@ -47,7 +82,8 @@ static inline vector3d vector3d_cross(vector3d first, vector3d second) {
     return result;
 }
 
-static inline double vector3d_magnitude(vector3d vector) {
+static inline real vector3d_magnitude(vector3d vector) {
+    VECTOR3D_COUNT(vector3d_sqrtCount);
     return sqrt(vector.x * vector.x + vector.y * vector.y + vector.z * vector.z);
 }
 
@@ -58,8 +94,8 @@ static inline vector3d vector3d_zero() {
 }
 
 static inline int vector3d_compare(vector3d first, vector3d second) {
-    double firstMag = vector3d_magnitude(first);
-    double secondMag = vector3d_magnitude(second);
+    real firstMag = vector3d_magnitude(first);
+    real secondMag = vector3d_magnitude(second);
     if(firstMag < secondMag) {
         return -1;
     }
@@ -72,7 +108,8 @@ static inline int vector3d_compare(vector3d first, vector3d second) {
 }
 
 static inline vector3d vector3d_normalize(vector3d vector) {
-    double length = vector3d_magnitude(vector);
+    VECTOR3D_COUNT(vector3d_normalizeCount);
+    real length = vector3d_magnitude(vector);
     vector3d normal = {
         vector.x / length,
         vector.y / length,
@@ -82,7 +119,8 @@ static inline vector3d vector3d_normalize(vector3d vector) {
     return normal;
 }
 
-static inline double vector3d_distance(vector3d first, vector3d second) {
+static inline real vector3d_distance(vector3d first, vector3d second) {
+    VECTOR3D_COUNT(vector3d_sqrtCount);
     return sqrt(pow(first.x - second.x, 2) + pow(first.y - second.y, 2) +
         pow(first.z - second.z, 2));
 }
@@ -1,8 +1,89 @@
 #define __USE_MINGW_ANSI_STDIO 1
+#define _POSIX_C_SOURCE 200809L
 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "threadpool.h"
 #include "write.h"
 
+// Pixels packed per fwrite() when 'pixel' is not exactly three bytes
+#define WRITE_BLOCK_PIXELS 65536
+// Longest P3 pixel: "255 255 255" and the three spaces after it
+#define ASCII_PIXEL_MAX 14
+// Rough amount of text each task formats before it is written
+#define ASCII_TASK_BYTES (1 << 18)
+
+// Every channel value as P3 text, so a pixel is formatted with three copies
+// instead of three trips through printf()
+static const char decimals[256][4] = {
+    "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "10", "11", "12", "13",
+    "14", "15", "16", "17", "18", "19", "20", "21", "22", "23", "24", "25",
+    "26", "27", "28", "29", "30", "31", "32", "33", "34", "35", "36", "37",
+    "38", "39", "40", "41", "42", "43", "44", "45", "46", "47", "48", "49",
+    "50", "51", "52", "53", "54", "55", "56", "57", "58", "59", "60", "61",
+    "62", "63", "64", "65", "66", "67", "68", "69", "70", "71", "72", "73",
+    "74", "75", "76", "77", "78", "79", "80", "81", "82", "83", "84", "85",
+    "86", "87", "88", "89", "90", "91", "92", "93", "94", "95", "96", "97",
+    "98", "99", "100", "101", "102", "103", "104", "105", "106", "107", "108",
+    "109", "110", "111", "112", "113", "114", "115", "116", "117", "118", "119",
+    "120", "121", "122", "123", "124", "125", "126", "127", "128", "129", "130",
+    "131", "132", "133", "134", "135", "136", "137", "138", "139", "140", "141",
+    "142", "143", "144", "145", "146", "147", "148", "149", "150", "151", "152",
+    "153", "154", "155", "156", "157", "158", "159", "160", "161", "162", "163",
+    "164", "165", "166", "167", "168", "169", "170", "171", "172", "173", "174",
+    "175", "176", "177", "178", "179", "180", "181", "182", "183", "184", "185",
+    "186", "187", "188", "189", "190", "191", "192", "193", "194", "195", "196",
+    "197", "198", "199", "200", "201", "202", "203", "204", "205", "206", "207",
+    "208", "209", "210", "211", "212", "213", "214", "215", "216", "217", "218",
+    "219", "220", "221", "222", "223", "224", "225", "226", "227", "228", "229",
+    "230", "231", "232", "233", "234", "235", "236", "237", "238", "239", "240",
+    "241", "242", "243", "244", "245", "246", "247", "248", "249", "250", "251",
+    "252", "253", "254", "255"
+};
+
+// P3 rows being formatted in parallel. Each task formats into slice
+// 'task % window' of 'buffer', which is written out when the task retires.
+typedef struct asciiJob {
+    const pixel* pixels;
+    size_t width;
+    size_t rowCount;
+    size_t rowsPerTask;
+    size_t taskBytes;
+    size_t window;
+    char* buffer;
+    size_t* lengths;
+    FILE* outputFd;
+    int status;
+} asciiJob;
+
+int writeRaw(const pixel* pixels, size_t count, FILE* outputFd);
+int writeAscii(const pixel* pixels, size_t width, size_t height,
+    FILE* outputFd, size_t threads);
+void formatAsciiTask(size_t task, size_t worker, void* arg);
+void retireAsciiTask(size_t task, void* arg);
+size_t formatAsciiRow(const pixel* row, size_t width, char* text);
+char* appendDecimal(char* text, unsigned char value);
+
 int writeHeader(pnmHeader header, FILE* outputFd) {
+    char buffer[PNM_HEADER_MAX];
+    int length = formatHeader(header, buffer, sizeof(buffer));
+    if(length < 0) {
+        return -1;
+    }
+
+    if(fwrite(buffer, 1, length, outputFd) != (size_t)length) {
+        fprintf(stderr, "Error: Cannot write image header\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int formatHeader(pnmHeader header, char* buffer, size_t size) {
     if(header.mode < 1 || header.mode > 7) {
         fprintf(stderr, "Error: Mode P%d not valid\n", header.mode);
         return -1;
@@ -24,20 +105,57 @@ int writeHeader(pnmHeader header, FILE* outputFd) {
         return -1;
     }
 
-    fprintf(outputFd, "P%d\n", header.mode);
+    int length = snprintf(buffer, size, "P%d\n"
+        "# Created with raycast (Christopher Philabaum <cp723@nau.edu>)\n"
+        "%zu %zu\n", header.mode, header.width, header.height);
+    // If not P1 or P4, then write maxColorSize
+    if(header.mode % 3 != 1 && length >= 0 && (size_t)length < size) {
+        length += snprintf(buffer + length, size - length, "%zu\n",
+            header.maxColorSize);
+    }
+    if(length < 0 || (size_t)length >= size) {
+        fprintf(stderr, "Error: Image header too long\n");
+        return -1;
+    }
 
-    fprintf(outputFd, "# Created with raycast (Christopher Philabaum <cp723@nau.edu>)\n");
+    return length;
+}
 
-    fprintf(outputFd, "%zu %zu\n", header.width, header.height);
-    // If not P1 or P4, then write maxColorSize
-    if(header.mode % 3 != 1) {
-        fprintf(outputFd, "%zu\n", header.maxColorSize);
+size_t bodySizeMax(pnmHeader header) {
+    if(header.mode == 3) {
+        return header.height * (header.width * ASCII_PIXEL_MAX + 1);
     }
 
-    return 0;
+    return header.width * header.height * 3;
 }
 
-int writeBody(pnmHeader header, pixel* pixels, FILE* outputFd) {
+size_t formatBody(pnmHeader header, const pixel* pixels, char* buffer) {
+    size_t count = header.width * header.height;
+    if(header.mode == 6) {
+        if(sizeof(*pixels) == 3) {
+            memcpy(buffer, pixels, count * 3);
+        }
+        else {
+            for(size_t i = 0; i < count; i++) {
+                buffer[i * 3] = pixels[i].red;
+                buffer[i * 3 + 1] = pixels[i].green;
+                buffer[i * 3 + 2] = pixels[i].blue;
+            }
+        }
+        return count * 3;
+    }
+
+    size_t length = 0;
+    for(size_t y = 0; y < header.height; y++) {
+        length += formatAsciiRow(&(pixels[y * header.width]), header.width,
+            buffer + length);
+    }
+
+    return length;
+}
+
+int writeBody(pnmHeader header, const pixel* pixels, FILE* outputFd,
+        size_t threads) {
     if(header.mode < 1 || header.mode > 7) {
         fprintf(stderr, "Error: Mode P%d not valid\n", header.mode);
         return -1;
@@ -57,37 +175,14 @@ int writeBody(pnmHeader header, pixel* pixels, FILE* outputFd) {
 
     // If P4 - P7, set write mode as binary.
     if(header.mode == 6) {
-        // Loop through the image buffer like a grid, individually writing red,
-        // green, and blue explicitly to avoid endianness errors (wrong byte order)
-        for(size_t y = 0; y < header.height; y++) {
-            for(size_t x = 0; x < header.width; x++) {
-                fwrite(&(pixels[y * header.width + x].red), 1, 1, outputFd);
-                fwrite(&(pixels[y * header.width + x].green), 1, 1, outputFd);
-                fwrite(&(pixels[y * header.width + x].blue), 1, 1, outputFd);
-            }
+        if(writeRaw(pixels, header.width * header.height, outputFd) < 0) {
+            return -1;
         }
     }
     else if(header.mode == 3) {
-        for(size_t y = 0; y < header.height; y++) {
-            for(size_t x = 0; x < header.width; x++) {
-                // Write the channels as unsigned decimal values and space them
-                // with single spaces
-                fprintf(outputFd, "%u", pixels[y * header.width + x].red);
-                fprintf(outputFd, " %u", pixels[y * header.width + x].green);
-                fprintf(outputFd, " %u", pixels[y * header.width + x].blue);
-
-                // For the end of every 5 pixels, end the line with a newline
-                // to avoid lines >70 characters (based on the ppm documentation)
-                if(x % 5 == 4) {
-                    fprintf(outputFd, "\n");
-                }
-                // Otherwise, space inebtween each pixel 3 spaces
-                else {
-                    fprintf(outputFd, "   ");
-                }
-            }
-
-            fprintf(outputFd, "\n");
+        if(writeAscii(pixels, header.width, header.height, outputFd,
+                threads) < 0) {
+            return -1;
         }
     }
     else {
@@ -97,3 +192,205 @@ int writeBody(pnmHeader header, pixel* pixels, FILE* outputFd) {
 
     return 0;
 }
+
+// Writes the P6 body in as few calls as possible. 'pixel' is three unsigned
+// chars in red, green, blue order, so when the compiler adds no padding the
+// framebuffer already is the body and goes out in one fwrite(), which stdio
+// hands straight to the kernel without copying it into its own buffer.
+int writeRaw(const pixel* pixels, size_t count, FILE* outputFd) {
+    if(sizeof(*pixels) == 3) {
+        if(fwrite(pixels, 3, count, outputFd) != count) {
+            fprintf(stderr, "Error: Cannot write image body\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    unsigned char* block = malloc(3 * WRITE_BLOCK_PIXELS);
+    if(block == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        return -1;
+    }
+    for(size_t start = 0; start < count; start += WRITE_BLOCK_PIXELS) {
+        size_t blockCount = count - start < WRITE_BLOCK_PIXELS ?
+            count - start : WRITE_BLOCK_PIXELS;
+        for(size_t i = 0; i < blockCount; i++) {
+            block[i * 3] = pixels[start + i].red;
+            block[i * 3 + 1] = pixels[start + i].green;
+            block[i * 3 + 2] = pixels[start + i].blue;
+        }
+        if(fwrite(block, 3, blockCount, outputFd) != blockCount) {
+            fprintf(stderr, "Error: Cannot write image body\n");
+            free(block);
+            return -1;
+        }
+    }
+    free(block);
+
+    return 0;
+}
+
+// Writes the P3 body with each channel as an unsigned decimal, channels
+// separated by single spaces and pixels by three, five pixels to a line (to
+// keep lines under 70 characters, per the PPM documentation) and each row
+// ending its last line. Runs of rows are formatted on 'threads' workers and
+// written in order as they finish.
+int writeAscii(const pixel* pixels, size_t width, size_t height,
+        FILE* outputFd, size_t threads) {
+    size_t rowBytes = width * ASCII_PIXEL_MAX + 1;
+    if(threads == 0) {
+        threads = threadpool_cores();
+    }
+    asciiJob job = { pixels, width, height, ASCII_TASK_BYTES / rowBytes, 0, 0,
+        NULL, NULL, outputFd, 0 };
+    if(job.rowsPerTask == 0) {
+        job.rowsPerTask = 1;
+    }
+    job.taskBytes = job.rowsPerTask * rowBytes;
+
+    size_t tasks = (height + job.rowsPerTask - 1) / job.rowsPerTask;
+    if(tasks == 0) {
+        return 0;
+    }
+    // Room for a slow task to finish while every worker keeps formatting
+    job.window = tasks < threads * 2 ? tasks : threads * 2;
+    job.buffer = malloc(job.taskBytes * job.window);
+    job.lengths = malloc(sizeof(*job.lengths) * job.window);
+    if(job.buffer == NULL || job.lengths == NULL) {
+        fprintf(stderr, "Error: Memory allocation error\n");
+        free(job.buffer);
+        free(job.lengths);
+        return -1;
+    }
+
+    if(threadpool_runOrdered(threads, tasks, 1, job.window, formatAsciiTask,
+            retireAsciiTask, &job) < 0) {
+        job.status = -1;
+    }
+
+    free(job.buffer);
+    free(job.lengths);
+
+    return job.status;
+}
+
+void formatAsciiTask(size_t task, size_t worker, void* arg) {
+    (void)worker;
+    asciiJob* job = arg;
+    size_t start = task * job->rowsPerTask;
+    size_t end = start + job->rowsPerTask;
+    if(end > job->rowCount) {
+        end = job->rowCount;
+    }
+
+    size_t slot = task % job->window;
+    char* text = job->buffer + slot * job->taskBytes;
+    size_t length = 0;
+    for(size_t y = start; y < end; y++) {
+        length += formatAsciiRow(&(job->pixels[y * job->width]), job->width,
+            text + length);
+    }
+    job->lengths[slot] = length;
+}
+
+// Writes a formatted task out. After a failed write the rest are dropped.
+void retireAsciiTask(size_t task, void* arg) {
+    asciiJob* job = arg;
+    size_t slot = task % job->window;
+    if(job->status < 0) {
+        return;
+    }
+    if(fwrite(job->buffer + slot * job->taskBytes, 1, job->lengths[slot],
+            job->outputFd) != job->lengths[slot]) {
+        fprintf(stderr, "Error: Cannot write image body\n");
+        job->status = -1;
+    }
+}
+
+size_t formatAsciiRow(const pixel* row, size_t width, char* text) {
+    char* start = text;
+
+    for(size_t x = 0; x < width; x++) {
+        text = appendDecimal(text, row[x].red);
+        *text++ = ' ';
+        text = appendDecimal(text, row[x].green);
+        *text++ = ' ';
+        text = appendDecimal(text, row[x].blue);
+
+        // For the end of every 5 pixels, end the line with a newline
+        if(x % 5 == 4) {
+            *text++ = '\n';
+        }
+        else {
+            memcpy(text, "   ", 3);
+            text += 3;
+        }
+    }
+    *text++ = '\n';
+
+    return text - start;
+}
+
+// Copies all four bytes of the entry and steps past only its digits. The
+// byte after them is always overwritten by the separator that follows.
+char* appendDecimal(char* text, unsigned char value) {
+    memcpy(text, decimals[value], 4);
+
+    return text + 1 + (value >= 10) + (value >= 100);
+}
+
+int mapImage(const char* path, pnmHeader header, pnmMap* map) {
+    if(header.mode != 6 || header.maxColorSize > 255 || sizeof(pixel) != 3) {
+        fprintf(stderr, "Error: Only P6 images with 1-byte colors can be "
+            "mapped\n");
+        return -1;
+    }
+
+    char buffer[PNM_HEADER_MAX];
+    int length = formatHeader(header, buffer, sizeof(buffer));
+    if(length < 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        perror("Error: Cannot open output file");
+        return -1;
+    }
+
+    map->size = length + 3 * header.width * header.height;
+    // Sizing the file up front leaves a hole the body is rendered into
+    if(ftruncate(fd, map->size) != 0) {
+        perror("Error: Cannot size output file");
+        close(fd);
+        return -1;
+    }
+    map->base = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+        0);
+    close(fd);
+    if(map->base == MAP_FAILED) {
+        perror("Error: Cannot map output file");
+        return -1;
+    }
+
+    memcpy(map->base, buffer, length);
+    map->pixels = (pixel*)((unsigned char*)map->base + length);
+
+    return 0;
+}
+
+// Writes the image back before unmapping it. A full disk or an I/O error only
+// shows up once the pages are written, which munmap() alone never reports.
+int unmapImage(pnmMap* map) {
+    int status = 0;
+    if(msync(map->base, map->size, MS_SYNC) != 0) {
+        perror("Error: Cannot write output file");
+        status = -1;
+    }
+    if(munmap(map->base, map->size) != 0 && status == 0) {
+        perror("Error: Cannot write output file");
+        status = -1;
+    }
+
+    return status;
+}
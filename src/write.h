@@ -5,7 +5,33 @@
 
 #include "pnm.h"
 
+// Longest header formatHeader() writes, with room for 64-bit sizes
+#define PNM_HEADER_MAX 128
+
+// An output file mapped into memory, with its header already written and
+// 'pixels' pointing at where the body goes
+typedef struct pnmMap {
+    pixel* pixels;
+    void* base;
+    size_t size;
+} pnmMap;
+
 int writeHeader(pnmHeader header, FILE* outputFd);
-int writeBody(pnmHeader header, pixel* pixels, FILE* outputFd);
+// Formats the header into 'buffer' and returns its length, or -1
+int formatHeader(pnmHeader header, char* buffer, size_t size);
+// P3 bodies are formatted on 'threads' workers (0 uses every core, 1 formats
+// on the calling thread)
+int writeBody(pnmHeader header, const pixel* pixels, FILE* outputFd,
+    size_t threads);
+// Most bytes formatBody() can take for a P3 or P6 'header'
+size_t bodySizeMax(pnmHeader header);
+// Formats a P3 or P6 body into 'buffer', which must hold bodySizeMax()
+// bytes, and returns its length. Unlike writeBody(), the header is not
+// checked.
+size_t formatBody(pnmHeader header, const pixel* pixels, char* buffer);
+// Creates 'path' at its final size and maps it, so a P6 image can be rendered
+// straight into the file with no buffer of its own and no copy to write it
+int mapImage(const char* path, pnmHeader header, pnmMap* map);
+int unmapImage(pnmMap* map);
 
 #endif // CS430_PNM_WRITE_H